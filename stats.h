@@ -32,11 +32,54 @@ PERFSTAT_u64(n_hitlimit,	'c', "How many hit the rate limit", "times")
 PERFSTAT_u64(n_req,		'c', "N requests", "reqs")
 PERFSTAT_u64(n_httpok,		'c', "Successful HTTP request", "reqs")
 PERFSTAT_u64(n_httperror,	'c', "Failed HTTP request", "reqs")
+PERFSTAT_u64(n_pipereq,		'c', "Requests sent pipelined", "reqs")
+PERFSTAT_u64(n_pipedrop,	'c', "In-flight requests never answered",
+				     "reqs")
 PERFSTAT_u64(n_conntotal,	'c', "Total TCP connected", "conns")
+PERFSTAT_u64(n_tfo,		'c', "Conns sending the request in the SYN",
+				     "conns")
+PERFSTAT_u64(n_tfoaccepted,	'c', "Server took the data in our SYN", "conns")
+PERFSTAT_u64(n_tfofallback,	'c', "TFO tried, fell back to a handshake",
+				     "conns")
+PERFSTAT_u64(n_tls,		'c', "TLS handshakes done", "conns")
+PERFSTAT_u64(n_tlsresumed,	'c', "TLS sessions resumed", "conns")
+PERFSTAT_u64(n_tlserror,	'c', "TLS handshake or record errors", "times")
+PERFSTAT_u64(n_ktlstx,		'c', "Conns sending through kernel TLS",
+				     "conns")
+PERFSTAT_u64(n_ktlsrx,		'c', "Conns receiving through kernel TLS",
+				     "conns")
+PERFSTAT_u64(n_zcsend,		'c', "Request writes done with MSG_ZEROCOPY",
+				     "writes")
+PERFSTAT_u64(n_zccopied,	'c', "Zerocopy writes the kernel copied",
+				     "writes")
+PERFSTAT_u64(n_h2conn,		'c', "HTTP/2 conns started", "conns")
+PERFSTAT_u64(n_h2stream,	'c', "HTTP/2 streams opened", "streams")
+PERFSTAT_u64(n_h2rst,		'c', "HTTP/2 streams reset by the server",
+				     "streams")
+PERFSTAT_u64(n_h2goaway,	'c', "HTTP/2 GOAWAY received", "times")
+PERFSTAT_u64(n_h2proto,		'c', "HTTP/2 protocol errors", "times")
+PERFSTAT_u64(n_h2noalpn,	'c', "TLS server didn't agree on h2", "conns")
+PERFSTAT_u64(n_poolhit,		'c', "Request got an idle pooled conn", "times")
+PERFSTAT_u64(n_poolmiss,	'c', "Request had to connect", "times")
+PERFSTAT_u64(n_poolidle,	'g', "N idle conns in the pool", "conns")
+PERFSTAT_u64(n_poolreuse,	'c', "Conns parked in the pool for reuse",
+				     "conns")
+PERFSTAT_u64(n_poolevict,	'c', "Pooled conns closed as stale or old",
+				     "conns")
+PERFSTAT_u64(n_portspace,	'g', "Source ports usable per target", "ports")
+PERFSTAT_u64(n_portuse,		'g', "Source port space in use", "percent")
+PERFSTAT_u64(n_portretry,	'c', "Source port busy, tried the next one",
+				     "times")
+PERFSTAT_u64(n_closeactive,	'c', "Conns closed by us, not the server",
+				     "conns")
+PERFSTAT_u64(n_timewait,	'g', "Est. our conns in TIME_WAIT", "conns")
+PERFSTAT_u64(n_tcpinfo,		'c', "Conns sampled with TCP_INFO", "conns")
 PERFSTAT_u64(n_rxbytes,		'c', "Total bytes varnishperf got", "bytes")
 PERFSTAT_u64(n_txbytes,		'c', "Total bytes varnishperf send", "bytes")
 PERFSTAT_dbl(t_conntotal,	'c', "Total time used for connect(2)",
 				       "seconds")
+PERFSTAT_dbl(t_tlstotal,	'c', "Total time used for TLS handshakes",
+				       "seconds")
 PERFSTAT_dbl(t_fbtotal,		'c', "Total time used for waiting"
 				     " the first byte after sending HTTP"
 				     " request",
@@ -49,6 +92,27 @@ PERFSTAT_u64(n_resstraight,	'c', "straight response with Content-Length",
 PERFSTAT_u64(n_reschunked,	'c', "chunked response with Transfer-Encoding",
 				     "times")
 PERFSTAT_u64(n_reseof,		'c', "eof-style response", "times")
+PERFSTAT_u64(n_hdrgrow,		'c', "Response header outgrew its buffer",
+				     "times")
+
+/* Varnish */
+PERFSTAT_u64(n_vhit,		'c', "X-Varnish says it's a cache hit", "times")
+PERFSTAT_u64(n_vmiss,		'c', "X-Varnish says it's a miss or pass",
+				     "times")
+
+/* Our own overhead */
+PERFSTAT_u64(n_loop,		'c', "Worker event loop rounds", "loops")
+PERFSTAT_u64(n_loopev,		'c', "Events the worker loops handled",
+				     "events")
+PERFSTAT_dbl(t_loop,		'c', "Time worker loops spent on events",
+				     "seconds")
+PERFSTAT_dbl(t_evwait,		'c', "Time events waited for their turn",
+				     "seconds")
+PERFSTAT_dbl(t_cpuuser,		'c', "Worker CPU time in user mode",
+				     "seconds")
+PERFSTAT_dbl(t_cpusys,		'c', "Worker CPU time in the kernel",
+				     "seconds")
+PERFSTAT_u64(n_syscall,		'c', "Syscalls made by the workers", "calls")
 
 /* Response status */
 PERFSTAT_u64(n_status_0xx,	'c', "HTTP response status for 0XX", "times")
@@ -65,6 +129,8 @@ PERFSTAT_u64(n_status_9xx,	'c', "HTTP response status for 9XX", "times")
 /* Errors */
 PERFSTAT_u64(n_eof,		'c', "Unexpected EOF", "times")
 PERFSTAT_u64(n_eaddrinuse,	'c', "Address already in use", "times")
+PERFSTAT_u64(n_eaddrnotavail,	'c', "Source address and port used up",
+				     "times")
 PERFSTAT_u64(n_econnreset,	'c', "Connection reset by peer", "times")
 PERFSTAT_u64(n_econnrefused,	'c', "Connection refused", "times")
 PERFSTAT_u64(n_emfile,		'c', "Too many open files", "times")
@@ -72,3 +138,5 @@ PERFSTAT_u64(n_toolonghdr,	'c', "Too long HTTP response header", "times")
 PERFSTAT_u64(n_tooearlycrlf,	'c', "Too early CRLF", "times")
 PERFSTAT_u64(n_wrongres,	'c', "Wrong HTTP response format", "times")
 PERFSTAT_u64(n_wrongstatus,	'c', "Wrong status header", "times")
+PERFSTAT_u64(n_bodymismatch,	'c', "Response body failed the url checks",
+				     "times")
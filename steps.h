@@ -33,6 +33,7 @@ STEP(start,				START)
 STEP(http_start,			HTTP_START)
 STEP(http_wait,				HTTP_WAIT)
 STEP(http_connect,			HTTP_CONNECT)
+STEP(http_tls,				HTTP_TLS)
 STEP(http_txreq_init,			HTTP_TXREQ_INIT)
 STEP(http_txreq,			HTTP_TXREQ)
 STEP(http_rxresp,			HTTP_RXRESP)
@@ -43,6 +44,8 @@ STEP(http_rxresp_chunked_no,		HTTP_RXRESP_CHUNKED_NO)
 STEP(http_rxresp_chunked_body,		HTTP_RXRESP_CHUNKED_BODY)
 STEP(http_rxresp_chunked_crlf,		HTTP_RXRESP_CHUNKED_CRLF)
 STEP(http_rxresp_eof,			HTTP_RXRESP_EOF)
+STEP(h2_init,				H2_INIT)
+STEP(h2_io,				H2_IO)
 STEP(http_done,				HTTP_DONE)
 STEP(http_error,			HTTP_ERROR)
 STEP(http_ok,				HTTP_OK)
@@ -30,17 +30,25 @@
 #include <sys/param.h>
 #include <sys/epoll.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <arpa/inet.h>
+#include <linux/errqueue.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <math.h>
 #include <netdb.h>
 #include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -48,20 +56,34 @@
 #include <time.h>
 #include <unistd.h>
 
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
 #include "humanize_number.h"
 #include "miniobj.h"
 #include "vas.h"
 #include "vcallout.h"
 #include "vct.h"
+#include "vfind.h"
+#include "vhash.h"
+#include "vhist.h"
+#include "vhpack.h"
 #include "vlck.h"
 #include "vqueue.h"
 #include "vsb.h"
+#include "vsm.h"
+#include "vtim.h"
+#include "vtrace.h"
 
 #define VTCP_ADDRBUFSIZE	64
 #define VTCP_PORTBUFSIZE	16
 #define TIM_FORMAT_SIZE		30
 #define NEEDLESS_RETURN(foo)	return (foo)
 
+#ifndef RUSAGE_THREAD
+#define	RUSAGE_THREAD		1	/* Linux, hidden without _GNU_SOURCE */
+#endif
+
 struct parspec;
 struct worker;
 struct wq;
@@ -96,32 +118,75 @@ struct params {
 	unsigned		diag_bitmap;
 
 	unsigned		sess_workspace;
+	unsigned		http_resp_size;
 	unsigned		linger;
+	unsigned		tcp_fastopen;
+	unsigned		zerocopy_min;
+	unsigned		loop_lag_warn;
+
+	/* TLS */
+	unsigned		tls_resume;
+	unsigned		tls_ktls;
+
+	/* HTTP/2 */
+	unsigned		h2_window;
+
+	/* Source address */
+	unsigned		bind_no_port;
+	unsigned		src_port_lo;
+	unsigned		src_port_hi;
+
+	/* Keep-alive connection pool */
+	unsigned		pool_max_idle;
+	unsigned		pool_max_age;
+	unsigned		pool_max_reqs;
+
+	/* Request trace */
+	unsigned		tcpinfo_sample;
+	unsigned		trace_sample;
+	unsigned		trace_size;
 };
 static struct params		master;
 static struct params		*params;
 
 /*--------------------------------------------------------------------
- * XXX some variables are protected by ses_stat_mtx but others are
- * not.
+ * Latency phases, each kept in a per-worker histogram (usec).  Total
+ * runs from sending the request to the end of the response.
  */
 
-struct perfstat_1s {
-	uint32_t		n_conn;
-	double			t_conntotal;
-	double			t_connmin;
-	double			t_connmax;
-	uint32_t		n_fb;
-	double			t_fbtotal;
-	double			t_fbmin;
-	double			t_fbmax;
-	uint32_t		n_body;
-	double			t_bodytotal;
-	double			t_bodymin;
-	double			t_bodymax;
+enum lat_phase {
+	LAT_CONN = 0,
+	LAT_TLS,
+	LAT_FB,
+	LAT_BODY,
+	LAT_TOTAL,
+	LAT_N
+};
+static const char * const lat_name[LAT_N] = {
+	"connect", "tls handshake", "first byte", "body", "total"
 };
-static struct perfstat_1s	_perfstat_1s;
-static struct perfstat_1s	*VSC_C_1s = &_perfstat_1s;
+static struct vhist		lat_sum[LAT_N];
+
+/* What tcpinfo_sample keeps of a connection, per target */
+enum tcpi_key {
+	TCPI_RTT = 0,		/* usec */
+	TCPI_RTTVAR,		/* usec */
+	TCPI_RETRANS,		/* segments */
+	TCPI_CWND,		/* segments */
+	TCPI_RATE,		/* bytes per second */
+	TCPI_N
+};
+static const char * const tcpi_name[TCPI_N] = {
+	"rtt ms", "rttvar ms", "retrans", "cwnd", "rate Mbit/s"
+};
+
+/*
+ * Counters are sharded: VSC_C_main points at the calling thread's own
+ * copy, a worker's for the workers and _perfstat for the scheduler and
+ * main threads, so nobody shares a cache line or loses an increment.
+ * VSC_Merge() adds them up into VSC_C_sum for reporting.  n_conn and
+ * n_sess are limits we act on, so they live under ses_stat_mtx instead.
+ */
 
 struct perfstat {
 #define	PEFSTAT_STATUS_MAX	1000
@@ -134,7 +199,30 @@ struct perfstat {
 #undef PERFSTAT_u64
 };
 static struct perfstat		_perfstat;
-static struct perfstat		*VSC_C_main = &_perfstat;
+static __thread struct perfstat	*VSC_C_main = &_perfstat;
+static struct perfstat		_perfstat_sum;
+static struct perfstat		*VSC_C_sum = &_perfstat_sum;
+
+/*
+ * The same counters again for each url, target and source IP, plus
+ * what their requests took.  Each worker keeps a dense array of rows:
+ * urls first, then targets, then source IPs.
+ */
+
+struct bdstat {
+#define	PERFSTAT_u64(a, b, c, d)	uint64_t a;
+#define	PERFSTAT_dbl(a, b, c, d)	double a;
+#include "stats.h"
+#undef PERFSTAT_dbl
+#undef PERFSTAT_u64
+	uint64_t		n_lat[LAT_N];
+	double			t_lat[LAT_N];
+	double			t_latmin[LAT_N];
+	double			t_latmax[LAT_N];
+};
+static unsigned			bd_nrow;
+static unsigned			bd_srcbase;
+static struct bdstat		*bd_sum;
 
 /*--------------------------------------------------------------------*/
 
@@ -158,16 +246,134 @@ struct vss_addr {
 	struct sockaddr_storage	 va_addr;
 };
 
+/*--------------------------------------------------------------------
+ * A target is one address we connect to.  It keeps the idle keep-alive
+ * connections to it, so any request for the same address can pick one
+ * up, whichever url or session it comes from.
+ */
+
+struct vconn {
+	unsigned		magic;
+#define	VCONN_MAGIC		0x4a7c0e15
+	int			fd;
+	SSL			*ssl;
+	struct h2conn		*h2;
+	unsigned		nreq;		/* requests so far */
+	uint64_t		t_open;
+	int			srcidx;
+	VTAILQ_ENTRY(vconn)	list;
+};
+
+struct target {
+	unsigned		magic;
+#define	TARGET_MAGIC		0x7d2b61a9
+	struct vss_addr		*vaddr;
+	char			name[128];	/* [addr]:port or unix:path */
+	unsigned		bdidx;
+	unsigned		tls;
+	const char		*sni;
+	unsigned		h2;
+	struct lock		mtx;
+	SSL_SESSION		*tls_sess;	/* to resume, under mtx */
+	VTAILQ_HEAD(vconnhead, vconn) idle;	/* most recent first */
+	unsigned		nidle;
+	VTAILQ_HEAD(, vconn)	spare;
+	VTAILQ_ENTRY(target)	list;
+};
+static VTAILQ_HEAD(targethead, target) targets = VTAILQ_HEAD_INITIALIZER(targets);
+
+/*--------------------------------------------------------------------
+ * Request templates.  Slots like ${seq} are left alone by the macros
+ * and the request is kept as static text with slots in between.  The
+ * slots are filled for every request and go out as iovecs of their own
+ * next to the static text, which is never copied.
+ */
+
+struct tslot {
+	unsigned		type;
+#define	TSLOT_SEQ		1
+#define	TSLOT_RAND		2
+#define	TSLOT_WORKER		3
+#define	TSLOT_REQID		4
+#define	TSLOT_LIST		5
+	uint64_t		lo;		/* rand */
+	uint64_t		hi;		/* rand; seq modulus, or 0 */
+	char			**list;
+	unsigned		nlist;
+	unsigned		maxlen;
+};
+
+struct tseg {
+	char			*p;		/* static text before slot */
+	size_t			len;
+	struct tslot		*slot;		/* NULL after the last one */
+};
+
+struct tmpl {
+	struct tseg		*seg;
+	unsigned		nseg;
+	unsigned		nslot;
+	unsigned		flags;
+#define	TMPL_F_SEQ		(1 << 0)
+#define	TMPL_F_REQID		(1 << 1)
+	size_t			statlen;
+	size_t			slotlen;	/* every slot at its longest */
+#define	TMPL_MAXLEN		8192
+};
+
+/* What all slots of one request share */
+struct treq {
+	uint64_t		seq;
+	uint64_t		reqid;
+};
+
 struct url {
 	unsigned		magic;
 #define	URL_MAGIC		0x3178c2cb
 
+	const char		*label;
+	unsigned		bdidx;
 	struct vsb		*vsb;
-	struct vss_addr		**vaddr;
+	struct tmpl		*tmpl;		/* if vsb has slots */
+	unsigned		tflags;		/* of all its templates */
+	uint64_t		*tseq;		/* next ${seq}, own line */
+	struct vss_addr		**vaddr;	/* of every -connect */
+	unsigned		*weight;
 	int			nvaddr;
 
-	char			addr[VTCP_ADDRBUFSIZE];
-	char			port[VTCP_PORTBUFSIZE];
+	/*
+	 * Sessions go round sched, which lists each address in tgts as
+	 * many times as its weight, spread out.  Each worker keeps its
+	 * own place in it (worker->rr).
+	 */
+	struct target		**tgts;
+	unsigned		*sched;
+	unsigned		nsched;
+
+	/* Response body checks */
+	unsigned		vflags;
+#define	URL_V_LEN		(1 << 0)
+#define	URL_V_HASH		(1 << 1)
+#define	URL_V_SYNTH		(1 << 2)
+	ssize_t			vlen;
+	enum vhash_type		vhtype;
+	uint64_t		vdigest;
+
+	unsigned		pipeline;	/* requests in flight per conn */
+#define	URL_PIPELINE_MAX	64
+
+	unsigned		tls;
+	const char		*sni;
+
+	/* HTTP/2: the request as header fields, pseudo-headers first */
+	unsigned		h2;
+	unsigned		streams;	/* concurrent streams per conn */
+#define	URL_STREAMS_MAX		1024
+	struct h2field		*h2f;
+	int			nh2f;
+	size_t			h2hdrlen;	/* worst case HPACK size */
+	char			*body;		/* read-only pages */
+	size_t			bodylen;
 
 	VTAILQ_ENTRY(url)	list;
 };
@@ -175,6 +381,15 @@ static VTAILQ_HEAD(, url)	url_list = VTAILQ_HEAD_INITIALIZER(url_list);
 static struct url		**urls;
 static int			num_urls;
 
+static SSL_CTX			*tls_ctx;	/* if any url has -tls */
+
+/*
+ * One period of what synth_body() generates without randomness: 93
+ * lines of 64 bytes, each starting one character later than the last.
+ */
+#define	SYNTH_PERIOD		(93 * 64)
+static char			*synth_pat;
+
 struct srcip {
 	char			*ip;
 	struct sockaddr_storage sockaddr;
@@ -200,6 +415,27 @@ typedef struct {
 	char			*e;
 } txt;
 
+/*--------------------------------------------------------------------
+ * Well-known response headers
+ */
+
+enum hdr {
+#define HDR(n, u)	HDR_##u,
+#include "hdrs.h"
+#undef HDR
+	HDR__MAX
+};
+
+/*--------------------------------------------------------------------
+ * Body check state of the response being received
+ */
+
+struct bodychk {
+	struct vhash		vh;
+	ssize_t			vbytes;		/* body bytes checked */
+	unsigned		vbad;
+};
+
 /*--------------------------------------------------------------------
  * HTTP Protocol connection structure
  */
@@ -209,10 +445,94 @@ struct http_conn {
 #define HTTP_CONN_MAGIC		0x3e19edd1
 
 	int			fd;
+	SSL			*ssl;
 	unsigned		maxbytes;
 	struct ws		*ws;
+	struct hbuf		*hb;		/* rxbuf if it outgrew ws */
+	char			*lim;		/* end of rxbuf space */
 	txt			rxbuf;
 	txt			pipeline;
+
+	/*
+	 * Response header parser state.  The header is parsed line by line
+	 * as bytes arrive so a read never rescans what was already seen.
+	 */
+	char			*lp;		/* start of the current line */
+	char			*hp;		/* next byte to be scanned */
+#define	MAXHDR			64
+	char			*hdr[MAXHDR];
+	int			nhdr;
+	char			*hval[HDR__MAX];	/* values */
+	int			status;
+	ssize_t			cl;
+	unsigned		hflags;
+#define	HTC_F_CL		(1 << 0)	/* Content-Length seen */
+#define	HTC_F_CHUNKED		(1 << 1)	/* Transfer-Encoding: chunked */
+#define	HTC_F_CLOSE		(1 << 2)	/* no keep-alive */
+};
+
+/*--------------------------------------------------------------------
+ * HTTP/2 connection.  It lives as long as the TCP connection and goes
+ * to the pool with it, as the HPACK tables and the windows have to.
+ * Stream slots are indexed by stream ID, so a lookup is one compare.
+ */
+
+struct h2field {
+	char			*name;
+	size_t			nlen;
+	char			*val;
+	size_t			vlen;
+	struct tmpl		*t;		/* if val has slots */
+};
+
+struct h2stream {
+	uint32_t		id;		/* 0 if the slot is free */
+	unsigned		flags;
+#define	H2S_F_HDR		(1 << 0)	/* final header is in */
+#define	H2S_F_VHIT		(1 << 1)
+#define	H2S_F_VMISS		(1 << 2)
+	int			status;
+	int64_t			swin;		/* send window */
+	size_t			boff;		/* request body sent */
+	uint32_t		rxunacked;
+	uint64_t		t_start;
+	uint64_t		t_hdr;
+	struct bodychk		bc;
+};
+
+struct h2conn {
+	unsigned		magic;
+#define	H2CONN_MAGIC		0x6e2f1a43
+	unsigned		flags;
+#define	H2_F_SETTINGS		(1 << 0)	/* got the peer's SETTINGS */
+#define	H2_F_GOAWAY		(1 << 1)
+	uint32_t		next_id;
+	uint32_t		peer_maxstreams;
+	uint32_t		peer_maxframe;
+	int32_t			peer_initwin;
+	int64_t			cwin;		/* connection send window */
+	uint32_t		crxunacked;
+	struct vhpack		*enc;
+	struct vhpack		*dec;
+
+	/* Header block being put together from HEADERS + CONTINUATION */
+	uint32_t		hb_id;
+	unsigned		hb_end;		/* HEADERS had END_STREAM */
+	unsigned char		*hb;
+	size_t			hblen;
+	size_t			hbsize;
+
+	unsigned char		*rx;
+	size_t			rxlen;
+	unsigned char		*tx;
+	size_t			txoff;
+	size_t			txlen;
+	size_t			txsize;
+
+	struct h2stream		*st;
+	unsigned		nst;		/* slots, a power of 2 */
+	unsigned		nactive;
+	unsigned		nbody;		/* streams with body to send */
 };
 
 /*--------------------------------------------------------------------
@@ -246,13 +566,29 @@ struct sess {
 #define SESS_MAGIC		0x2c2f9c5a
 	unsigned		flags;
 #define	SESS_F_EOF		(1 << 0)
+#define	SESS_F_NOREUSE		(1 << 1)	/* don't pool the conn */
+#define	SESS_F_TFO		(1 << 2)	/* request goes in the SYN */
+#define	SESS_F_ZC		(1 << 3)	/* SO_ZEROCOPY is on */
 	struct worker		*wrk;
+	int			srcidx;		/* srcips[] we bound, or -1 */
+	int			err;		/* errno of this request */
 
 	enum step		prevstep;
 	enum step		step;
 	int			fd;
+	SSL			*ssl;
+	struct h2conn		*h2;
 
 	int			calls;
+	unsigned		conn_nreq;	/* requests on this conn */
+	unsigned		nbatch;		/* requests in this write */
+	unsigned		npending;	/* responses still owed */
+	unsigned		zc_pending;	/* MSG_ZEROCOPY not done yet */
+	ssize_t			wlen;		/* bytes in this write */
+	uint16_t		*tlen;		/* slot values of the batch */
+	char			*tval;
+	uint64_t		t_txbatch;
+	uint64_t		t_connopen;
 
 #ifdef VARNISHPERF_DEBUG
 #define	STEPHIST_MAX		64
@@ -261,6 +597,7 @@ struct sess {
 #endif
 
 	struct url		*url;
+	struct target		*tgt;
 
 	socklen_t		mysockaddrlen;
 	struct sockaddr_storage	*mysockaddr;
@@ -272,21 +609,24 @@ struct sess {
 	ssize_t			woffset;
 	struct http_conn	htc;
 #define	SESS_NOBUFSIZ		32
-	char			*nobuf;		/* For chunked-encoding */
+	char			nobuf[SESS_NOBUFSIZ];	/* For chunked-encoding */
 	ssize_t			nooffset;
 	ssize_t			no;
 	struct ws		ws[1];
-#define	MAXHDR			64
-	char			*resphdr[MAXHDR];
 
-	double			t_start;
-	double			t_done;
-	double			t_connstart;
-	double			t_connend;
-	double			t_fbstart;
-	double			t_fbend;
-	double			t_bodystart;
-	double			t_bodyend;
+	struct bodychk		bc;
+
+	/* VTIM_mono(), 0 until it happens */
+	uint64_t		t_start;
+	uint64_t		t_done;
+	uint64_t		t_connstart;
+	uint64_t		t_connend;
+	uint64_t		t_tlsstart;
+	uint64_t		t_tlsend;
+	uint64_t		t_fbstart;
+	uint64_t		t_fbend;
+	uint64_t		t_bodystart;
+	uint64_t		t_bodyend;
 
 	struct sessmem		*mem;
 	VTAILQ_ENTRY(sess)	poollist;
@@ -319,6 +659,26 @@ static struct lock		ses_mem_mtx;
 static struct lock		ses_stat_mtx;
 static volatile uint64_t	n_sess_grab = 0;
 static uint64_t			n_sess_rel = 0;
+static uint64_t			n_conn = 0;
+
+/*--------------------------------------------------------------------
+ * Buffers for response headers which don't fit into the session
+ * workspace.  They come in power of 2 sizes from HBF_MINSIZE up and are
+ * cached per worker so a steady stream of big headers doesn't malloc.
+ */
+
+struct hbuf {
+	unsigned		magic;
+#define	HBUF_MAGIC		0x1b5e9f3d
+	unsigned		size;
+	int			cls;
+	VTAILQ_ENTRY(hbuf)	list;
+	char			*data;
+};
+
+#define	HBF_MINSIZE		8192
+#define	HBF_NCLASS		8		/* 8k .. 1m */
+#define	HBF_MAXFREE		16		/* cached per class */
 
 /*--------------------------------------------------------------------*/
 
@@ -331,11 +691,85 @@ struct worker {
 	int			nwant;
 	pthread_t		owner;
 	int			queue[2];
+	VTAILQ_HEAD(, hbuf)	hbf_free[HBF_NCLASS];
+	int			hbf_nfree[HBF_NCLASS];
+
+	struct vhist		*lat;	/* [LAT_N], only we write */
+	struct bdstat		*bd;	/* [bd_nrow] */
+	struct vhist		*tcpi;	/* [target][TCPI_N] */
+	unsigned		*rr;	/* [num_urls], url->sched cursor */
+	unsigned		ntcpi;
+
+	/* -T ring, see vtrace.h */
+	struct vtrace_hdr	*tr;
+	struct vtrace_rec	*trrec;
+	size_t			trlen;
+	uint64_t		trpos;
+	unsigned		trskip;
+	uint32_t		trseq;
+
+	/* Template slots */
+	unsigned		id;
+	uint64_t		rng;
+	uint64_t		nreqid;
+
+	/* This worker's share of the source (IP, port) space */
+	unsigned		bind_next;
+	unsigned		port_lo;
+	unsigned		port_hi;
+
 	VTAILQ_ENTRY(worker)	list;
+
+	/* Our own overhead */
+	uint64_t		t_ru;		/* last getrusage(2) */
+	uint64_t		lagmax;		/* usec, SCH_stat() resets it */
+
+	/* Our counter shard, odd stat_seq while we're changing it */
+	unsigned		stat_seq __attribute__((aligned(64)));
+	struct perfstat		stat;
 };
 static VTAILQ_HEAD(, worker)	workers = VTAILQ_HEAD_INITIALIZER(workers);
 static struct lock		workers_mtx;
 
+/*
+ * Counters go through these so the running session's url, target and
+ * source IP rows see them too.
+ */
+
+static __thread struct bdstat	*VSC_C_bd;
+static __thread struct sess	*VSC_C_sp;
+
+static inline int
+vsc_rows(const struct sess *sp, struct bdstat **r)
+{
+	int n = 0;
+
+	if (sp == NULL || VSC_C_bd == NULL)
+		return (0);
+	if (sp->url != NULL)
+		r[n++] = &VSC_C_bd[sp->url->bdidx];
+	if (sp->tgt != NULL)
+		r[n++] = &VSC_C_bd[sp->tgt->bdidx];
+	if (sp->srcidx >= 0)
+		r[n++] = &VSC_C_bd[bd_srcbase + sp->srcidx];
+	return (n);
+}
+
+#define	VSC_ADD(f, v)	do {						\
+	__typeof__(VSC_C_main->f) _v = (v);				\
+	struct bdstat *_r[3];						\
+	int _i, _n = vsc_rows(VSC_C_sp, _r);				\
+									\
+	VSC_C_main->f += _v;						\
+	for (_i = 0; _i < _n; _i++)					\
+		_r[_i]->f += _v;					\
+} while (0)
+#define	VSC_INC(f)	VSC_ADD(f, 1)
+#define	VSC_DEC(f)	VSC_ADD(f, -1)
+
+/* One more syscall; a call into OpenSSL counts as one too */
+#define	VSC_SYS()	(VSC_C_main->n_syscall++)
+
 /*--------------------------------------------------------------------*/
 
 /*
@@ -371,6 +805,14 @@ static int	z_flag = 0;
  * Boot-up time from TIM_real().
  */
 static double	boottime;
+/*
+ * Add to a VTIM_mono() reading to get it in CLOCK_REALTIME.
+ */
+static uint64_t	tim_mono2real;
+/*
+ * When this worker's epoll_wait(2) returned, 0 outside of its loop.
+ */
+static __thread uint64_t	wrk_tbatch;
 /*
  * Default value is 0 but 1 if SIGINT is delivered.
  */
@@ -379,14 +821,20 @@ static int	verbose;
 
 static void	EVT_Add(struct worker *wrk, int want, int fd, void *arg);
 static void	EVT_Del(struct worker *wrk, int fd);
+static void	H2_Free(struct h2conn *h2);
 static void	SES_Acct(struct sess *sp);
+static void	SES_AcctReq(struct sess *sp, int status, ssize_t bytes);
 static void	SES_Delete(struct sess *sp);
 static void	SES_Rush(void);
 static int	SES_Schedule(struct sess *sp);
 static void	SES_Sleep(struct sess *sp);
 static void	SES_Wait(struct sess *sp, int want);
 static void	SES_errno(int error);
+static uint64_t	TIM_batch(void);
 static double	TIM_real(void);
+static void	TRC_Req(struct sess *sp, int status, ssize_t bytes);
+static int	VSS_resolve(const char *addr, const char *port,
+		    struct vss_addr ***vap);
 
 /*--------------------------------------------------------------------*/
 
@@ -452,28 +900,6 @@ WS_Assert(const struct ws *ws)
 	}
 }
 
-static char *
-WS_Alloc(struct ws *ws, unsigned bytes)
-{
-	char *r;
-
-	WS_Assert(ws);
-	bytes = PRNDUP(bytes);
-
-	assert(ws->r == NULL);
-	if (ws->f + bytes > ws->e) {
-		ws->overflow++;
-		WS_Assert(ws);
-		return(NULL);
-	}
-	r = ws->f;
-	ws->f += bytes;
-	if (params->diag_bitmap & 0x8)
-		fprintf(stdout, "WS_Alloc(%p, %u) = %p", ws, bytes, r);
-	WS_Assert(ws);
-	return (r);
-}
-
 static unsigned
 WS_Reserve(struct ws *ws, unsigned bytes)
 {
@@ -591,6 +1017,7 @@ VTCP_nonblocking(int sock)
 	int i, j;
 
 	i = 1;
+	VSC_SYS();
 	j = ioctl(sock, FIONBIO, &i);
 	VTCP_Assert(j);
 	return (j);
@@ -624,142 +1051,710 @@ VTCP_name(const struct sockaddr_storage *addr, unsigned l,
 	}
 }
 
-/*--------------------------------------------------------------------*/
+/*--------------------------------------------------------------------
+ * TLS.  SSL_read() and SSL_write() failures are turned into what
+ * read(2) and write(2) would have said, so the rest of the code only
+ * ever waits on EAGAIN.  As everything reads until EAGAIN before it
+ * waits, nothing is left stranded in OpenSSL's buffers.
+ */
 
-static void
-vca_close_session(struct sess *sp, const char *why)
+static ssize_t
+tls_ioerr(SSL *ssl, int i)
+{
+
+	switch (SSL_get_error(ssl, i)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		errno = EAGAIN;
+		return (-1);
+	case SSL_ERROR_ZERO_RETURN:
+		return (0);
+	case SSL_ERROR_SYSCALL:
+		if (errno == 0)
+			errno = ECONNRESET;
+		return (-1);
+	default:
+		VSC_INC(n_tlserror);
+		ERR_clear_error();
+		errno = EPROTO;
+		return (-1);
+	}
+}
+
+static ssize_t
+htc_read(const struct http_conn *htc, void *p, size_t len)
 {
 	int i;
 
-	(void)why;
+	VSC_SYS();
+	if (htc->ssl == NULL)
+		return (read(htc->fd, p, len));
+	ERR_clear_error();
+	i = SSL_read(htc->ssl, p, MIN(len, INT_MAX));
+	if (i > 0)
+		return (i);
+	return (tls_ioerr(htc->ssl, i));
+}
 
-	if (sp->fd >= 0) {
-		i = close(sp->fd);
-		assert(i == 0 || errno != EBADF);	/* XXX EINVAL seen */
-	}
-	sp->fd = -1;
+static ssize_t
+ses_read(const struct sess *sp, void *p, size_t len)
+{
+	int i;
+
+	VSC_SYS();
+	if (sp->ssl == NULL)
+		return (read(sp->fd, p, len));
+	ERR_clear_error();
+	i = SSL_read(sp->ssl, p, MIN(len, INT_MAX));
+	if (i > 0)
+		return (i);
+	return (tls_ioerr(sp->ssl, i));
 }
 
-/*--------------------------------------------------------------------
- * Check if we have a complete HTTP request or response yet
- *
- * Return values:
- *	 0  No, keep trying
- *	>0  Yes, it is this many bytes long.
+/*
+ * Like writev(2).  Over TLS small iovecs are gathered into one record's
+ * worth before each SSL_write(), so a templated request doesn't go out
+ * as a record per segment.  A retry after SSL_ERROR_WANT_WRITE gathers
+ * the same bytes again, as OpenSSL wants.
  */
 
-static int
-htc_header_complete(txt *t)
+#define	SES_TLSREC		16384
+
+static __thread char		ses_tlsbuf[SES_TLSREC];
+
+static ssize_t
+ses_writev(const struct sess *sp, const struct iovec *iov, int n)
 {
-	const char *p;
+	const char *b;
+	ssize_t l;
+	size_t len, o, c;
+	int i, j;
 
-	Tcheck(*t);
-	assert(*t->e == '\0');
-	/* Skip any leading white space */
-	for (p = t->b ; vct_issp(*p); p++)
-		continue;
-	if (p == t->e) {
-		/* All white space */
-		t->e = t->b;
-		*t->e = '\0';
-		return (0);
+	if (sp->ssl == NULL) {
+		VSC_SYS();
+		if (n == 1)
+			return (write(sp->fd, iov[0].iov_base, iov[0].iov_len));
+		return (writev(sp->fd, iov, n));
 	}
-	while (1) {
-		p = strchr(p, '\n');
-		if (p == NULL)
-			return (0);
-		p++;
-		if (*p == '\r')
-			p++;
-		if (*p == '\n')
+	for (j = 0, o = 0, l = 0; j < n; ) {
+		if (iov[j].iov_len == 0) {
+			j++;
+			continue;
+		}
+		if (o == 0 && (j + 1 == n || iov[j].iov_len >= SES_TLSREC)) {
+			b = iov[j].iov_base;
+			len = iov[j++].iov_len;
+		} else {
+			/* iov[j] from byte o on, then the next ones */
+			for (len = 0; j < n && len < SES_TLSREC; ) {
+				c = MIN(iov[j].iov_len - o, SES_TLSREC - len);
+				memcpy(ses_tlsbuf + len,
+				    (const char *)iov[j].iov_base + o, c);
+				len += c;
+				o += c;
+				if (o == iov[j].iov_len) {
+					j++;
+					o = 0;
+				}
+			}
+			b = ses_tlsbuf;
+		}
+		ERR_clear_error();
+		VSC_SYS();
+		i = SSL_write(sp->ssl, b, len);
+		if (i <= 0) {
+			if (l > 0)
+				break;
+			l = tls_ioerr(sp->ssl, i);
+			if (l == 0) {
+				errno = EPIPE;
+				l = -1;
+			}
+			return (l);
+		}
+		l += i;
+		if (i < len)
 			break;
 	}
-	p++;
-	return (p - t->b);
+	return (l);
 }
 
-/*--------------------------------------------------------------------*/
+/*
+ * A new session ticket.  It's kept per target, so the next handshake
+ * to the same place resumes no matter which session made this one.
+ */
+
+static int
+tls_newsess(SSL *ssl, SSL_SESSION *sess)
+{
+	struct target *tgt;
+
+	CAST_OBJ_NOTNULL(tgt, SSL_get_app_data(ssl), TARGET_MAGIC);
+	Lck_Lock(&tgt->mtx);
+	if (tgt->tls_sess != NULL)
+		SSL_SESSION_free(tgt->tls_sess);
+	tgt->tls_sess = sess;
+	Lck_Unlock(&tgt->mtx);
+	return (1);		/* we keep the reference */
+}
 
 static void
-HTC_Init(struct http_conn *htc, struct ws *ws, int fd, unsigned maxbytes)
+tls_free(SSL *ssl, int clean)
 {
 
-	htc->magic = HTTP_CONN_MAGIC;
-	htc->ws = ws;
-	htc->fd = fd;
-	htc->maxbytes = maxbytes;
+	if (ssl == NULL)
+		return;
+	if (clean) {
+		VSC_SYS();
+		(void)SSL_shutdown(ssl);	/* close_notify, no wait */
+	}
+	SSL_free(ssl);
+	ERR_clear_error();
+}
 
-	(void)WS_Reserve(htc->ws, htc->maxbytes);
-	htc->rxbuf.b = ws->f;
-	htc->rxbuf.e = ws->f;
-	*htc->rxbuf.e = '\0';
-	htc->pipeline.b = NULL;
-	htc->pipeline.e = NULL;
+static void
+TLS_Init(void)
+{
+	static const unsigned char alpn[] = "\x08http/1.1";
+
+	tls_ctx = SSL_CTX_new(TLS_client_method());
+	XXXAN(tls_ctx);
+	/* A load generator has no business checking certificates. */
+	SSL_CTX_set_verify(tls_ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+	    SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+	/* EOF without close_notify ends an EOF body, like cleartext */
+	SSL_CTX_set_options(tls_ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+	AZ(SSL_CTX_set_alpn_protos(tls_ctx, alpn, sizeof(alpn) - 1));
+	if (params->tls_resume) {
+		SSL_CTX_set_session_cache_mode(tls_ctx,
+		    SSL_SESS_CACHE_CLIENT | SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(tls_ctx, tls_newsess);
+	} else {
+		SSL_CTX_set_session_cache_mode(tls_ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(tls_ctx, SSL_OP_NO_TICKET);
+	}
+	if (params->tls_ktls) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+#else
+		fprintf(stdout, "[INFO] OpenSSL has no kTLS, "
+		    "tls_ktls is ignored\n");
+#endif
+	}
 }
 
-/*--------------------------------------------------------------------
- * Return 1 if we have a complete HTTP procol header
- */
+/*--------------------------------------------------------------------*/
 
-static int
-HTC_Complete(struct http_conn *htc)
+static void
+vca_close_session(struct sess *sp, const char *why)
 {
 	int i;
 
-	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
-	i = htc_header_complete(&htc->rxbuf);
-	assert(i >= 0);
-	if (i == 0)
-		return (0);
-	WS_ReleaseP(htc->ws, htc->rxbuf.e);
-	AZ(htc->pipeline.b);
-	AZ(htc->pipeline.e);
-	if (htc->rxbuf.b + i < htc->rxbuf.e) {
-		htc->pipeline.b = htc->rxbuf.b + i;
-		htc->pipeline.e = htc->rxbuf.e;
-		htc->rxbuf.e = htc->pipeline.b;
+	(void)why;
+
+	tls_free(sp->ssl, 0);
+	sp->ssl = NULL;
+	H2_Free(sp->h2);
+	sp->h2 = NULL;
+	if (sp->fd >= 0) {
+		VSC_SYS();
+		i = close(sp->fd);
+		assert(i == 0 || errno != EBADF);	/* XXX EINVAL seen */
 	}
-	return (1);
+	sp->fd = -1;
 }
 
 /*--------------------------------------------------------------------
- * Receive more HTTP protocol bytes
+ * Split the status line into PROTO, STATUS and MSG.
  */
 
 static int
-HTC_Rx(struct http_conn *htc)
+htc_parse_status(struct http_conn *htc, char *p)
 {
-	int i;
+	char *end;
+	long l;
 
-	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
-	AN(htc->ws->r);
-	i = (htc->ws->r - htc->rxbuf.e) - 1;	/* space for NUL */
-	if (i <= 0) {
-		WS_ReleaseP(htc->ws, htc->rxbuf.b);
+	while (vct_issp(*p))
+		p++;
+	htc->hdr[0] = p;
+	while (*p != '\0' && !vct_issp(*p))
+		p++;
+	if (*p == '\0') {
+		VSC_INC(n_tooearlycrlf);
+		fprintf(stdout, "[ERROR] too early CRLF after PROTO\n");
 		return (-1);
 	}
-	i = read(htc->fd, htc->rxbuf.e, i);
-	if (i == -1) {
-		if (errno != EAGAIN)
-			WS_ReleaseP(htc->ws, htc->rxbuf.b);
-		return (-2);
+	*p++ = '\0';
+	if (!strcmp(htc->hdr[0], "HTTP/1.0"))
+		htc->hflags |= HTC_F_CLOSE;
+
+	/* STATUS */
+	while (vct_issp(*p))		/* XXX: H space only */
+		p++;
+	if (*p == '\0') {
+		VSC_INC(n_tooearlycrlf);
+		fprintf(stdout, "[ERROR] too early CRLF after STATUS\n");
+		return (-1);
 	}
-	if (i == 0) {
-		WS_ReleaseP(htc->ws, htc->rxbuf.b);
-		return (-3);
+	htc->hdr[1] = p;
+	while (*p != '\0' && !vct_issp(*p))
+		p++;
+	if (*p == '\0')
+		htc->hdr[2] = NULL;
+	else {
+		*p++ = '\0';
+		/* MSG */
+		while (vct_issp(*p))	/* XXX: H space only */
+			p++;
+		htc->hdr[2] = p;
 	}
-	VSC_C_main->n_rxbytes += i;
-	htc->rxbuf.e += i;
-	*htc->rxbuf.e = '\0';
-	return (HTC_Complete(htc));
+	htc->nhdr = 3;
+
+	errno = 0;
+	l = strtol(htc->hdr[1], &end, 10);
+	if (errno != 0 || *end != '\0' || l < 0 || l > INT_MAX) {
+		VSC_INC(n_wrongstatus);
+		fprintf(stdout, "[ERROR] wrong status header\n");
+		return (-1);
+	}
+	htc->status = (int)l;
+	return (0);
 }
 
 /*--------------------------------------------------------------------
- * Read up to len bytes, returning pipelined data first.
+ * Index of the well-known headers, keyed by name length and a case
+ * folded hash of the name.  Filled once by HDR_Init().
  */
 
-static ssize_t
-HTC_Read(struct http_conn *htc, void *d, size_t len)
+#define	HDRTBL_SIZE		32	/* power of 2, > 2 * HDR__MAX */
+
+struct hdrtbl {
+	const char		*name;
+	unsigned		len;
+	unsigned		hash;
+	enum hdr		idx;
+};
+static struct hdrtbl		hdrtbl[HDRTBL_SIZE];
+
+static inline unsigned
+hdr_hash(const char *p, unsigned l)
+{
+	unsigned h = l;
+
+	while (l-- > 0)
+		h = h * 33 + (*p++ | 0x20);
+	return (h);
+}
+
+static void
+HDR_Init(void)
+{
+	static const char * const names[] = {
+#define HDR(n, u)	n,
+#include "hdrs.h"
+#undef HDR
+	};
+	struct hdrtbl *ht;
+	unsigned h, i, l;
+
+	for (i = 0; i < HDR__MAX; i++) {
+		l = strlen(names[i]);
+		h = hdr_hash(names[i], l);
+		ht = &hdrtbl[h & (HDRTBL_SIZE - 1)];
+		while (ht->name != NULL) {
+			if (++ht == &hdrtbl[HDRTBL_SIZE])
+				ht = hdrtbl;
+		}
+		ht->name = names[i];
+		ht->len = l;
+		ht->hash = h;
+		ht->idx = (enum hdr)i;
+	}
+}
+
+static int
+hdr_lookup(const char *p, unsigned l)
+{
+	const struct hdrtbl *ht;
+	unsigned h;
+
+	h = hdr_hash(p, l);
+	for (ht = &hdrtbl[h & (HDRTBL_SIZE - 1)]; ht->name != NULL; ) {
+		if (ht->hash == h && ht->len == l &&
+		    !strncasecmp(ht->name, p, l))
+			return (ht->idx);
+		if (++ht == &hdrtbl[HDRTBL_SIZE])
+			ht = hdrtbl;
+	}
+	return (-1);
+}
+
+/*--------------------------------------------------------------------
+ * Record a header line, index it if it's a well-known one and pick up
+ * the headers which drive the body fetch while we still have the line
+ * in cache.
+ */
+
+static int
+htc_parse_header(struct http_conn *htc, char *p, const char *e)
+{
+	char *end, *q, *v;
+	int i;
+
+	if (htc->nhdr >= MAXHDR - 1) {
+		VSC_INC(n_toolonghdr);
+		fprintf(stdout, "[ERROR] too long headers\n");
+		return (-1);
+	}
+	htc->hdr[htc->nhdr++] = p;
+	htc->hdr[htc->nhdr] = NULL;
+
+	q = VFIND_chr(p, e, ':');
+	if (q == NULL)
+		return (0);
+	i = hdr_lookup(p, q - p);
+	if (i < 0)
+		return (0);
+	for (v = q + 1; vct_issp(*v); v++)
+		continue;
+	for (end = p + (e - p); end > v && vct_islws(end[-1]); end--)
+		continue;
+	*end = '\0';
+	htc->hval[i] = v;
+
+	switch (i) {
+	case HDR_CONNECTION:
+		if (!strcasecmp(v, "close"))
+			htc->hflags |= HTC_F_CLOSE;
+		else if (!strcasecmp(v, "keep-alive"))
+			htc->hflags &= ~HTC_F_CLOSE;
+		break;
+	case HDR_CONTENT_LENGTH:
+		if (!vct_isdigit(*v))
+			return (-1);
+		errno = 0;
+		htc->cl = strtoul(v, &end, 10);
+		if (errno == ERANGE || *end != '\0')
+			return (-1);
+		htc->hflags |= HTC_F_CL;
+		break;
+	case HDR_TRANSFER_ENCODING:
+		if (!strcasecmp(v, "chunked"))
+			htc->hflags |= HTC_F_CHUNKED;
+		break;
+	default:
+		break;
+	}
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Value of a well-known header of the last response, or NULL.
+ */
+
+static inline const char *
+HTC_GetHdr(const struct http_conn *htc, enum hdr h)
+{
+
+	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
+	assert(h < HDR__MAX);
+	return (htc->hval[h]);
+}
+
+/*--------------------------------------------------------------------
+ * Check if we have a complete HTTP response yet.  Scanning resumes
+ * where the previous call stopped and every complete line is parsed
+ * once, as it is found.
+ *
+ * Return values:
+ *	-1  Malformed header
+ *	 0  No, keep trying
+ *	>0  Yes, it is this many bytes long.
+ */
+
+static int
+htc_header_complete(struct http_conn *htc)
+{
+	char *b, *p, *q;
+
+	Tcheck(htc->rxbuf);
+	assert(*htc->rxbuf.e == '\0');
+	b = htc->lp;
+	p = htc->hp;
+	while ((p = VFIND_chr(p, htc->rxbuf.e, '\n')) != NULL) {
+		q = p;
+		if (q > b && q[-1] == '\r')
+			q--;
+		if (q == b) {
+			if (htc->nhdr == 0) {
+				/* Skip any leading blank lines */
+				b = ++p;
+				continue;
+			}
+			htc->lp = htc->hp = ++p;
+			return (p - htc->rxbuf.b);
+		}
+		*q = '\0';
+		if (htc->nhdr == 0) {
+			if (htc_parse_status(htc, b))
+				return (-1);
+		} else if (htc_parse_header(htc, b, q))
+			return (-1);
+		b = ++p;
+	}
+	htc->lp = b;
+	htc->hp = htc->rxbuf.e;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Get a header buffer of at least len bytes from the worker's cache.
+ */
+
+static struct hbuf *
+HBF_Get(struct worker *wrk, unsigned len)
+{
+	struct hbuf *hb;
+	int cls;
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	for (cls = 0; (HBF_MINSIZE << cls) < len; cls++)
+		if (cls == HBF_NCLASS - 1)
+			return (NULL);
+	hb = VTAILQ_FIRST(&wrk->hbf_free[cls]);
+	if (hb != NULL) {
+		CHECK_OBJ_NOTNULL(hb, HBUF_MAGIC);
+		VTAILQ_REMOVE(&wrk->hbf_free[cls], hb, list);
+		wrk->hbf_nfree[cls]--;
+		return (hb);
+	}
+	hb = malloc(sizeof(*hb) + (HBF_MINSIZE << cls));
+	if (hb == NULL)
+		return (NULL);
+	hb->magic = HBUF_MAGIC;
+	hb->size = HBF_MINSIZE << cls;
+	hb->cls = cls;
+	hb->data = (char *)(hb + 1);
+	return (hb);
+}
+
+static void
+HBF_Put(struct worker *wrk, struct hbuf *hb)
+{
+
+	CHECK_OBJ_NOTNULL(wrk, WORKER_MAGIC);
+	CHECK_OBJ_NOTNULL(hb, HBUF_MAGIC);
+	if (wrk->hbf_nfree[hb->cls] >= HBF_MAXFREE) {
+		free(hb);
+		return;
+	}
+	VTAILQ_INSERT_HEAD(&wrk->hbf_free[hb->cls], hb, list);
+	wrk->hbf_nfree[hb->cls]++;
+}
+
+/*--------------------------------------------------------------------
+ * Move the partial header into a buffer twice as big, fixing up every
+ * pointer the parser keeps into it.
+ */
+
+static int
+htc_grow(struct http_conn *htc, struct worker *wrk)
+{
+	struct hbuf *hb;
+	ptrdiff_t d;
+	unsigned l;
+	int i;
+
+	l = 2 * pdiff(htc->rxbuf.b, htc->lim);
+	if (l < HBF_MINSIZE)
+		l = HBF_MINSIZE;
+	if (l > htc->maxbytes)
+		l = htc->maxbytes;
+	if (l <= pdiff(htc->rxbuf.b, htc->lim))
+		return (-1);
+	hb = HBF_Get(wrk, l);
+	if (hb == NULL)
+		return (-1);
+	VSC_INC(n_hdrgrow);
+
+	memcpy(hb->data, htc->rxbuf.b, Tlen(htc->rxbuf) + 1);
+	d = hb->data - htc->rxbuf.b;
+	for (i = 0; i < htc->nhdr; i++)
+		if (htc->hdr[i] != NULL)
+			htc->hdr[i] += d;
+	for (i = 0; i < HDR__MAX; i++)
+		if (htc->hval[i] != NULL)
+			htc->hval[i] += d;
+	htc->lp += d;
+	htc->hp += d;
+	htc->rxbuf.e += d;
+	if (htc->hb != NULL)
+		HBF_Put(wrk, htc->hb);
+	else
+		WS_ReleaseP(htc->ws, htc->rxbuf.b);
+	htc->rxbuf.b = hb->data;
+	htc->hb = hb;
+	htc->lim = hb->data + MIN(hb->size, htc->maxbytes);
+	return (0);
+}
+
+static void
+htc_rxrelease(struct http_conn *htc, char *p)
+{
+
+	if (htc->hb == NULL)
+		WS_ReleaseP(htc->ws, p);
+}
+
+/*--------------------------------------------------------------------
+ * The response header starts out in what's left of the session
+ * workspace and moves to a worker's header buffer only if it doesn't
+ * fit, up to maxbytes.
+ *
+ * Bytes the last response left in the pipeline belong to the next one
+ * and are moved to the start of the new rxbuf, which stays in the
+ * header buffer if the last one needed it.
+ */
+
+static void
+HTC_Init(struct http_conn *htc, struct ws *ws, int fd, SSL *ssl,
+    unsigned maxbytes)
+{
+	char *p = NULL;
+	size_t l = 0;
+
+	if (htc->magic == HTTP_CONN_MAGIC && htc->pipeline.b != NULL) {
+		p = htc->pipeline.b;
+		l = Tlen(htc->pipeline);
+	}
+	htc->magic = HTTP_CONN_MAGIC;
+	htc->ws = ws;
+	htc->fd = fd;
+	htc->ssl = ssl;
+	htc->maxbytes = maxbytes;
+
+	if (htc->hb != NULL) {
+		htc->lim = htc->hb->data + MIN(htc->hb->size, maxbytes);
+		htc->rxbuf.b = htc->hb->data;
+	} else {
+		(void)WS_Reserve(htc->ws, 0);
+		htc->lim = ws->r;
+		if (htc->lim > ws->f + maxbytes)
+			htc->lim = ws->f + maxbytes;
+		htc->rxbuf.b = ws->f;
+	}
+	assert(htc->rxbuf.b + l < htc->lim);
+	if (l > 0)
+		memmove(htc->rxbuf.b, p, l);
+	htc->rxbuf.e = htc->rxbuf.b + l;
+	*htc->rxbuf.e = '\0';
+	htc->pipeline.b = NULL;
+	htc->pipeline.e = NULL;
+
+	htc->lp = htc->hp = htc->rxbuf.b;
+	htc->hdr[0] = htc->hdr[1] = htc->hdr[2] = NULL;
+	htc->nhdr = 0;
+	memset(htc->hval, 0, sizeof(htc->hval));
+	htc->status = -1;
+	htc->cl = -1;
+	htc->hflags = 0;
+}
+
+/*--------------------------------------------------------------------
+ * Return 1 if we have a complete HTTP procol header, -1 if it's broken.
+ */
+
+static int
+HTC_Complete(struct http_conn *htc)
+{
+	int i;
+
+	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
+	i = htc_header_complete(htc);
+	if (i <= 0)
+		return (i);
+	htc_rxrelease(htc, htc->rxbuf.e);
+	AZ(htc->pipeline.b);
+	AZ(htc->pipeline.e);
+	if (htc->rxbuf.b + i < htc->rxbuf.e) {
+		htc->pipeline.b = htc->rxbuf.b + i;
+		htc->pipeline.e = htc->rxbuf.e;
+		htc->rxbuf.e = htc->pipeline.b;
+	}
+	return (1);
+}
+
+/*--------------------------------------------------------------------
+ * Receive more HTTP protocol bytes
+ */
+
+static int
+HTC_Rx(struct http_conn *htc, struct worker *wrk)
+{
+	int i;
+
+	CHECK_OBJ_NOTNULL(htc, HTTP_CONN_MAGIC);
+	AN(htc->hb != NULL || htc->ws->r != NULL);
+	if (htc->hp < htc->rxbuf.e) {
+		/* pipelined bytes carried over by HTC_Init() */
+		i = HTC_Complete(htc);
+		if (i != 0)
+			goto done;
+	}
+	i = (htc->lim - htc->rxbuf.e) - 1;	/* space for NUL */
+	if (i <= 0) {
+		if (htc_grow(htc, wrk)) {
+			htc_rxrelease(htc, htc->rxbuf.b);
+			return (-1);
+		}
+		i = (htc->lim - htc->rxbuf.e) - 1;
+		assert(i > 0);
+	}
+	i = htc_read(htc, htc->rxbuf.e, i);
+	if (i == -1) {
+		if (errno != EAGAIN)
+			htc_rxrelease(htc, htc->rxbuf.b);
+		return (-2);
+	}
+	if (i == 0) {
+		htc_rxrelease(htc, htc->rxbuf.b);
+		return (-3);
+	}
+	VSC_ADD(n_rxbytes, i);
+	htc->rxbuf.e += i;
+	*htc->rxbuf.e = '\0';
+	i = HTC_Complete(htc);
+done:
+	if (i < 0) {
+		htc_rxrelease(htc, htc->rxbuf.b);
+		return (-4);
+	}
+	return (i);
+}
+
+/*--------------------------------------------------------------------
+ * Done with the response; hand a header buffer back to the pool.
+ */
+
+static void
+HTC_Fini(struct http_conn *htc, struct worker *wrk)
+{
+
+	if (htc->hb == NULL)
+		return;
+	HBF_Put(wrk, htc->hb);
+	htc->hb = NULL;
+	htc->rxbuf.b = htc->rxbuf.e = NULL;
+	htc->pipeline.b = htc->pipeline.e = NULL;
+}
+
+/*--------------------------------------------------------------------
+ * Read up to len bytes, returning pipelined data first.
+ */
+
+static ssize_t
+HTC_Read(struct http_conn *htc, void *d, size_t len)
 {
 	size_t l;
 	unsigned char *p;
@@ -783,10 +1778,10 @@ HTC_Read(struct http_conn *htc, void *d, size_t len)
 	}
 	if (len == 0)
 		return (l);
-	i = read(htc->fd, p, len);
+	i = htc_read(htc, p, len);
 	if (i < 0)
 		return (i);
-	VSC_C_main->n_rxbytes += i;
+	VSC_ADD(n_rxbytes, i);
 	return (i + l);
 }
 
@@ -809,18 +1804,24 @@ static int
 cnt_timeout(struct sess *sp)
 {
 
-	VSC_C_main->n_timeout++;
+	VSC_INC(n_timeout);
+	sp->err = ETIMEDOUT;
 
 	switch (sp->prevstep) {
 	case STP_HTTP_CONNECT:
-		if (isnan(sp->t_connend))
-			sp->t_connend = TIM_real();
+		if (sp->t_connend == 0)
+			sp->t_connend = VTIM_mono();
+		sp->step = STP_HTTP_ERROR;
+		break;
+	case STP_HTTP_TLS:
+		if (sp->t_tlsend == 0)
+			sp->t_tlsend = VTIM_mono();
 		sp->step = STP_HTTP_ERROR;
 		break;
 	case STP_HTTP_TXREQ:
 	case STP_HTTP_RXRESP_HDR:
-		if (isnan(sp->t_fbend))
-			sp->t_fbend = TIM_real();
+		if (sp->t_fbend == 0)
+			sp->t_fbend = VTIM_mono();
 		sp->step = STP_HTTP_ERROR;
 		break;
 	case STP_HTTP_RXRESP_CL:
@@ -828,8 +1829,11 @@ cnt_timeout(struct sess *sp)
 	case STP_HTTP_RXRESP_CHUNKED_BODY:
 	case STP_HTTP_RXRESP_CHUNKED_CRLF:
 	case STP_HTTP_RXRESP_EOF:
-		if (isnan(sp->t_bodyend))
-			sp->t_bodyend = TIM_real();
+		if (sp->t_bodyend == 0)
+			sp->t_bodyend = VTIM_mono();
+		sp->step = STP_HTTP_ERROR;
+		break;
+	case STP_H2_IO:
 		sp->step = STP_HTTP_ERROR;
 		break;
 	default:
@@ -840,110 +1844,566 @@ cnt_timeout(struct sess *sp)
 }
 
 /*--------------------------------------------------------------------
- * The very first request
+ * Check that there is still something at the far end of a given socket.
+ * We poll the fd with instant timeout, if there are any events we can't
+ * use it (backends are not allowed to pipeline).
  */
 
 static int
-cnt_first(struct sess *sp)
+vbe_CheckFd(int fd)
 {
+	struct pollfd pfd;
 
-	sp->step = STP_START;
-	return (0);
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return (poll(&pfd, 1, 0) == 0);
 }
 
-/*--------------------------------------------------------------------
- * START
- * Handle a request.
+/*
+ * Over TLS the far end may send records which aren't data, such as the
+ * TLS 1.3 session tickets following the handshake.  Let OpenSSL eat
+ * those before deciding.
  */
 
 static int
-cnt_start(struct sess *sp)
+ses_CheckConn(int fd, SSL *ssl)
 {
-	static int cnt = 0;
+	char c;
+	int i;
 
-	callout_init(&sp->co, 0);
-	sp->url = urls[cnt++ % num_urls];
-	sp->t_start = TIM_real();
-	sp->t_connstart = NAN;
-	sp->t_connend = NAN;
-	sp->t_fbstart = NAN;
-	sp->t_fbend = NAN;
-	sp->t_bodystart = NAN;
-	sp->t_bodyend = NAN;
-	sp->t_done = NAN;
+	if (vbe_CheckFd(fd))
+		return (1);
+	if (ssl == NULL)
+		return (0);
+	ERR_clear_error();
+	VSC_SYS();
+	i = SSL_read(ssl, &c, 1);
+	if (i > 0 || SSL_get_error(ssl, i) != SSL_ERROR_WANT_READ) {
+		ERR_clear_error();
+		return (0);
+	}
+	return (vbe_CheckFd(fd));
+}
 
-	sp->step = STP_HTTP_START;
-	return (0);
+/*--------------------------------------------------------------------
+ * HTTP/2 connection state
+ */
+
+#define	H2_PREFACE		"PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define	H2_FRAMEHDR		9
+#define	H2_MAXFRAME		16384	/* SETTINGS_MAX_FRAME_SIZE we keep */
+#define	H2_RXBUF		(4 * (H2_FRAMEHDR + H2_MAXFRAME))
+#define	H2_DEFWIN		65535
+#define	H2_MAXWIN		0x7fffffff
+#define	H2_CONNWIN		(1 << 30)	/* our connection window */
+#define	H2_DEFSTREAMS		100	/* until the peer's SETTINGS */
+
+static struct h2conn *
+H2_New(void)
+{
+	struct h2conn *h2;
+
+	ALLOC_OBJ(h2, H2CONN_MAGIC);
+	XXXAN(h2);
+	h2->next_id = 1;
+	h2->peer_maxstreams = UINT32_MAX;
+	h2->peer_maxframe = H2_MAXFRAME;
+	h2->peer_initwin = H2_DEFWIN;
+	h2->cwin = H2_DEFWIN;
+	h2->enc = VHPACK_New(VHPACK_TABLESIZE);
+	h2->dec = VHPACK_New(VHPACK_TABLESIZE);
+	h2->rx = malloc(H2_RXBUF);
+	XXXAN(h2->rx);
+	return (h2);
 }
 
-static int
-cnt_http_start(struct sess *sp)
+static void
+H2_Free(struct h2conn *h2)
 {
 
-	/* XXX doesn't care for IPv6 at all */
-	sp->fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sp->fd == -1) {
-		SES_errno(errno);
-		if (params->diag_bitmap & 0x2)
-			fprintf(stdout, "[ERROR] socket(2) error: %d %s\n",
-			    errno, strerror(errno));
-		sp->step = STP_DONE;
-		return (0);
-	}
-	sp->step = STP_HTTP_WAIT;
-	return (0);
+	if (h2 == NULL)
+		return;
+	CHECK_OBJ_NOTNULL(h2, H2CONN_MAGIC);
+	VHPACK_Free(h2->enc);
+	VHPACK_Free(h2->dec);
+	free(h2->hb);
+	free(h2->rx);
+	free(h2->tx);
+	free(h2->st);
+	FREE_OBJ(h2);
 }
 
-/*--------------------------------------------------------------------
- * We want to get out of any kind of trouble-hit TCP connections as fast
- * as absolutely possible, so we set them LINGER enabled with zero timeout,
- * so that even if there are outstanding write data on the socket, a close(2)
- * will return immediately.
+/*
+ * An idle HTTP/2 connection may well have something to read, a PING or
+ * new SETTINGS; it's only gone if the far end closed it.
  */
-static const struct linger linger = {
-	.l_onoff	=	0,
-};
 
 static int
-cnt_http_wait(struct sess *sp)
+h2_CheckConn(int fd)
 {
-	struct srcip *sip;
-	int ret, val = 1;
-	static int no = 0;
+	char c;
+
+	if (vbe_CheckFd(fd))
+		return (1);
+	return (recv(fd, &c, 1, MSG_PEEK) > 0);
+}
+
+/*--------------------------------------------------------------------
+ * Connection pool
+ */
+
+static int
+tgt_usable(const struct vconn *vc, uint64_t now)
+{
+
+	if (vc->nreq >= params->pool_max_reqs)
+		return (0);
+	if (VTIM_dur(vc->t_open, now) >= params->pool_max_age)
+		return (0);
+	return (1);
+}
+
+/*
+ * The idle gauge belongs to the target alone: the session parking a
+ * conn isn't the one taking it, so url and source IP rows would drift.
+ */
+
+static void
+tgt_idle(const struct target *tgt, int d)
+{
+
+	VSC_C_main->n_poolidle += d;
+	if (VSC_C_bd != NULL)
+		VSC_C_bd[tgt->bdidx].n_poolidle += d;
+}
+
+static void
+tgt_close(const struct target *tgt, struct vconn *vc)
+{
+	int i;
+
+	tls_free(vc->ssl, 1);
+	vc->ssl = NULL;
+	H2_Free(vc->h2);
+	vc->h2 = NULL;
+	VSC_SYS();
+	i = close(vc->fd);
+	assert(i == 0 || errno != EBADF);
+	/* The running session may be after another target: charge ours */
+	VSC_C_main->n_poolevict++;
+	if (VSC_C_bd != NULL)
+		VSC_C_bd[tgt->bdidx].n_poolevict++;
+	if (!params->linger && tgt->vaddr->va_family != AF_UNIX) {
+		VSC_C_main->n_closeactive++;
+		if (VSC_C_bd != NULL)
+			VSC_C_bd[tgt->bdidx].n_closeactive++;
+	}
+	Lck_Lock(&ses_stat_mtx);
+	n_conn--;
+	if (m_arg != 0)
+		SES_Rush();
+	Lck_Unlock(&ses_stat_mtx);
+}
+
+/*
+ * Hand an idle connection to the session.  Connections which got too
+ * old or were closed by the far end on the way are dropped.  The
+ * checks and the close happen with the pool unlocked; the vconn is
+ * ours until it goes back on the spare list.
+ */
+
+static int
+TGT_Get(struct target *tgt, struct sess *sp)
+{
+	struct vconn *vc;
+	uint64_t now = TIM_batch();
+	int fd, ok;
+
+	CHECK_OBJ_NOTNULL(tgt, TARGET_MAGIC);
+	Lck_Lock(&tgt->mtx);
+	while ((vc = VTAILQ_FIRST(&tgt->idle)) != NULL) {
+		CHECK_OBJ_NOTNULL(vc, VCONN_MAGIC);
+		VTAILQ_REMOVE(&tgt->idle, vc, list);
+		tgt->nidle--;
+		tgt_idle(tgt, -1);
+		Lck_Unlock(&tgt->mtx);
+
+		fd = vc->fd;
+		ok = tgt_usable(vc, now) && (vc->h2 != NULL ?
+		    h2_CheckConn(fd) : ses_CheckConn(fd, vc->ssl));
+		if (ok) {
+			sp->fd = fd;
+			sp->ssl = vc->ssl;
+			vc->ssl = NULL;
+			sp->h2 = vc->h2;
+			vc->h2 = NULL;
+			sp->conn_nreq = vc->nreq;
+			sp->t_connopen = vc->t_open;
+			sp->srcidx = vc->srcidx;
+		} else
+			tgt_close(tgt, vc);
+
+		Lck_Lock(&tgt->mtx);
+		VTAILQ_INSERT_HEAD(&tgt->spare, vc, list);
+		if (ok) {
+			Lck_Unlock(&tgt->mtx);
+			return (1);
+		}
+	}
+	Lck_Unlock(&tgt->mtx);
+	return (0);
+}
+
+/*
+ * Park the session's connection for someone else to use.  Returns 0 if
+ * the pool took it.
+ */
+
+static int
+TGT_Put(struct target *tgt, struct sess *sp)
+{
+	struct vconn *vc;
+
+	CHECK_OBJ_NOTNULL(tgt, TARGET_MAGIC);
+	Lck_Lock(&tgt->mtx);
+	if (tgt->nidle >= params->pool_max_idle) {
+		Lck_Unlock(&tgt->mtx);
+		return (-1);
+	}
+	vc = VTAILQ_FIRST(&tgt->spare);
+	if (vc != NULL)
+		VTAILQ_REMOVE(&tgt->spare, vc, list);
+	else {
+		ALLOC_OBJ(vc, VCONN_MAGIC);
+		XXXAN(vc);
+	}
+	vc->fd = sp->fd;
+	vc->ssl = sp->ssl;
+	vc->h2 = sp->h2;
+	vc->nreq = sp->conn_nreq;
+	vc->t_open = sp->t_connopen;
+	vc->srcidx = sp->srcidx;
+	if (!tgt_usable(vc, TIM_batch())) {
+		vc->ssl = NULL;
+		vc->h2 = NULL;
+		VTAILQ_INSERT_HEAD(&tgt->spare, vc, list);
+		Lck_Unlock(&tgt->mtx);
+		return (-1);
+	}
+	VTAILQ_INSERT_HEAD(&tgt->idle, vc, list);
+	tgt->nidle++;
+	tgt_idle(tgt, 1);
+	VSC_INC(n_poolreuse);
+	Lck_Unlock(&tgt->mtx);
+	if (m_arg != 0) {
+		/* Let a session waiting for the -m limit have it */
+		Lck_Lock(&ses_stat_mtx);
+		SES_Rush();
+		Lck_Unlock(&ses_stat_mtx);
+	}
+	return (0);
+}
+
+/*
+ * Close the oldest idle connection of any target, to make room under
+ * the -m limit for a connection somebody actually wants.
+ */
+
+static int
+TGT_Evict(void)
+{
+	struct target *tgt;
+	struct vconn *vc;
+
+	VTAILQ_FOREACH(tgt, &targets, list) {
+		Lck_Lock(&tgt->mtx);
+		vc = VTAILQ_LAST(&tgt->idle, vconnhead);
+		if (vc != NULL) {
+			VTAILQ_REMOVE(&tgt->idle, vc, list);
+			tgt->nidle--;
+			tgt_idle(tgt, -1);
+			Lck_Unlock(&tgt->mtx);
+			tgt_close(tgt, vc);
+			Lck_Lock(&tgt->mtx);
+			VTAILQ_INSERT_HEAD(&tgt->spare, vc, list);
+			Lck_Unlock(&tgt->mtx);
+			return (1);
+		}
+		Lck_Unlock(&tgt->mtx);
+	}
+	return (0);
+}
+
+static struct target *
+TGT_Find(struct vss_addr *vaddr, unsigned tls, const char *sni, unsigned h2)
+{
+	struct target *tgt;
+	char abuf[VTCP_ADDRBUFSIZE], pbuf[VTCP_PORTBUFSIZE];
+
+	VTAILQ_FOREACH(tgt, &targets, list) {
+		if (tgt->vaddr->va_addrlen == vaddr->va_addrlen &&
+		    !memcmp(&tgt->vaddr->va_addr, &vaddr->va_addr,
+		    vaddr->va_addrlen) && tgt->tls == tls && tgt->h2 == h2 &&
+		    (tgt->sni == sni ||
+		    (tgt->sni != NULL && sni != NULL && !strcmp(tgt->sni, sni))))
+			return (tgt);
+	}
+	ALLOC_OBJ(tgt, TARGET_MAGIC);
+	XXXAN(tgt);
+	tgt->vaddr = vaddr;
+	tgt->tls = tls;
+	tgt->sni = sni;
+	tgt->h2 = h2;
+	if (vaddr->va_family == AF_UNIX)
+		(void)snprintf(tgt->name, sizeof tgt->name, "unix:%s",
+		    ((struct sockaddr_un *)&vaddr->va_addr)->sun_path);
+	else {
+		VTCP_name(&vaddr->va_addr, vaddr->va_addrlen, abuf,
+		    sizeof abuf, pbuf, sizeof pbuf);
+		(void)snprintf(tgt->name, sizeof tgt->name,
+		    vaddr->va_family == AF_INET6 ? "[%s]:%s" : "%s:%s",
+		    abuf, pbuf);
+	}
+	Lck_New(&tgt->mtx, "target");
+	VTAILQ_INIT(&tgt->idle);
+	VTAILQ_INIT(&tgt->spare);
+	VTAILQ_INSERT_TAIL(&targets, tgt, list);
+	return (tgt);
+}
+
+/*--------------------------------------------------------------------
+ * The very first request
+ */
+
+static int
+cnt_first(struct sess *sp)
+{
+
+	sp->step = STP_START;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * START
+ * Handle a request.
+ */
+
+static int
+cnt_start(struct sess *sp)
+{
+	static int cnt = 0;
+	struct url *url;
+	int i;
+
+	callout_init(&sp->co, 0);
+	i = cnt++ % num_urls;
+	url = sp->url = urls[i];
+	sp->tgt = url->tgts[url->sched[sp->wrk->rr[i]++ % url->nsched]];
+	sp->srcidx = -1;
+	sp->err = 0;
+	sp->t_start = TIM_batch();
+	sp->t_connstart = 0;
+	sp->t_connend = 0;
+	sp->t_tlsstart = 0;
+	sp->t_tlsend = 0;
+	sp->t_fbstart = 0;
+	sp->t_fbend = 0;
+	sp->t_bodystart = 0;
+	sp->t_bodyend = 0;
+	sp->t_done = 0;
+
+	sp->step = STP_HTTP_START;
+	return (0);
+}
+
+static int
+cnt_http_start(struct sess *sp)
+{
+
+	if (params->pool_max_idle > 0 && TGT_Get(sp->tgt, sp)) {
+		VSC_INC(n_poolhit);
+		sp->step = sp->tgt->h2 ? STP_H2_INIT : STP_HTTP_TXREQ_INIT;
+		return (0);
+	}
+	VSC_SYS();
+	sp->fd = socket(sp->tgt->vaddr->va_family, SOCK_STREAM,
+	    sp->tgt->vaddr->va_protocol);
+	if (sp->fd == -1) {
+		SES_errno(errno);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout, "[ERROR] socket(2) error: %d %s\n",
+			    errno, strerror(errno));
+		sp->step = STP_DONE;
+		return (0);
+	}
+	sp->step = STP_HTTP_WAIT;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * We want to get out of any kind of trouble-hit TCP connections as fast
+ * as absolutely possible, so we set them LINGER enabled with zero timeout,
+ * so that even if there are outstanding write data on the socket, a close(2)
+ * will return immediately.
+ */
+static const struct linger linger = {
+	.l_onoff	=	1,
+	.l_linger	=	0,
+};
+
+/*--------------------------------------------------------------------
+ * Pick the source address.  Each worker walks its own share of the
+ * (source IP, port) space, so threads never compete for a port, and
+ * with src_port_range set the kernel's port search is skipped too.
+ * Otherwise IP_BIND_ADDRESS_NO_PORT leaves the port to connect(2),
+ * which can then reuse one that's busy towards another destination.
+ */
+
+#define	SES_BIND_TRIES		16
+
+static int
+ses_bind(struct sess *sp)
+{
+	struct worker *wrk = sp->wrk;
+	struct sockaddr_storage ss;
+	struct srcip *sip = NULL;
+	socklen_t sl;
+	unsigned u, port;
+	int family = sp->tgt->vaddr->va_family, i, skip, val = 1;
+
+	if (num_srcips == 0 && wrk->port_lo == 0)
+		return (0);
+	for (i = 0, skip = 0; i < SES_BIND_TRIES; ) {
+		u = wrk->bind_next++;
+		memset(&ss, 0, sizeof ss);
+		if (num_srcips > 0) {
+			sip = &srcips[u % num_srcips];
+			if (sip->sockaddr.ss_family != family) {
+				if (++skip < num_srcips)
+					continue;
+				/* none of ours: don't let the kernel pick */
+				VSC_INC(n_portretry);
+				errno = EADDRNOTAVAIL;
+				return (-1);
+			}
+			skip = 0;
+			u /= num_srcips;
+			memcpy(&ss, &sip->sockaddr, sip->sockaddrlen);
+			sl = sip->sockaddrlen;
+		} else {
+			ss.ss_family = family;
+			sl = family == AF_INET6 ? sizeof(struct sockaddr_in6) :
+			    sizeof(struct sockaddr_in);
+		}
+		if (wrk->port_lo != 0) {
+			port = wrk->port_lo + u % (wrk->port_hi - wrk->port_lo + 1);
+			if (family == AF_INET6)
+				((struct sockaddr_in6 *)&ss)->sin6_port =
+				    htons(port);
+			else
+				((struct sockaddr_in *)&ss)->sin_port =
+				    htons(port);
+		}
+#ifdef IP_BIND_ADDRESS_NO_PORT
+		else if (params->bind_no_port) {
+			VSC_SYS();
+			(void)setsockopt(sp->fd, IPPROTO_IP,
+			    IP_BIND_ADDRESS_NO_PORT, &val, sizeof val);
+		}
+#endif
+		VSC_SYS();
+		if (bind(sp->fd, (struct sockaddr *)&ss, sl) == 0) {
+			if (sip != NULL) {
+				sp->srcidx = sip - srcips;
+				/* counted before we knew our source */
+				VSC_C_bd[bd_srcbase + sp->srcidx].n_conntotal++;
+			}
+			return (0);
+		}
+		if (errno != EADDRINUSE || wrk->port_lo == 0)
+			return (-1);
+		VSC_INC(n_portretry);
+		i++;
+	}
+	return (-1);
+}
+
+static int
+cnt_http_wait(struct sess *sp)
+{
+	int fd, ret, val = 1;
 
 	Lck_Lock(&ses_stat_mtx);
-	if (m_arg != 0 && VSC_C_main->n_conn >= m_arg) {
+	if (m_arg != 0 && n_conn >= m_arg) {
 		Lck_Unlock(&ses_stat_mtx);
+		if (params->pool_max_idle > 0) {
+			/*
+			 * Somebody may have parked a connection we can use
+			 * while we were sleeping.  If not, make room by
+			 * closing an idle one to another target.
+			 */
+			fd = sp->fd;
+			if (TGT_Get(sp->tgt, sp)) {
+				VSC_SYS();
+				AZ(close(fd));
+				VSC_INC(n_poolhit);
+				sp->step = sp->tgt->h2 ? STP_H2_INIT :
+				    STP_HTTP_TXREQ_INIT;
+				return (0);
+			}
+			if (TGT_Evict())
+				return (0);
+		}
 		SES_Sleep(sp);
 		return (1);
 	}
-	VSC_C_main->n_conntotal++;
-	VSC_C_main->n_conn++;
+	VSC_INC(n_conntotal);
+	n_conn++;
 	Lck_Unlock(&ses_stat_mtx);
+	if (params->pool_max_idle > 0)
+		VSC_INC(n_poolmiss);
 	ret = VTCP_nonblocking(sp->fd);
 	if (ret != 0) {
 		fprintf(stdout, "[ERROR] VTCP_nonblocking() error.\n");
 		sp->step = STP_HTTP_ERROR;
 		return (0);
 	}
-	if (params->linger)
+	if (sp->tgt->vaddr->va_family == AF_UNIX) {
+		/* No TCP, no ports and nothing to bind */
+		sp->flags &= ~SESS_F_TFO;
+		sp->step = STP_HTTP_CONNECT;
+		return (0);
+	}
+	if (params->linger) {
+		VSC_SYS();
 		AZ(setsockopt(sp->fd, SOL_SOCKET, SO_LINGER, &linger,
 			sizeof linger));
+	}
 	/* Disable Nagle algorithm for pipelining requests.  */
+	VSC_SYS();
         AZ(setsockopt(sp->fd, SOL_TCP, TCP_NODELAY, &val, sizeof(val)));
-	if (num_srcips > 0) {
-		/* Try a source IP address in round-robin manner. */
-		sip = &srcips[no++ % num_srcips];
-		if (bind(sp->fd, (struct sockaddr *)&sip->sockaddr,
-		    sip->sockaddrlen)) {
-			SES_errno(errno);
-			if (params->diag_bitmap & 0x2)
-				fprintf(stdout,
-				    "[ERROR] bind(2) with %s error: %d %s\n",
-				    sip->ip, errno, strerror(errno));
-			sp->step = STP_HTTP_ERROR;
-			return (0);
-		}
+	/*
+	 * With TCP_FASTOPEN_CONNECT connect(2) returns at once if we hold
+	 * a cookie for the server and the first write(2) goes out with
+	 * the SYN.  Without a cookie it's an ordinary connect.
+	 */
+	sp->flags &= ~SESS_F_TFO;
+	if (params->tcp_fastopen) {
+		VSC_SYS();
+		if (setsockopt(sp->fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &val,
+		    sizeof(val)) == 0)
+			sp->flags |= SESS_F_TFO;
+		else
+			VSC_INC(n_tfofallback);
+	}
+	if (ses_bind(sp)) {
+		SES_errno(errno);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout, "[ERROR] bind(2) error: %d %s\n",
+			    errno, strerror(errno));
+		sp->step = STP_HTTP_ERROR;
+		return (0);
 	}
 	sp->step = STP_HTTP_CONNECT;
 	return (0);
@@ -952,22 +2412,35 @@ cnt_http_wait(struct sess *sp)
 static int
 cnt_http_connect(struct sess *sp)
 {
-	struct url *url = sp->url;
-	struct vss_addr *vaddr;
+	struct vss_addr *vaddr = sp->tgt->vaddr;
 	int ret;
 
-	if (isnan(sp->t_connstart))
-		sp->t_connstart = TIM_real();
-
-	assert(url->nvaddr > 0);
-	vaddr = url->vaddr[0];		/* XXX always use the first */
+	if (sp->t_connstart == 0)
+		sp->t_connstart = VTIM_mono();
 
+	VSC_SYS();
 	ret = connect(sp->fd, (struct sockaddr *)&vaddr->va_addr,
 	    vaddr->va_addrlen);
+	if (sp->flags & SESS_F_TFO) {
+		if (ret == 0) {
+			/*
+			 * The SYN hasn't even left yet, so there is no
+			 * connect time to take; leave it out of the
+			 * connect figures rather than record nothing as
+			 * zero.  The handshake shows in first byte time.
+			 */
+			VSC_INC(n_tfo);
+			sp->t_connstart = 0;
+		} else {
+			/* no cookie yet, this SYN fetches one */
+			VSC_INC(n_tfofallback);
+			sp->flags &= ~SESS_F_TFO;
+		}
+	}
 	if (ret == -1) {
 		if (errno != EINPROGRESS) {
-			if (isnan(sp->t_connend))
-				sp->t_connend = TIM_real();
+			if (sp->t_connend == 0)
+				sp->t_connend = VTIM_mono();
 			SES_errno(errno);
 			if (params->diag_bitmap & 0x2)
 				fprintf(stdout,
@@ -982,70 +2455,462 @@ cnt_http_connect(struct sess *sp)
 		SES_Wait(sp, SESS_WANT_WRITE);
 		return (1);
 	}
-	if (isnan(sp->t_connend))
-		sp->t_connend = TIM_real();
-	sp->step = STP_HTTP_TXREQ_INIT;
+	if (sp->t_connend == 0)
+		sp->t_connend = VTIM_mono();
+	sp->conn_nreq = 0;
+	sp->t_connopen = sp->t_connend;
+	if (sp->tgt->tls)
+		sp->step = STP_HTTP_TLS;
+	else
+		sp->step = sp->tgt->h2 ? STP_H2_INIT : STP_HTTP_TXREQ_INIT;
 	return (0);
 }
 
 /*--------------------------------------------------------------------
- * Check that there is still something at the far end of a given socket.
- * We poll the fd with instant timeout, if there are any events we can't
- * use it (backends are not allowed to pipeline).
+ * Non-blocking TLS handshake, resuming the target's last session if
+ * there is one.  HTTP/2 targets offer only "h2" in ALPN and insist on
+ * getting it.
  */
 
 static int
-vbe_CheckFd(int fd)
+cnt_http_tls(struct sess *sp)
 {
-	struct pollfd pfd;
+	struct target *tgt = sp->tgt;
+	const unsigned char *alpn;
+	unsigned alpnlen;
+	char buf[256];
+	int i, want;
+
+	if (sp->ssl == NULL) {
+		sp->t_tlsstart = VTIM_mono();
+		sp->ssl = SSL_new(tls_ctx);
+		XXXAN(sp->ssl);
+		AN(SSL_set_fd(sp->ssl, sp->fd));
+		SSL_set_connect_state(sp->ssl);
+		AN(SSL_set_app_data(sp->ssl, tgt));
+		if (tgt->sni != NULL)
+			AN(SSL_set_tlsext_host_name(sp->ssl, tgt->sni));
+		if (tgt->h2)
+			AZ(SSL_set_alpn_protos(sp->ssl,
+			    (const unsigned char *)"\x02h2", 3));
+		if (params->tls_resume) {
+			Lck_Lock(&tgt->mtx);
+			if (tgt->tls_sess != NULL)
+				AN(SSL_set_session(sp->ssl, tgt->tls_sess));
+			Lck_Unlock(&tgt->mtx);
+		}
+	}
+	ERR_clear_error();
+	VSC_SYS();
+	i = SSL_do_handshake(sp->ssl);
+	if (i == 1) {
+		sp->t_tlsend = VTIM_mono();
+		VSC_INC(n_tls);
+		if (SSL_session_reused(sp->ssl))
+			VSC_INC(n_tlsresumed);
+#ifdef BIO_get_ktls_send
+		if (BIO_get_ktls_send(SSL_get_wbio(sp->ssl)))
+			VSC_INC(n_ktlstx);
+		if (BIO_get_ktls_recv(SSL_get_rbio(sp->ssl)))
+			VSC_INC(n_ktlsrx);
+#endif
+		if (!tgt->h2) {
+			sp->step = STP_HTTP_TXREQ_INIT;
+			return (0);
+		}
+		SSL_get0_alpn_selected(sp->ssl, &alpn, &alpnlen);
+		if (alpnlen != 2 || memcmp(alpn, "h2", 2)) {
+			VSC_INC(n_h2noalpn);
+			if (params->diag_bitmap & 0x2)
+				fprintf(stdout,
+				    "[ERROR] %s didn't agree to h2 in ALPN\n",
+				    tgt->name);
+			sp->flags |= SESS_F_NOREUSE;
+			sp->step = STP_HTTP_ERROR;
+			return (0);
+		}
+		sp->step = STP_H2_INIT;
+		return (0);
+	}
+	switch (SSL_get_error(sp->ssl, i)) {
+	case SSL_ERROR_WANT_READ:
+		want = SESS_WANT_READ;
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		want = SESS_WANT_WRITE;
+		break;
+	default:
+		sp->t_tlsend = VTIM_mono();
+		VSC_INC(n_tlserror);
+		if (params->diag_bitmap & 0x2) {
+			ERR_error_string_n(ERR_get_error(), buf, sizeof buf);
+			fprintf(stdout,
+			    "[ERROR] TLS handshake with %s failed: %s\n",
+			    tgt->name, buf);
+		}
+		ERR_clear_error();
+		sp->step = STP_HTTP_ERROR;
+		return (0);
+	}
+	callout_reset(&sp->wrk->cb, &sp->co,
+	    CALLOUT_SECTOTICKS(params->connect_timeout), cnt_timeout_tick, sp);
+	SES_Wait(sp, want);
+	return (1);
+}
 
-	pfd.fd = fd;
-	pfd.events = POLLIN;
-	pfd.revents = 0;
-	return (poll(&pfd, 1, 0) == 0);
+/*--------------------------------------------------------------------
+ * Filling template slots
+ */
+
+static uint32_t			tmpl_runid;	/* first part of ${reqid} */
+
+static uint64_t
+wrk_random(struct worker *w)
+{
+
+	/* xorshift64* */
+	w->rng ^= w->rng >> 12;
+	w->rng ^= w->rng << 25;
+	w->rng ^= w->rng >> 27;
+	return (w->rng * 0x2545f4914f6cdd1dULL);
 }
 
-static int
-cnt_http_txreq_init(struct sess *sp)
+static size_t
+tmpl_u64(char *dst, uint64_t v)
 {
+	char b[20], *p = b + sizeof b;
+	size_t l;
 
-	if (!vbe_CheckFd(sp->fd)) {
-		fprintf(stdout,
-		    "[ERROR] socket is closed or its buffer isn't empty.\n");
-		sp->step = STP_HTTP_ERROR;
-		return (0);
-	}
-	WS_Reset(sp->ws, NULL);
-	sp->woffset = 0;
-	sp->step = STP_HTTP_TXREQ;
-	return (0);
+	do
+		*--p = '0' + v % 10;
+	while ((v /= 10) != 0);
+	l = b + sizeof b - p;
+	memcpy(dst, p, l);
+	return (l);
 }
 
-static int
-cnt_http_txreq(struct sess *sp)
+static void
+treq_start(struct url *url, struct worker *w, struct treq *tr)
 {
-	struct url *url = sp->url;
-	ssize_t l;
 
-	if (isnan(sp->t_fbstart))
-		sp->t_fbstart = TIM_real();
+	if (url->tflags & TMPL_F_SEQ)
+		tr->seq = __sync_fetch_and_add(url->tseq, 1);
+	if (url->tflags & TMPL_F_REQID)
+		tr->reqid = w->nreqid++;
+}
 
-	assert(VSB_len(url->vsb) - sp->woffset > 0);
-	l = write(sp->fd, VSB_data(url->vsb) + sp->woffset,
-	    VSB_len(url->vsb) - sp->woffset);
-	if (l <= 0) {
-		if (l == -1 && errno == EAGAIN)
-			goto wantwrite;
-		SES_errno(errno);
-		if (params->diag_bitmap & 0x2)
-			fprintf(stdout,
-			    "write(2) error: %d %s\n", errno, strerror(errno));
-		sp->step = STP_HTTP_ERROR;
-		return (0);
-	}
-	sp->woffset += l;
-	VSC_C_main->n_txbytes += l;
-	if (sp->woffset != VSB_len(url->vsb)) {
+/* dst has room for ts->maxlen */
+static size_t
+tslot_fill(const struct tslot *ts, struct worker *w, const struct treq *tr,
+    char *dst)
+{
+	const char *p;
+	uint64_t v;
+	size_t l;
+	int i;
+
+	switch (ts->type) {
+	case TSLOT_SEQ:
+		return (tmpl_u64(dst, ts->hi > 0 ? tr->seq % ts->hi : tr->seq));
+	case TSLOT_RAND:
+		v = wrk_random(w);
+		if (ts->hi - ts->lo != UINT64_MAX)
+			v = ts->lo + v % (ts->hi - ts->lo + 1);
+		return (tmpl_u64(dst, v));
+	case TSLOT_WORKER:
+		return (tmpl_u64(dst, w->id));
+	case TSLOT_REQID:
+		for (i = 28; i >= 0; i -= 4)
+			*dst++ = "0123456789abcdef"[(tmpl_runid >> i) & 0xf];
+		*dst++ = '-';
+		l = tmpl_u64(dst, w->id);
+		dst[l++] = '-';
+		return (9 + l + tmpl_u64(dst + l, tr->reqid));
+	case TSLOT_LIST:
+		p = ts->list[wrk_random(w) % ts->nlist];
+		l = strlen(p);
+		memcpy(dst, p, l);
+		return (l);
+	default:
+		WRONG("slot type");
+	}
+	NEEDLESS_RETURN(0);
+}
+
+/* The whole thing into dst, which has room for TMPL_MAXLEN */
+static size_t
+tmpl_render(const struct tmpl *t, struct worker *w, const struct treq *tr,
+    char *dst)
+{
+	const struct tseg *sg;
+	char *p = dst;
+	unsigned u;
+
+	for (u = 0, sg = t->seg; u < t->nseg; u++, sg++) {
+		memcpy(p, sg->p, sg->len);
+		p += sg->len;
+		if (sg->slot != NULL)
+			p += tslot_fill(sg->slot, w, tr, p);
+	}
+	assert(p - dst <= TMPL_MAXLEN);
+	return (p - dst);
+}
+
+/* The body goes out with a CRLF after it */
+static size_t
+url_bodywire(const struct url *url)
+{
+
+	return (url->bodylen > 0 ? url->bodylen + 2 : 0);
+}
+
+/*
+ * Fill the slots of the whole batch into the workspace, their lengths
+ * first and then the values back to back.  The batch is cut short if
+ * it doesn't all fit.
+ */
+
+static int
+ses_tmpl_fill(struct sess *sp)
+{
+	const struct tmpl *t = sp->url->tmpl;
+	const struct tseg *sg;
+	struct treq tr;
+	unsigned u, v, per, room;
+	uint16_t *tl;
+	char *p;
+
+	per = t->nslot * sizeof *tl + t->slotlen;
+	room = WS_Reserve(sp->ws, 0);
+	if (room < per) {
+		WS_ReleaseP(sp->ws, sp->ws->f);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout, "[ERROR] sess_workspace is too small "
+			    "for the request template\n");
+		sp->step = STP_HTTP_ERROR;
+		return (1);
+	}
+	if (sp->nbatch > room / per)
+		sp->nbatch = room / per;
+	sp->tlen = tl = (void *)sp->ws->f;
+	sp->tval = p = (char *)(tl + sp->nbatch * t->nslot);
+	sp->wlen = sp->nbatch * (t->statlen + url_bodywire(sp->url));
+	for (u = 0; u < sp->nbatch; u++) {
+		treq_start(sp->url, sp->wrk, &tr);
+		for (v = 0, sg = t->seg; v < t->nseg; v++, sg++) {
+			if (sg->slot == NULL)
+				continue;
+			*tl = tslot_fill(sg->slot, sp->wrk, &tr, p);
+			p += *tl;
+			sp->wlen += *tl++;
+		}
+	}
+	WS_ReleaseP(sp->ws, p);
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * MSG_ZEROCOPY.  The kernel sends from the url's body pages and tells us
+ * on the socket's error queue when it's done with them.  The body never
+ * changes, so all we need the notices for is to keep the error queue
+ * empty: anything on it makes the socket look broken to poll(2).
+ */
+
+static ssize_t
+ses_writev_zc(struct sess *sp, struct iovec *iov, int n)
+{
+#ifdef MSG_ZEROCOPY
+	struct msghdr msg;
+	ssize_t l;
+	int val = 1;
+
+	if ((sp->flags & SESS_F_ZC) == 0) {
+		VSC_SYS();
+		if (setsockopt(sp->fd, SOL_SOCKET, SO_ZEROCOPY, &val,
+		    sizeof val))
+			return (ses_writev(sp, iov, n));
+		sp->flags |= SESS_F_ZC;
+	}
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = iov;
+	msg.msg_iovlen = n;
+	VSC_SYS();
+	l = sendmsg(sp->fd, &msg, MSG_ZEROCOPY);
+	if (l >= 0) {
+		sp->zc_pending++;
+		VSC_INC(n_zcsend);
+	} else if (errno == ENOBUFS)
+		l = ses_writev(sp, iov, n);	/* over optmem_max */
+	return (l);
+#else
+	return (ses_writev(sp, iov, n));
+#endif
+}
+
+static void
+ses_zcreap(struct sess *sp)
+{
+#ifdef MSG_ZEROCOPY
+	struct sock_extended_err *ee;
+	struct cmsghdr *cm;
+	struct msghdr msg;
+	char cbuf[128];
+	unsigned n;
+
+	while (sp->zc_pending > 0) {
+		memset(&msg, 0, sizeof msg);
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof cbuf;
+		VSC_SYS();
+		if (recvmsg(sp->fd, &msg, MSG_ERRQUEUE) < 0)
+			break;
+		for (cm = CMSG_FIRSTHDR(&msg); cm != NULL;
+		    cm = CMSG_NXTHDR(&msg, cm)) {
+			if (!(cm->cmsg_level == SOL_IP &&
+			    cm->cmsg_type == IP_RECVERR) &&
+			    !(cm->cmsg_level == SOL_IPV6 &&
+			    cm->cmsg_type == IPV6_RECVERR))
+				continue;
+			ee = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (ee->ee_errno != 0 ||
+			    ee->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+			/* one notice covers sends ee_info to ee_data */
+			n = ee->ee_data - ee->ee_info + 1;
+			sp->zc_pending -= MIN(n, sp->zc_pending);
+			if (ee->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+				VSC_ADD(n_zccopied, n);
+		}
+	}
+#else
+	(void)sp;
+#endif
+}
+
+static int
+cnt_http_txreq_init(struct sess *sp)
+{
+
+	if (sp->zc_pending > 0)
+		ses_zcreap(sp);
+	if (!ses_CheckConn(sp->fd, sp->ssl)) {
+		fprintf(stdout,
+		    "[ERROR] socket is closed or its buffer isn't empty.\n");
+		sp->step = STP_HTTP_ERROR;
+		return (0);
+	}
+	HTC_Fini(&sp->htc, sp->wrk);
+	WS_Reset(sp->ws, NULL);
+	sp->woffset = 0;
+	sp->nbatch = sp->url->pipeline;
+	if (sp->nbatch > (unsigned)(C_arg - sp->calls))
+		sp->nbatch = C_arg - sp->calls;
+	if (sp->nbatch > params->pool_max_reqs - sp->conn_nreq)
+		sp->nbatch = params->pool_max_reqs - sp->conn_nreq;
+	if (sp->nbatch == 0)
+		sp->nbatch = 1;
+	if (sp->url->tmpl == NULL)
+		sp->wlen = sp->nbatch *
+		    (VSB_len(sp->url->vsb) + url_bodywire(sp->url));
+	else if (ses_tmpl_fill(sp))
+		return (0);
+	sp->step = STP_HTTP_TXREQ;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * The request goes out as iovecs of the header and the body, both
+ * built once per url and only ever read, with the template slots
+ * filled for this batch in between.  With -pipeline the batch is one
+ * writev(2) of all its requests; woffset counts bytes over the whole
+ * batch and whatever went out already is skipped.
+ */
+
+#define	TXQ_MAX			(2 * URL_PIPELINE_MAX)
+
+struct txq {
+	struct iovec		iov[TXQ_MAX];
+	int			n;
+	size_t			skip;
+	size_t			len;
+};
+
+static void
+txq_add(struct txq *q, char *p, size_t len)
+{
+
+	if (q->skip >= len) {
+		q->skip -= len;
+		return;
+	}
+	if (q->n == TXQ_MAX)
+		return;			/* the next writev(2) then */
+	q->iov[q->n].iov_base = p + q->skip;
+	q->iov[q->n].iov_len = len - q->skip;
+	q->len += len - q->skip;
+	q->skip = 0;
+	q->n++;
+}
+
+static int
+cnt_http_txreq(struct sess *sp)
+{
+	struct url *url = sp->url;
+	const struct tmpl *t = url->tmpl;
+	const struct tseg *sg;
+	const uint16_t *tl;
+	struct txq q;
+	ssize_t l, blen;
+	unsigned u, v;
+	char *tv;
+
+	if (sp->t_fbstart == 0)
+		sp->t_fbstart = sp->t_txbatch = VTIM_mono();
+
+	blen = url_bodywire(url);
+again:
+	assert(sp->wlen - sp->woffset > 0);
+	tl = sp->tlen;
+	tv = sp->tval;
+	q.n = 0;
+	q.skip = sp->woffset;
+	q.len = 0;
+	for (u = 0; u < sp->nbatch && q.n < TXQ_MAX; u++) {
+		if (t == NULL)
+			txq_add(&q, VSB_data(url->vsb), VSB_len(url->vsb));
+		else {
+			for (v = 0, sg = t->seg; v < t->nseg; v++, sg++) {
+				txq_add(&q, sg->p, sg->len);
+				if (sg->slot != NULL) {
+					txq_add(&q, tv, *tl);
+					tv += *tl++;
+				}
+			}
+		}
+		if (blen > 0)
+			txq_add(&q, url->body, blen);
+	}
+	if (params->zerocopy_min > 0 && url->bodylen >= params->zerocopy_min &&
+	    sp->ssl == NULL && (sp->flags & SESS_F_TFO) == 0 &&
+	    sp->tgt->vaddr->va_family != AF_UNIX)
+		l = ses_writev_zc(sp, q.iov, q.n);
+	else
+		l = ses_writev(sp, q.iov, q.n);
+	if (l <= 0) {
+		if (l == -1 && (errno == EAGAIN || errno == EINPROGRESS))
+			goto wantwrite;
+		SES_errno(errno);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout,
+			    "write(2) error: %d %s\n", errno, strerror(errno));
+		sp->step = STP_HTTP_ERROR;
+		return (0);
+	}
+	sp->woffset += l;
+	VSC_ADD(n_txbytes, l);
+	if (sp->woffset != sp->wlen) {
+		if (l == q.len)
+			goto again;	/* took all we had room for */
 wantwrite:
 		callout_reset(&sp->wrk->cb, &sp->co,
 		    CALLOUT_SECTOTICKS(params->write_timeout), cnt_timeout_tick,
@@ -1053,8 +2918,12 @@ wantwrite:
 		SES_Wait(sp, SESS_WANT_WRITE);
 		return (1);
 	}
-	VSC_C_main->n_req++;
-	sp->calls++;
+	VSC_ADD(n_req, sp->nbatch);
+	if (sp->nbatch > 1)
+		VSC_ADD(n_pipereq, sp->nbatch);
+	sp->calls += sp->nbatch;
+	sp->conn_nreq += sp->nbatch;
+	sp->npending = sp->nbatch;
 	sp->step = STP_HTTP_RXRESP;
 	return (0);
 }
@@ -1063,126 +2932,102 @@ static int
 cnt_http_rxresp(struct sess *sp)
 {
 
-	HTC_Init(&sp->htc, sp->ws, sp->fd, /* XXX */4096);
+	if (sp->htc.hb == NULL)
+		WS_Reset(sp->ws, NULL);		/* last header is done with */
+	HTC_Init(&sp->htc, sp->ws, sp->fd, sp->ssl, params->http_resp_size);
+	if (sp->t_fbstart == 0)
+		sp->t_fbstart = sp->t_txbatch;	/* pipelined, in FIFO order */
 	sp->roffset = 0;
 	sp->step = STP_HTTP_RXRESP_HDR;
 	return (0);
 }
 
-/**********************************************************************
- * find header
+/*--------------------------------------------------------------------
+ * Response body checks.  Bytes are looked at as they pass by, nothing
+ * gets buffered.  vbytes is kept up even with nothing to check, as the
+ * -T records want it.
  */
 
-static char *
-http_find_header(char * const *hh, const char *hdr)
+static void
+ses_bodystart(const struct url *url, struct bodychk *bc)
 {
-	int n, l;
-	char *r;
 
-	l = strlen(hdr);
+	if (url->vflags & URL_V_HASH)
+		VHASH_Start(&bc->vh, url->vhtype);
+	bc->vbytes = 0;
+	bc->vbad = 0;
+}
 
-	for (n = 3; hh[n] != NULL; n++) {
-		if (strncasecmp(hdr, hh[n], l) || hh[n][l] != ':')
-			continue;
-		for (r = hh[n] + l + 1; vct_issp(*r); r++)
-			continue;
-		return (r);
+static void
+ses_bodycheck(const struct url *url, struct bodychk *bc, const char *p,
+    ssize_t len)
+{
+	ssize_t l, n, o;
+
+	if (url->vflags & URL_V_HASH)
+		VHASH_Update(&bc->vh, p, len);
+	if ((url->vflags & URL_V_SYNTH) && !bc->vbad) {
+		o = bc->vbytes;
+		for (l = len; l > 0; o += n, p += n, l -= n) {
+			if (o >= url->vlen - 1) {
+				/* synth_body() always ends with NL */
+				if (o > url->vlen - 1 || *p != '\n')
+					bc->vbad = 1;
+				break;
+			}
+			n = MIN(l, SYNTH_PERIOD - o % SYNTH_PERIOD);
+			n = MIN(n, url->vlen - 1 - o);
+			if (memcmp(p, synth_pat + o % SYNTH_PERIOD, n)) {
+				bc->vbad = 1;
+				break;
+			}
+		}
 	}
-	return (NULL);
+	bc->vbytes += len;
 }
 
 static int
-http_probe_splitheader(struct sess *sp)
+ses_bodyverify(const struct url *url, struct bodychk *bc)
 {
-	struct http_conn *htc = &sp->htc;
-	char *p, *q, **hh;
-	int n;
-
-	memset(sp->resphdr, 0, sizeof(sp->resphdr));
-	hh = sp->resphdr;
 
-	n = 0;
-	p = htc->rxbuf.b;
+	if ((url->vflags & URL_V_LEN) && bc->vbytes != url->vlen)
+		bc->vbad = 1;
+	if ((url->vflags & URL_V_HASH) &&
+	    VHASH_Final(&bc->vh) != url->vdigest)
+		bc->vbad = 1;
+	return (bc->vbad);
+}
 
-	/* PROTO */
-	while (vct_islws(*p))
-		p++;
-	hh[n++] = p;
-	while (!vct_islws(*p))
-		p++;
-	if (vct_iscrlf(*p)) {
-		VSC_C_main->n_tooearlycrlf++;
-		fprintf(stdout, "[ERROR] too early CRLF after PROTO\n");
-		return (-1);
-	}
-	*p++ = '\0';
+/*--------------------------------------------------------------------
+ * Once the server has answered we can tell whether it took the data
+ * in our SYN or the kernel had to send it again after the handshake.
+ */
 
-	/* STATUS */
-	while (vct_issp(*p))		/* XXX: H space only */
-		p++;
-	if (vct_iscrlf(*p)) {
-		VSC_C_main->n_tooearlycrlf++;
-		fprintf(stdout, "[ERROR] too early CRLF after STATUS\n");
-		return (-1);
-	}
-	hh[n++] = p;
-	while (!vct_islws(*p))
-		p++;
-	if (vct_iscrlf(*p)) {
-		hh[n++] = NULL;
-		q = p;
-		p += vct_skipcrlf(p);
-		*q = '\0';
-	} else {
-		*p++ = '\0';
-		/* MSG */
-		while (vct_issp(*p))		/* XXX: H space only */
-			p++;
-		hh[n++] = p;
-		while (!vct_iscrlf(*p))
-			p++;
-		q = p;
-		p += vct_skipcrlf(p);
-		*q = '\0';
-	}
-	if (n != 3) {
-		VSC_C_main->n_wrongstatus++;
-		fprintf(stdout, "[ERROR] wrong status header\n");
-		return (-1);
-	}
+static void
+ses_tfo_check(const struct sess *sp)
+{
+	struct tcp_info ti;
+	socklen_t l = sizeof ti;
 
-	while (*p != '\0') {
-		if (n >= MAXHDR) {
-			VSC_C_main->n_toolonghdr++;
-			fprintf(stdout, "[ERROR] too long headers\n");
-			return (-1);
-		}
-		if (vct_iscrlf(*p))
-			break;
-		hh[n++] = p++;
-		while (*p != '\0' && !vct_iscrlf(*p))
-			p++;
-		q = p;
-		p += vct_skipcrlf(p);
-		*q = '\0';
-	}
-	p += vct_skipcrlf(p);
-	if (p != htc->rxbuf.e)
-		return (-1);
-	return (0);
+	VSC_SYS();
+	if (getsockopt(sp->fd, IPPROTO_TCP, TCP_INFO, &ti, &l) == 0 &&
+	    (ti.tcpi_options & TCPI_OPT_SYN_DATA))
+		VSC_INC(n_tfoaccepted);
+	else
+		VSC_INC(n_tfofallback);
 }
 
 static int
 cnt_http_rxresp_hdr(struct sess *sp)
 {
-	int l, r;
-	char *end, *p;
+	struct http_conn *htc = &sp->htc;
+	int l;
 
 retry:
-	l = HTC_Rx(&sp->htc);
+	l = HTC_Rx(htc, sp->wrk);
 	switch (l) {
 	case -1:
-		VSC_C_main->n_toolonghdr++;
+		VSC_INC(n_toolonghdr);
 		if (params->diag_bitmap & 0x2)
 			fprintf(stdout, "[ERROR] too big header response\n");
 		sp->step = STP_HTTP_ERROR;
@@ -1195,8 +3040,8 @@ retry:
 			SES_Wait(sp, SESS_WANT_READ);
 			return (1);
 		}
-		if (isnan(sp->t_fbend))
-			sp->t_fbend = TIM_real();
+		if (sp->t_fbend == 0)
+			sp->t_fbend = VTIM_mono();
 		SES_errno(errno);
 		if (params->diag_bitmap & 0x2)
 			fprintf(stdout, "[ERROR] %s: read(2) error: %d %s\n",
@@ -1204,8 +3049,8 @@ retry:
 		sp->step = STP_HTTP_ERROR;
 		return (0);
 	case -3:
-		if (isnan(sp->t_fbend))
-			sp->t_fbend = TIM_real();
+		if (sp->t_fbend == 0)
+			sp->t_fbend = VTIM_mono();
 		SES_errno(0);
 		if (params->diag_bitmap & 0x2)
 			fprintf(stdout,
@@ -1213,43 +3058,41 @@ retry:
 			    __func__);
 		sp->step = STP_HTTP_ERROR;
 		return (0);
+	case -4:
+		if (sp->t_fbend == 0)
+			sp->t_fbend = VTIM_mono();
+		VSC_INC(n_wrongres);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout, "[ERROR] corrupted response header\n");
+		sp->step = STP_HTTP_ERROR;
+		return (0);
 	default:
 		if (l == 0)
 			goto retry;
 		assert(l > 0);
 	}
-	if (isnan(sp->t_fbend))
-		sp->t_fbend = TIM_real();
-	r = http_probe_splitheader(sp);
-	if (r == -1) {
-		VSC_C_main->n_wrongres++;
-		if (params->diag_bitmap & 0x2)
-			fprintf(stdout, "[ERROR] corrupted response header\n");
-		sp->step = STP_HTTP_ERROR;
-		return (0);
+	if (sp->t_fbend == 0)
+		sp->t_fbend = VTIM_mono();
+	if (sp->t_bodystart == 0)
+		sp->t_bodystart = VTIM_mono();
+	if (sp->flags & SESS_F_TFO) {
+		sp->flags &= ~SESS_F_TFO;
+		ses_tfo_check(sp);
 	}
-	if (isnan(sp->t_bodystart))
-		sp->t_bodystart = TIM_real();
-	p = http_find_header(sp->resphdr, "Content-Length");
-	if (p != NULL) {
-		errno = 0;
-		sp->cl = strtoul(p, &end, 0);
-		if (errno == ERANGE || end == p || *end)
-			assert(0 == 1);
-		VSC_C_main->n_resstraight++;
+	ses_bodystart(sp->url, &sp->bc);
+	if (htc->hflags & HTC_F_CL) {
+		sp->cl = htc->cl;
+		VSC_INC(n_resstraight);
 		sp->step = STP_HTTP_RXRESP_CL;
 		return (0);
 	}
-	p = http_find_header(sp->resphdr, "Transfer-Encoding");
-	if (p != NULL && !strcmp(p, "chunked")) {
-		VSC_C_main->n_reschunked++;
-		sp->nobuf = WS_Alloc(sp->ws, SESS_NOBUFSIZ);
-		AN(sp->nobuf);
+	if (htc->hflags & HTC_F_CHUNKED) {
+		VSC_INC(n_reschunked);
 		sp->nooffset = 0;
 		sp->step = STP_HTTP_RXRESP_CHUNKED_INIT;
 		return (0);
 	}
-	VSC_C_main->n_reseof++;
+	VSC_INC(n_reseof);
 	sp->flags |= SESS_F_EOF;
 	sp->step = STP_HTTP_RXRESP_EOF;
 	return (0);
@@ -1272,8 +3115,8 @@ cnt_http_rxresp_cl(struct sess *sp)
 				SES_Wait(sp, SESS_WANT_READ);
 				return (1);
 			}
-			if (isnan(sp->t_bodyend))
-				sp->t_bodyend = TIM_real();
+			if (sp->t_bodyend == 0)
+				sp->t_bodyend = VTIM_mono();
 			SES_errno(errno);
 			if (params->diag_bitmap & 0x2)
 				fprintf(stdout,
@@ -1283,10 +3126,11 @@ cnt_http_rxresp_cl(struct sess *sp)
 			return (0);
 		}
 		sp->roffset += l;
+		ses_bodycheck(sp->url, &sp->bc, buf, l);
 		assert(sp->roffset <= sp->cl);
 	}
-	if (isnan(sp->t_bodyend))
-		sp->t_bodyend = TIM_real();
+	if (sp->t_bodyend == 0)
+		sp->t_bodyend = VTIM_mono();
 	sp->step = STP_HTTP_OK;
 	return (0);
 }
@@ -1295,7 +3139,6 @@ static int
 cnt_http_rxresp_chunked_init(struct sess *sp)
 {
 
-	AN(sp->nobuf);
 	sp->nooffset = 0;
 	sp->step = STP_HTTP_RXRESP_CHUNKED_NO;
 	return (0);
@@ -1317,8 +3160,8 @@ retry:
 			SES_Wait(sp, SESS_WANT_READ);
 			return (1);
 		}
-		if (isnan(sp->t_bodyend))
-			sp->t_bodyend = TIM_real();
+		if (sp->t_bodyend == 0)
+			sp->t_bodyend = VTIM_mono();
 		SES_errno(errno);
 		if (params->diag_bitmap & 0x2)
 			fprintf(stdout,
@@ -1359,8 +3202,8 @@ cnt_http_rxresp_chunked_body(struct sess *sp)
 				SES_Wait(sp, SESS_WANT_READ);
 				return (1);
 			}
-			if (isnan(sp->t_bodyend))
-				sp->t_bodyend = TIM_real();
+			if (sp->t_bodyend == 0)
+				sp->t_bodyend = VTIM_mono();
 			SES_errno(errno);
 			if (params->diag_bitmap & 0x2)
 				fprintf(stdout,
@@ -1370,6 +3213,7 @@ cnt_http_rxresp_chunked_body(struct sess *sp)
 			return (0);
 		}
 		sp->nooffset += l;
+		ses_bodycheck(sp->url, &sp->bc, buf, l);
 		assert(sp->nooffset <= sp->no);
 	}
 	assert(sp->nooffset == sp->no);
@@ -1393,8 +3237,8 @@ retry:
 			SES_Wait(sp, SESS_WANT_READ);
 			return (1);
 		}
-		if (isnan(sp->t_bodyend))
-			sp->t_bodyend = TIM_real();
+		if (sp->t_bodyend == 0)
+			sp->t_bodyend = VTIM_mono();
 		SES_errno(errno);
 		if (params->diag_bitmap & 0x2)
 			fprintf(stdout,
@@ -1414,8 +3258,8 @@ retry:
 		sp->step = STP_HTTP_RXRESP_CHUNKED_INIT;
 		return (0);
 	}
-	if (isnan(sp->t_bodyend))
-		sp->t_bodyend = TIM_real();
+	if (sp->t_bodyend == 0)
+		sp->t_bodyend = VTIM_mono();
 	sp->step = STP_HTTP_OK;
 	return (0);
 }
@@ -1436,8 +3280,8 @@ cnt_http_rxresp_eof(struct sess *sp)
 				SES_Wait(sp, SESS_WANT_READ);
 				return (1);
 			}
-			if (isnan(sp->t_bodyend))
-				sp->t_bodyend = TIM_real();
+			if (sp->t_bodyend == 0)
+				sp->t_bodyend = VTIM_mono();
 			SES_errno(errno);
 			if (params->diag_bitmap & 0x2)
 				fprintf(stdout,
@@ -1449,77 +3293,108 @@ cnt_http_rxresp_eof(struct sess *sp)
 		if (l == 0)
 			break;
 		sp->roffset += l;
+		ses_bodycheck(sp->url, &sp->bc, buf, l);
 	}
-	if (isnan(sp->t_bodyend))
-		sp->t_bodyend = TIM_real();
+	if (sp->t_bodyend == 0)
+		sp->t_bodyend = VTIM_mono();
 	sp->step = STP_HTTP_OK;
 	return (0);
 }
 
+/*--------------------------------------------------------------------
+ * Count a response status
+ */
+
+static void
+ses_status(int v)
+{
+
+	assert(v >= 0);
+	if (v >= PEFSTAT_STATUS_MAX)
+		VSC_C_main->n_statusother++;
+	else {
+		VSC_C_main->n_status[v]++;
+		/*
+		 * XXX WG: common on weongyo... Use your brain more!
+		 */
+		switch (v / 100) {
+		case 0:
+			VSC_INC(n_status_0xx);
+			break;
+		case 1:
+			VSC_INC(n_status_1xx);
+			break;
+		case 2:
+			VSC_INC(n_status_2xx);
+			break;
+		case 3:
+			VSC_INC(n_status_3xx);
+			break;
+		case 4:
+			VSC_INC(n_status_4xx);
+			break;
+		case 5:
+			VSC_INC(n_status_5xx);
+			break;
+		case 6:
+			VSC_INC(n_status_6xx);
+			break;
+		case 7:
+			VSC_INC(n_status_7xx);
+			break;
+		case 8:
+			VSC_INC(n_status_8xx);
+			break;
+		case 9:
+			VSC_INC(n_status_9xx);
+			break;
+		default:
+			WRONG("[CRIT] Unexpected value...");
+		}
+	}
+}
+
 static int
 cnt_http_ok(struct sess *sp)
 {
-	long int http_status;
-	int v;
-	char *endptr = NULL;
+	const char *p;
 
-	VSC_C_main->n_httpok++;
+	if (sp->url->vflags != 0 && ses_bodyverify(sp->url, &sp->bc)) {
+		VSC_INC(n_bodymismatch);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout,
+			    "[ERROR] response body doesn't match (%zd bytes)\n",
+			    sp->bc.vbytes);
+		sp->step = STP_HTTP_ERROR;
+		return (0);
+	}
+	VSC_INC(n_httpok);
+	SES_AcctReq(sp, sp->htc.status, sp->bc.vbytes);
 
-	if (sp->resphdr[1] != NULL) {
-		errno = 0;
-		http_status = strtol(sp->resphdr[1], &endptr, 10);
-		if ((errno == ERANGE &&
-		     (http_status == LONG_MAX ||
-		      http_status == LONG_MIN)) ||
-		    (errno != 0 && http_status == 0) ||
-		    (sp->resphdr[1] == endptr))
-			goto skip;
-		if (http_status >= PEFSTAT_STATUS_MAX)
-			VSC_C_main->n_statusother++;
-		else {
-			v = (int)http_status;
-			VSC_C_main->n_status[v]++;
-			/*
-			 * XXX WG: common on weongyo... Use your brain more!
-			 */
-			switch (v / 100) {
-			case 0:
-				VSC_C_main->n_status_0xx++;
-				break;
-			case 1:
-				VSC_C_main->n_status_1xx++;
-				break;
-			case 2:
-				VSC_C_main->n_status_2xx++;
-				break;
-			case 3:
-				VSC_C_main->n_status_3xx++;
-				break;
-			case 4:
-				VSC_C_main->n_status_4xx++;
-				break;
-			case 5:
-				VSC_C_main->n_status_5xx++;
-				break;
-			case 6:
-				VSC_C_main->n_status_6xx++;
-				break;
-			case 7:
-				VSC_C_main->n_status_7xx++;
-				break;
-			case 8:
-				VSC_C_main->n_status_8xx++;
-				break;
-			case 9:
-				VSC_C_main->n_status_9xx++;
-				break;
-			default:
-				WRONG("[CRIT] Unexpected value...");
-			}
-		}
+	/* Varnish puts two XIDs in X-Varnish for a hit, one otherwise. */
+	p = HTC_GetHdr(&sp->htc, HDR_X_VARNISH);
+	if (p != NULL) {
+		if (strchr(p, ' ') != NULL)
+			VSC_INC(n_vhit);
+		else
+			VSC_INC(n_vmiss);
+	}
+
+	ses_status(sp->htc.status);
+	assert(sp->npending > 0);
+	if (--sp->npending > 0) {
+		/* The rest of the batch is lost if the server closes. */
+		if ((sp->flags & SESS_F_EOF) == 0 &&
+		    (sp->htc.hflags & HTC_F_CLOSE) == 0)
+			sp->step = STP_HTTP_RXRESP;
+		else
+			sp->step = STP_HTTP_DONE;
+		return (0);
 	}
-skip:
-	if ((sp->flags & SESS_F_EOF) == 0 && sp->calls < C_arg && !stop) {
+	if ((sp->flags & SESS_F_EOF) == 0 &&
+	    (sp->htc.hflags & HTC_F_CLOSE) == 0 &&
+	    sp->calls < C_arg && sp->conn_nreq < params->pool_max_reqs &&
+	    !stop) {
 		sp->step = STP_HTTP_TXREQ_INIT;
 		callout_reset(&sp->wrk->cb, &sp->co,
 		    CALLOUT_SECTOTICKS(params->write_timeout), cnt_timeout_tick,
@@ -1535,42 +3410,896 @@ static int
 cnt_http_error(struct sess *sp)
 {
 
-	VSC_C_main->n_httperror++;
+	VSC_INC(n_httperror);
+	if (sp->err == 0)
+		sp->err = EPROTO;
+	if (sp->t_bodystart == 0)
+		SES_AcctReq(sp, 0, 0);
+	else
+		SES_AcctReq(sp, sp->htc.status, sp->bc.vbytes);
+	if (sp->npending > 0)
+		sp->npending--;
+	sp->flags |= SESS_F_NOREUSE;
 	sp->step = STP_HTTP_DONE;
 	return (0);
 }
 
-static int
-cnt_http_done(struct sess *sp)
-{
-	int i;
-
-	Lck_Lock(&ses_stat_mtx);
-	VSC_C_main->n_conn--;
-	if (m_arg != 0)
-		SES_Rush();
-	Lck_Unlock(&ses_stat_mtx);
-
-	assert(sp->fd >= 0);
-	i = close(sp->fd);
-	assert(i == 0 || errno != EBADF); /* XXX EINVAL seen */
-	sp->fd = -1;
-	sp->step = STP_DONE;
-	return (0);
-}
-
 /*--------------------------------------------------------------------
- * This is the final state, figure out if we should close or recycle
- * the client connection
+ * HTTP/2
+ *
+ * The session keeps up to -streams requests in flight on its connection
+ * and opens the next stream as soon as one is over.  All of it happens
+ * in H2_IO: queue frames, write what the socket takes, handle whatever
+ * came in, and wait on the side that is stuck.
  */
 
-static int
-cnt_done(struct sess *sp)
+#define	H2_DATA			0x0
+#define	H2_HEADERS		0x1
+#define	H2_PRIORITY		0x2
+#define	H2_RST_STREAM		0x3
+#define	H2_SETTINGS		0x4
+#define	H2_PUSH_PROMISE		0x5
+#define	H2_PING			0x6
+#define	H2_GOAWAY		0x7
+#define	H2_WINDOW_UPDATE	0x8
+#define	H2_CONTINUATION		0x9
+
+#define	H2_FL_END_STREAM	0x01
+#define	H2_FL_ACK		0x01
+#define	H2_FL_END_HEADERS	0x04
+#define	H2_FL_PADDED		0x08
+#define	H2_FL_PRIORITY		0x20
+
+#define	H2_SET_HEADER_TABLE_SIZE	0x1
+#define	H2_SET_ENABLE_PUSH		0x2
+#define	H2_SET_MAX_CONCURRENT_STREAMS	0x3
+#define	H2_SET_INITIAL_WINDOW_SIZE	0x4
+#define	H2_SET_MAX_FRAME_SIZE		0x5
+
+#define	H2_ERR_NO_ERROR		0x0
+#define	H2_ERR_PROTOCOL		0x1
+#define	H2_ERR_FLOW_CONTROL	0x3
+#define	H2_ERR_FRAME_SIZE	0x6
+#define	H2_ERR_COMPRESSION	0x9
+
+#define	H2_TXHIGH		(64 * 1024)	/* enough DATA queued */
+
+static uint32_t
+h2_get32(const unsigned char *p)
 {
 
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	return ((uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	    (uint32_t)p[2] << 8 | p[3]);
+}
+
+static void
+h2_put32(unsigned char *p, uint32_t v)
+{
+
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static unsigned char *
+h2_txspace(struct h2conn *h2, size_t len)
+{
+
+	if (h2->txoff > 0 && h2->txlen + len > h2->txsize) {
+		memmove(h2->tx, h2->tx + h2->txoff, h2->txlen - h2->txoff);
+		h2->txlen -= h2->txoff;
+		h2->txoff = 0;
+	}
+	if (h2->txlen + len > h2->txsize) {
+		h2->txsize = MAX(2 * h2->txsize, h2->txlen + len);
+		h2->tx = realloc(h2->tx, h2->txsize);
+		XXXAN(h2->tx);
+	}
+	return (h2->tx + h2->txlen);
+}
+
+static void
+h2_framehdr(unsigned char *p, size_t len, unsigned type, unsigned flags,
+    uint32_t id)
+{
+
+	assert(len <= 0xffffff);
+	p[0] = len >> 16;
+	p[1] = len >> 8;
+	p[2] = len;
+	p[3] = type;
+	p[4] = flags;
+	h2_put32(p + 5, id);
+}
+
+static void
+h2_queue(struct h2conn *h2, unsigned type, unsigned flags, uint32_t id,
+    const void *payload, size_t len)
+{
+	unsigned char *p;
+
+	p = h2_txspace(h2, H2_FRAMEHDR + len);
+	h2_framehdr(p, len, type, flags, id);
+	if (len > 0)
+		memcpy(p + H2_FRAMEHDR, payload, len);
+	h2->txlen += H2_FRAMEHDR + len;
+}
+
+/* WINDOW_UPDATE and RST_STREAM */
+static void
+h2_queue32(struct h2conn *h2, unsigned type, uint32_t id, uint32_t v)
+{
+	unsigned char b[4];
+
+	h2_put32(b, v);
+	h2_queue(h2, type, 0, id, b, sizeof b);
+}
+
+static struct h2stream *
+h2_stream(const struct h2conn *h2, uint32_t id)
+{
+	struct h2stream *st;
+
+	if ((id & 1) == 0 || h2->nst == 0)
+		return (NULL);
+	st = &h2->st[(id >> 1) & (h2->nst - 1)];
+	return (st->id == id ? st : NULL);
+}
+
+static void
+h2_stream_free(struct sess *sp, struct h2stream *st)
+{
+	struct h2conn *h2 = sp->h2;
+
+	if (st->boff < sp->url->bodylen) {
+		assert(h2->nbody > 0);
+		h2->nbody--;
+	}
+	st->id = 0;
+	assert(h2->nactive > 0);
+	h2->nactive--;
+	assert(sp->npending > 0);
+	sp->npending--;
+}
+
+/*
+ * A stream is over, one way or another.  Its times go into the same
+ * first byte and body columns as an HTTP/1 response does.
+ */
+
+static void
+h2_stream_done(struct sess *sp, struct h2stream *st, int ok)
+{
+	uint64_t now = VTIM_mono();
+
+	if (ok && sp->url->vflags != 0 && ses_bodyverify(sp->url, &st->bc)) {
+		VSC_INC(n_bodymismatch);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout, "[ERROR] response body of stream %u "
+			    "doesn't match (%zd bytes)\n", st->id,
+			    st->bc.vbytes);
+		ok = 0;
+	}
+	sp->t_fbstart = st->t_start;
+	sp->t_fbend = st->t_hdr == 0 ? now : st->t_hdr;
+	sp->t_bodystart = st->t_hdr;
+	sp->t_bodyend = now;
+	if (!ok && sp->err == 0)
+		sp->err = EPROTO;
+	SES_AcctReq(sp, st->status, st->bc.vbytes);
+	if (ok) {
+		VSC_INC(n_httpok);
+		if (st->flags & H2S_F_VHIT)
+			VSC_INC(n_vhit);
+		else if (st->flags & H2S_F_VMISS)
+			VSC_INC(n_vmiss);
+		ses_status(st->status);
+	} else
+		VSC_INC(n_httperror);
+	h2_stream_free(sp, st);
+}
+
+/*
+ * Something is wrong with the connection as a whole.  Tell the server
+ * why if the socket takes it, and give up on the connection.
+ */
+
+static int
+h2_connerr(struct sess *sp, unsigned err, const char *why)
+{
+	struct h2conn *h2 = sp->h2;
+	struct iovec iov;
+	unsigned char b[8];
+
+	VSC_INC(n_h2proto);
+	if (params->diag_bitmap & 0x2)
+		fprintf(stdout, "[ERROR] HTTP/2 to %s: %s\n", sp->tgt->name,
+		    why);
+	h2_put32(b, 0);
+	h2_put32(b + 4, err);
+	h2_queue(h2, H2_GOAWAY, 0, 0, b, sizeof b);
+	iov.iov_base = h2->tx + h2->txoff;
+	iov.iov_len = h2->txlen - h2->txoff;
+	(void)ses_writev(sp, &iov, 1);
+	sp->flags |= SESS_F_NOREUSE;
+	sp->step = STP_HTTP_ERROR;
+	return (-1);
+}
+
+/*--------------------------------------------------------------------
+ * Response headers
+ */
+
+struct h2hdrs {
+	int			status;
+	unsigned		flags;
+};
+
+static void
+h2_hdr(void *priv, const char *name, size_t nlen, const char *val,
+    size_t vlen)
+{
+	struct h2hdrs *hh = priv;
+
+	if (nlen == 7 && !memcmp(name, ":status", 7)) {
+		if (vlen == 3 && vct_isdigit(val[0]) &&
+		    vct_isdigit(val[1]) && vct_isdigit(val[2]))
+			hh->status = (val[0] - '0') * 100 +
+			    (val[1] - '0') * 10 + (val[2] - '0');
+	} else if (nlen == 9 && !memcmp(name, "x-varnish", 9))
+		hh->flags |= memchr(val, ' ', vlen) != NULL ?
+		    H2S_F_VHIT : H2S_F_VMISS;
+}
+
+/*
+ * Every header block is decoded, even one for a stream we gave up on,
+ * or the HPACK tables would go out of step.
+ */
+
+static int
+h2_hdrblock(struct sess *sp)
+{
+	struct h2conn *h2 = sp->h2;
+	struct h2stream *st;
+	struct h2hdrs hh;
+	unsigned end;
+
+	st = h2_stream(h2, h2->hb_id);
+	end = h2->hb_end;
+	hh.status = -1;
+	hh.flags = 0;
+	if (VHPACK_Decode(h2->dec, h2->hb, h2->hblen, h2_hdr, &hh))
+		return (h2_connerr(sp, H2_ERR_COMPRESSION,
+		    "HPACK decoding failed"));
+	h2->hb_id = 0;
+	h2->hblen = 0;
+	if (st == NULL)
+		return (0);
+	if ((st->flags & H2S_F_HDR) == 0) {
+		if (hh.status >= 100 && hh.status < 200 && !end)
+			return (0);		/* 1xx, the real one follows */
+		if (hh.status < 0) {
+			VSC_INC(n_wrongres);
+			if (params->diag_bitmap & 0x2)
+				fprintf(stdout, "[ERROR] stream %u: response "
+				    "without :status\n", st->id);
+			h2_queue32(h2, H2_RST_STREAM, st->id, H2_ERR_PROTOCOL);
+			h2_stream_done(sp, st, 0);
+			return (0);
+		}
+		st->flags |= H2S_F_HDR | hh.flags;
+		st->status = hh.status;
+		st->t_hdr = VTIM_mono();
+		ses_bodystart(sp->url, &st->bc);
+	}
+	if (end)
+		h2_stream_done(sp, st, 1);
+	return (0);
+}
+
+static int
+h2_hbappend(struct sess *sp, const unsigned char *p, size_t len,
+    unsigned flags)
+{
+	struct h2conn *h2 = sp->h2;
+
+	if (h2->hblen + len > params->http_resp_size) {
+		VSC_INC(n_toolonghdr);
+		return (h2_connerr(sp, H2_ERR_PROTOCOL,
+		    "too big header block"));
+	}
+	if (h2->hblen + len > h2->hbsize) {
+		h2->hbsize = MAX(2 * h2->hbsize, h2->hblen + len);
+		h2->hb = realloc(h2->hb, h2->hbsize);
+		XXXAN(h2->hb);
+	}
+	if (len > 0)
+		memcpy(h2->hb + h2->hblen, p, len);
+	h2->hblen += len;
+	if (flags & H2_FL_END_HEADERS)
+		return (h2_hdrblock(sp));
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Handle one frame from the server
+ */
+
+static int
+h2_settings(struct sess *sp, const unsigned char *p, size_t len)
+{
+	struct h2conn *h2 = sp->h2;
+	uint32_t v;
+	int64_t d;
+	unsigned u;
+	size_t i;
+
+	if (len % 6 != 0)
+		return (h2_connerr(sp, H2_ERR_FRAME_SIZE, "bad SETTINGS"));
+	for (i = 0; i < len; i += 6) {
+		v = h2_get32(p + i + 2);
+		switch (p[i] << 8 | p[i + 1]) {
+		case H2_SET_HEADER_TABLE_SIZE:
+			VHPACK_SetLimit(h2->enc, v);
+			break;
+		case H2_SET_MAX_CONCURRENT_STREAMS:
+			h2->peer_maxstreams = v;
+			break;
+		case H2_SET_INITIAL_WINDOW_SIZE:
+			if (v > H2_MAXWIN)
+				return (h2_connerr(sp, H2_ERR_FLOW_CONTROL,
+				    "bad SETTINGS_INITIAL_WINDOW_SIZE"));
+			/* applies to the streams already open too */
+			d = (int64_t)v - h2->peer_initwin;
+			for (u = 0; u < h2->nst; u++)
+				if (h2->st[u].id != 0)
+					h2->st[u].swin += d;
+			h2->peer_initwin = v;
+			break;
+		case H2_SET_MAX_FRAME_SIZE:
+			if (v < H2_MAXFRAME || v > 0xffffff)
+				return (h2_connerr(sp, H2_ERR_PROTOCOL,
+				    "bad SETTINGS_MAX_FRAME_SIZE"));
+			h2->peer_maxframe = v;
+			break;
+		default:
+			break;
+		}
+	}
+	h2->flags |= H2_F_SETTINGS;
+	h2_queue(h2, H2_SETTINGS, H2_FL_ACK, 0, NULL, 0);
+	return (0);
+}
+
+static int
+h2_frame(struct sess *sp, unsigned type, unsigned flags, uint32_t id,
+    const unsigned char *p, size_t len)
+{
+	struct h2conn *h2 = sp->h2;
+	struct h2stream *st;
+	size_t pad = 0;
+	uint32_t v;
+	unsigned u;
+
+	if (h2->hb_id != 0 && (type != H2_CONTINUATION || id != h2->hb_id))
+		return (h2_connerr(sp, H2_ERR_PROTOCOL,
+		    "header block interrupted"));
+	switch (type) {
+	case H2_DATA:
+		if (id == 0)
+			return (h2_connerr(sp, H2_ERR_PROTOCOL,
+			    "DATA on stream 0"));
+		/* Padding counts against the windows too */
+		h2->crxunacked += len;
+		if (h2->crxunacked >= H2_CONNWIN / 2) {
+			h2_queue32(h2, H2_WINDOW_UPDATE, 0, h2->crxunacked);
+			h2->crxunacked = 0;
+		}
+		if (flags & H2_FL_PADDED) {
+			if (len < 1 || p[0] >= len)
+				return (h2_connerr(sp, H2_ERR_PROTOCOL,
+				    "bad DATA padding"));
+			pad = p[0] + 1;
+		}
+		st = h2_stream(h2, id);
+		if (st == NULL)
+			break;			/* reset, or never ours */
+		if ((st->flags & H2S_F_HDR) == 0) {
+			h2_queue32(h2, H2_RST_STREAM, id, H2_ERR_PROTOCOL);
+			h2_stream_done(sp, st, 0);
+			break;
+		}
+		ses_bodycheck(sp->url, &st->bc, (const char *)p + (pad > 0),
+		    len - pad);
+		if (flags & H2_FL_END_STREAM) {
+			h2_stream_done(sp, st, 1);
+			break;
+		}
+		st->rxunacked += len;
+		if (st->rxunacked >= params->h2_window / 2) {
+			h2_queue32(h2, H2_WINDOW_UPDATE, id, st->rxunacked);
+			st->rxunacked = 0;
+		}
+		break;
+	case H2_HEADERS:
+		if (id == 0)
+			return (h2_connerr(sp, H2_ERR_PROTOCOL,
+			    "HEADERS on stream 0"));
+		if (flags & H2_FL_PADDED) {
+			if (len < 1)
+				return (h2_connerr(sp, H2_ERR_FRAME_SIZE,
+				    "bad HEADERS"));
+			pad = p[0];
+			p++;
+			len--;
+		}
+		if (flags & H2_FL_PRIORITY) {
+			if (len < 5)
+				return (h2_connerr(sp, H2_ERR_FRAME_SIZE,
+				    "bad HEADERS"));
+			p += 5;
+			len -= 5;
+		}
+		if (pad > len)
+			return (h2_connerr(sp, H2_ERR_PROTOCOL,
+			    "bad HEADERS padding"));
+		h2->hb_id = id;
+		h2->hb_end = flags & H2_FL_END_STREAM;
+		return (h2_hbappend(sp, p, len - pad, flags));
+	case H2_CONTINUATION:
+		if (id == 0 || id != h2->hb_id)
+			return (h2_connerr(sp, H2_ERR_PROTOCOL,
+			    "CONTINUATION out of place"));
+		return (h2_hbappend(sp, p, len, flags));
+	case H2_RST_STREAM:
+		if (id == 0 || len != 4)
+			return (h2_connerr(sp, H2_ERR_PROTOCOL,
+			    "bad RST_STREAM"));
+		st = h2_stream(h2, id);
+		if (st == NULL)
+			break;
+		VSC_INC(n_h2rst);
+		if (params->diag_bitmap & 0x2)
+			fprintf(stdout, "[ERROR] stream %u reset by %s, "
+			    "error %u\n", id, sp->tgt->name, h2_get32(p));
+		h2_stream_done(sp, st, 0);
+		break;
+	case H2_SETTINGS:
+		if (id != 0)
+			return (h2_connerr(sp, H2_ERR_PROTOCOL,
+			    "SETTINGS on a stream"));
+		if (flags & H2_FL_ACK)
+			break;
+		return (h2_settings(sp, p, len));
+	case H2_PUSH_PROMISE:
+		return (h2_connerr(sp, H2_ERR_PROTOCOL,
+		    "PUSH_PROMISE though push is off"));
+	case H2_PING:
+		if (id != 0 || len != 8)
+			return (h2_connerr(sp, H2_ERR_FRAME_SIZE, "bad PING"));
+		if ((flags & H2_FL_ACK) == 0)
+			h2_queue(h2, H2_PING, H2_FL_ACK, 0, p, len);
+		break;
+	case H2_GOAWAY:
+		if (id != 0 || len < 8)
+			return (h2_connerr(sp, H2_ERR_FRAME_SIZE,
+			    "bad GOAWAY"));
+		VSC_INC(n_h2goaway);
+		h2->flags |= H2_F_GOAWAY;
+		v = h2_get32(p) & H2_MAXWIN;
+		if (h2_get32(p + 4) != H2_ERR_NO_ERROR &&
+		    (params->diag_bitmap & 0x2))
+			fprintf(stdout, "[ERROR] GOAWAY from %s, error %u\n",
+			    sp->tgt->name, h2_get32(p + 4));
+		/* Streams past the last one it took won't be answered */
+		for (u = 0; u < h2->nst; u++) {
+			st = &h2->st[u];
+			if (st->id > v) {
+				VSC_INC(n_pipedrop);
+				h2_stream_free(sp, st);
+			}
+		}
+		break;
+	case H2_WINDOW_UPDATE:
+		if (len != 4)
+			return (h2_connerr(sp, H2_ERR_FRAME_SIZE,
+			    "bad WINDOW_UPDATE"));
+		v = h2_get32(p) & H2_MAXWIN;
+		if (id == 0) {
+			h2->cwin += v;
+			if (v == 0 || h2->cwin > H2_MAXWIN)
+				return (h2_connerr(sp, H2_ERR_FLOW_CONTROL,
+				    "bad WINDOW_UPDATE"));
+			break;
+		}
+		st = h2_stream(h2, id);
+		if (st != NULL)
+			st->swin += v;
+		break;
+	default:
+		break;		/* PRIORITY and unknown types */
+	}
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Open streams up to -streams and the server's limit.  The header block
+ * is encoded behind room for as many frame headers as it might need and
+ * is then split into HEADERS and CONTINUATION frames in place.
+ */
+
+static int
+h2_canopen(const struct sess *sp)
+{
+	const struct h2conn *h2 = sp->h2;
+
+	return (sp->calls < C_arg && sp->conn_nreq < params->pool_max_reqs &&
+	    !stop && (h2->flags & H2_F_GOAWAY) == 0 &&
+	    h2->next_id < H2_MAXWIN);
+}
+
+static void
+h2_open(struct sess *sp)
+{
+	struct h2conn *h2 = sp->h2;
+	struct url *url = sp->url;
+	const struct h2field *f;
+	struct h2stream *st;
+	unsigned char *p, *b, *d;
+	unsigned limit, nf, fl;
+	ssize_t l, n, o, c;
+	uint64_t now = 0;
+	struct treq tr;
+	char tbuf[TMPL_MAXLEN];
+	size_t tl;
+	int i;
+
+	limit = (h2->flags & H2_F_SETTINGS) ? h2->peer_maxstreams :
+	    H2_DEFSTREAMS;
+	limit = MIN(limit, url->streams);
+	while (h2->nactive < limit && h2_canopen(sp)) {
+		st = &h2->st[(h2->next_id >> 1) & (h2->nst - 1)];
+		if (st->id != 0)
+			break;		/* an old slow one still has it */
+		nf = url->h2hdrlen / h2->peer_maxframe + 1;
+		p = h2_txspace(h2, nf * H2_FRAMEHDR + url->h2hdrlen);
+		b = p + nf * H2_FRAMEHDR;
+		l = VHPACK_Begin(h2->enc, b, url->h2hdrlen);
+		assert(l >= 0);
+		if (url->tflags != 0)
+			treq_start(url, sp->wrk, &tr);
+		for (i = 0, f = url->h2f; i < url->nh2f; i++, f++) {
+			if (f->t != NULL) {
+				tl = tmpl_render(f->t, sp->wrk, &tr, tbuf);
+				n = VHPACK_EncodeLiteral(h2->enc, b + l,
+				    url->h2hdrlen - l, f->name, f->nlen, tbuf,
+				    tl);
+			} else
+				n = VHPACK_Encode(h2->enc, b + l,
+				    url->h2hdrlen - l, f->name, f->nlen,
+				    f->val, f->vlen);
+			assert(n >= 0);
+			l += n;
+		}
+		for (d = p, o = 0; o == 0 || o < l; o += c) {
+			c = MIN(l - o, h2->peer_maxframe);
+			fl = o + c == l ? H2_FL_END_HEADERS : 0;
+			if (o == 0 && url->bodylen == 0)
+				fl |= H2_FL_END_STREAM;
+			h2_framehdr(d, c, o == 0 ? H2_HEADERS :
+			    H2_CONTINUATION, fl, h2->next_id);
+			if (d + H2_FRAMEHDR != b + o)
+				memmove(d + H2_FRAMEHDR, b + o, c);
+			d += H2_FRAMEHDR + c;
+			if (c == 0)
+				break;
+		}
+		h2->txlen += d - p;
+
+		if (now == 0)
+			now = VTIM_mono();
+		memset(st, 0, sizeof *st);
+		st->id = h2->next_id;
+		h2->next_id += 2;
+		st->swin = h2->peer_initwin;
+		st->t_start = now;
+		st->t_hdr = 0;
+		if (url->bodylen > 0)
+			h2->nbody++;
+		h2->nactive++;
+		sp->npending++;
+		sp->calls++;
+		sp->conn_nreq++;
+		VSC_INC(n_req);
+		VSC_INC(n_h2stream);
+	}
+}
+
+/*
+ * Queue request bodies as far as the flow control windows let us.
+ */
+
+static void
+h2_body(struct sess *sp)
+{
+	struct h2conn *h2 = sp->h2;
+	const struct url *url = sp->url;
+	struct h2stream *st;
+	unsigned u;
+	int64_t n;
+
+	for (u = 0; u < h2->nst && h2->nbody > 0; u++) {
+		st = &h2->st[u];
+		if (st->id == 0)
+			continue;
+		while (st->boff < url->bodylen &&
+		    h2->txlen - h2->txoff < H2_TXHIGH) {
+			n = url->bodylen - st->boff;
+			n = MIN(n, st->swin);
+			n = MIN(n, h2->cwin);
+			n = MIN(n, h2->peer_maxframe);
+			if (n <= 0)
+				break;
+			h2_queue(h2, H2_DATA, st->boff + n == url->bodylen ?
+			    H2_FL_END_STREAM : 0, st->id, url->body + st->boff,
+			    n);
+			st->boff += n;
+			st->swin -= n;
+			h2->cwin -= n;
+			if (st->boff == url->bodylen)
+				h2->nbody--;
+		}
+	}
+}
+
+/*--------------------------------------------------------------------
+ * A new connection starts with the preface and our SETTINGS; one from
+ * the pool only needs enough stream slots for this url.
+ */
+
+static int
+cnt_h2_init(struct sess *sp)
+{
+	struct h2conn *h2;
+	unsigned char b[12];
+	unsigned n;
+
+	if (sp->h2 == NULL) {
+		sp->h2 = h2 = H2_New();
+		VSC_INC(n_h2conn);
+		memcpy(h2_txspace(h2, sizeof(H2_PREFACE) - 1), H2_PREFACE,
+		    sizeof(H2_PREFACE) - 1);
+		h2->txlen += sizeof(H2_PREFACE) - 1;
+		b[0] = 0;
+		b[1] = H2_SET_ENABLE_PUSH;
+		h2_put32(b + 2, 0);
+		b[6] = 0;
+		b[7] = H2_SET_INITIAL_WINDOW_SIZE;
+		h2_put32(b + 8, params->h2_window);
+		h2_queue(h2, H2_SETTINGS, 0, 0, b, sizeof b);
+		h2_queue32(h2, H2_WINDOW_UPDATE, 0, H2_CONNWIN - H2_DEFWIN);
+	}
+	h2 = sp->h2;
+	CHECK_OBJ_NOTNULL(h2, H2CONN_MAGIC);
+	AZ(h2->nactive);
+	for (n = 2; n < 2 * sp->url->streams; n <<= 1)
+		continue;
+	if (n > h2->nst) {
+		free(h2->st);
+		h2->st = calloc(n, sizeof *h2->st);
+		XXXAN(h2->st);
+		h2->nst = n;
+	}
+	sp->npending = 0;
+	sp->step = STP_H2_IO;
+	return (0);
+}
+
+static int
+cnt_h2_io(struct sess *sp)
+{
+	struct h2conn *h2 = sp->h2;
+	struct iovec iov;
+	const unsigned char *p;
+	size_t off, len;
+	ssize_t l;
+	int want;
+
+	CHECK_OBJ_NOTNULL(h2, H2CONN_MAGIC);
+	for (;;) {
+		h2_open(sp);
+		if (h2->nbody > 0)
+			h2_body(sp);
+		want = SESS_WANT_READ;
+		if (h2->txoff < h2->txlen) {
+			iov.iov_base = h2->tx + h2->txoff;
+			iov.iov_len = h2->txlen - h2->txoff;
+			l = ses_writev(sp, &iov, 1);
+			if (l < 0 && errno != EAGAIN && errno != EINPROGRESS) {
+				SES_errno(errno);
+				if (params->diag_bitmap & 0x2)
+					fprintf(stdout,
+					    "write(2) error: %d %s\n", errno,
+					    strerror(errno));
+				sp->flags |= SESS_F_NOREUSE;
+				sp->step = STP_HTTP_ERROR;
+				return (0);
+			}
+			if (l > 0) {
+				VSC_ADD(n_txbytes, l);
+				h2->txoff += l;
+			}
+			if (h2->txoff == h2->txlen)
+				h2->txoff = h2->txlen = 0;
+			else
+				want |= SESS_WANT_WRITE;
+		}
+
+		l = ses_read(sp, h2->rx + h2->rxlen, H2_RXBUF - h2->rxlen);
+		if (l == 0 && h2->nactive == 0 && !h2_canopen(sp)) {
+			sp->flags |= SESS_F_EOF;
+			break;
+		}
+		if (l == 0 || (l < 0 && errno != EAGAIN)) {
+			SES_errno(l == 0 ? 0 : errno);
+			if (params->diag_bitmap & 0x2)
+				fprintf(stdout, "[ERROR] %s: read(2) error: "
+				    "%s\n", __func__,
+				    l == 0 ? "unexpected EOF" : strerror(errno));
+			sp->flags |= SESS_F_NOREUSE;
+			sp->step = STP_HTTP_ERROR;
+			return (0);
+		}
+		if (l > 0) {
+			VSC_ADD(n_rxbytes, l);
+			h2->rxlen += l;
+			for (off = 0; h2->rxlen - off >= H2_FRAMEHDR;
+			    off += H2_FRAMEHDR + len) {
+				p = h2->rx + off;
+				len = (size_t)p[0] << 16 | p[1] << 8 | p[2];
+				if (len > H2_MAXFRAME) {
+					(void)h2_connerr(sp, H2_ERR_FRAME_SIZE,
+					    "frame too big, not HTTP/2?");
+					return (0);
+				}
+				if (h2->rxlen - off < H2_FRAMEHDR + len)
+					break;
+				if (h2_frame(sp, p[3], p[4],
+				    h2_get32(p + 5) & H2_MAXWIN,
+				    p + H2_FRAMEHDR, len))
+					return (0);
+			}
+			memmove(h2->rx, h2->rx + off, h2->rxlen - off);
+			h2->rxlen -= off;
+			continue;
+		}
+		if (h2->nactive == 0 && !h2_canopen(sp) && h2->txlen == 0)
+			break;
+		callout_reset(&sp->wrk->cb, &sp->co,
+		    CALLOUT_SECTOTICKS(want & SESS_WANT_WRITE ?
+		    params->write_timeout : params->read_timeout),
+		    cnt_timeout_tick, sp);
+		SES_Wait(sp, want);
+		return (1);
+	}
+	if (h2->flags & H2_F_GOAWAY)
+		sp->flags |= SESS_F_NOREUSE;
+	sp->step = STP_HTTP_DONE;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * What the kernel thinks of the connection, for one in tcpinfo_sample
+ * of them as they finish.  Lets a slow first byte be told apart from a
+ * slow network.  glibc's struct tcp_info stops at tcpi_total_retrans;
+ * the fields after it are laid out as in <linux/tcp.h>.
+ */
+
+struct tcpi {
+	struct tcp_info		ti;
+	uint64_t		pacing_rate;
+	uint64_t		max_pacing_rate;
+	uint64_t		bytes_acked;
+	uint64_t		bytes_received;
+	uint32_t		segs_out;
+	uint32_t		segs_in;
+	uint32_t		notsent_bytes;
+	uint32_t		min_rtt;
+	uint32_t		data_segs_in;
+	uint32_t		data_segs_out;
+	uint64_t		delivery_rate;		/* Linux 4.9 */
+};
+
+static void
+TCPI_Sample(struct sess *sp)
+{
+	struct worker *w = sp->wrk;
+	struct vhist *h;
+	struct tcpi t;
+	socklen_t l = sizeof(t);
+
+	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	if (w->tcpi == NULL || sp->tgt->vaddr->va_family == AF_UNIX ||
+	    ++w->ntcpi < params->tcpinfo_sample)
+		return;
+	w->ntcpi = 0;
+	bzero(&t, sizeof(t));
+	VSC_SYS();
+	if (getsockopt(sp->fd, IPPROTO_TCP, TCP_INFO, &t, &l) != 0)
+		return;
+	VSC_INC(n_tcpinfo);
+	h = &w->tcpi[(sp->tgt->bdidx - num_urls) * TCPI_N];
+	VHIST_Add(&h[TCPI_RTT], t.ti.tcpi_rtt);
+	VHIST_Add(&h[TCPI_RTTVAR], t.ti.tcpi_rttvar);
+	VHIST_Add(&h[TCPI_RETRANS], t.ti.tcpi_total_retrans);
+	VHIST_Add(&h[TCPI_CWND], t.ti.tcpi_snd_cwnd);
+	if (l >= sizeof(t))
+		VHIST_Add(&h[TCPI_RATE], t.delivery_rate);
+}
+
+static int
+cnt_http_done(struct sess *sp)
+{
+	int i;
+
+	if (sp->npending > 0) {
+		VSC_ADD(n_pipedrop, sp->npending);
+		sp->npending = 0;
+	}
+	HTC_Fini(&sp->htc, sp->wrk);
+	assert(sp->fd >= 0);
+	if (sp->zc_pending > 0) {
+		ses_zcreap(sp);
+		if (sp->zc_pending > 0)
+			sp->flags |= SESS_F_NOREUSE;	/* can't tell idle */
+	}
+	TCPI_Sample(sp);
+	if (params->pool_max_idle > 0 &&
+	    (sp->flags & (SESS_F_EOF | SESS_F_NOREUSE)) == 0 &&
+	    (sp->htc.hflags & HTC_F_CLOSE) == 0 && !stop &&
+	    TGT_Put(sp->tgt, sp) == 0) {
+		sp->fd = -1;
+		sp->ssl = NULL;
+		sp->h2 = NULL;
+		sp->step = STP_DONE;
+		return (0);
+	}
+
+	Lck_Lock(&ses_stat_mtx);
+	n_conn--;
+	if (m_arg != 0)
+		SES_Rush();
+	Lck_Unlock(&ses_stat_mtx);
+
+	if (!params->linger && (sp->flags & SESS_F_EOF) == 0 &&
+	    (sp->htc.hflags & HTC_F_CLOSE) == 0 &&
+	    sp->tgt->vaddr->va_family != AF_UNIX)
+		VSC_INC(n_closeactive);
+	tls_free(sp->ssl, (sp->flags & SESS_F_NOREUSE) == 0);
+	sp->ssl = NULL;
+	H2_Free(sp->h2);
+	sp->h2 = NULL;
+	VSC_SYS();
+	i = close(sp->fd);
+	assert(i == 0 || errno != EBADF); /* XXX EINVAL seen */
+	sp->fd = -1;
+	sp->step = STP_DONE;
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * This is the final state, figure out if we should close or recycle
+ * the client connection
+ */
+
+static int
+cnt_done(struct sess *sp)
+{
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 
-	sp->t_done = TIM_real();
+	sp->t_done = TIM_batch();
 	SES_Acct(sp);
 
 	assert(sp->fd == -1);
@@ -1596,12 +4325,14 @@ cnt_diag(struct sess *sp, const char *state)
 static void
 CNT_Session(struct sess *sp)
 {
+	struct sess *osp = VSC_C_sp;
 	struct worker *w;
 	int done;
 
 	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
 	w = sp->wrk;
 	CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	VSC_C_sp = sp;
 
 	if (sp->step == STP_FIRST && VTCP_nonblocking(sp->fd)) {
 		if (errno == ECONNRESET)
@@ -1627,576 +4358,1738 @@ CNT_Session(struct sess *sp)
 		sp->stephist[sp->nstephist++ % STEPHIST_MAX] = sp->step;
 #endif
 
-		switch (sp->step) {
-#define STEP(l,u) \
-		    case STP_##u: \
-			if (params->diag_bitmap & 0x01) \
-				cnt_diag(sp, #u); \
-			done = cnt_##l(sp); \
-		        break;
-#include "steps.h"
-#undef STEP
-		default:
-			WRONG("State engine misfire");
+		switch (sp->step) {
+#define STEP(l,u) \
+		    case STP_##u: \
+			if (params->diag_bitmap & 0x01) \
+				cnt_diag(sp, #u); \
+			done = cnt_##l(sp); \
+		        break;
+#include "steps.h"
+#undef STEP
+		default:
+			WRONG("State engine misfire");
+		}
+	}
+	VSC_C_sp = osp;
+}
+
+/*--------------------------------------------------------------------
+ * Queue a workrequest if possible.
+ */
+
+static int
+WRK_Queue(struct sess *sp)
+{
+	struct worker *w;
+	ssize_t l;
+
+	AZ(sp->wrk);
+	/* LRU */
+	Lck_Lock(&workers_mtx);
+	w = VTAILQ_FIRST(&workers);
+	AN(w);
+	VTAILQ_REMOVE(&workers, w, list);
+	VTAILQ_INSERT_TAIL(&workers, w, list);
+	Lck_Unlock(&workers_mtx);
+	/* Queue on the pipe */
+	l = write(w->queue[1], &sp, sizeof(sp));
+	if (l == -1) {
+		if (errno == EAGAIN)
+			return (-2);
+		return (-1);
+	}
+	assert(l == sizeof(sp));
+	return (0);
+}
+
+static void
+WRK_Init(struct worker *w)
+{
+	int i;
+
+	bzero(w, sizeof(*w));
+	w->magic = WORKER_MAGIC;
+	w->fd = epoll_create(1);
+	assert(w->fd >= 0);
+	COT_init(&w->cb);
+	for (i = 0; i < HBF_NCLASS; i++)
+		VTAILQ_INIT(&w->hbf_free[i]);
+	w->lat = calloc(LAT_N, sizeof(*w->lat));
+	AN(w->lat);
+	w->bd = calloc(bd_nrow, sizeof(*w->bd));
+	AN(w->bd);
+	w->rr = calloc(num_urls, sizeof(*w->rr));
+	AN(w->rr);
+	if (params->tcpinfo_sample > 0) {
+		w->tcpi = calloc((bd_srcbase - num_urls) * TCPI_N,
+		    sizeof(*w->tcpi));
+		AN(w->tcpi);
+	}
+
+	AZ(pipe(w->queue));
+	i = fcntl(w->queue[0], F_GETFL);
+	assert(i != -1);
+	i |= O_NONBLOCK;
+	i = fcntl(w->queue[0], F_SETFL, i);
+	assert(i != -1);
+	i = fcntl(w->queue[1], F_GETFL);
+	assert(i != -1);
+	i |= O_NONBLOCK;
+	i = fcntl(w->queue[1], F_SETFL, i);
+	assert(i != -1);
+
+	EVT_Add(w, SESS_WANT_READ, w->queue[0], w);
+}
+
+static void
+WRK_Fini(struct worker *w)
+{
+	struct hbuf *hb;
+	int i;
+
+	for (i = 0; i < HBF_NCLASS; i++) {
+		while ((hb = VTAILQ_FIRST(&w->hbf_free[i])) != NULL) {
+			VTAILQ_REMOVE(&w->hbf_free[i], hb, list);
+			free(hb);
+		}
+	}
+	free(w->lat);
+	free(w->bd);
+	free(w->rr);
+	free(w->tcpi);
+	AZ(close(w->queue[0]));
+	AZ(close(w->queue[1]));
+	COT_fini(&w->cb);
+	AZ(close(w->fd));
+}
+
+static void
+wrk_handleQueue(struct worker *w)
+{
+	ssize_t l;
+
+	VSC_SYS();
+	l = read(w->queue[0], &w->sp, sizeof(w->sp));
+	assert(l == sizeof(w->sp));
+
+	AZ(w->sp->wrk);
+	w->sp->wrk = w;
+	CNT_Session(w->sp);
+	w->sp = NULL;
+}
+
+/*--------------------------------------------------------------------
+ * Seqlock around everything that may touch our counter shard, so the
+ * reporter never sees half of a step (n_req counted but not its bytes).
+ */
+
+static inline void
+wrk_statbegin(struct worker *w)
+{
+
+	w->stat_seq++;
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+wrk_statend(struct worker *w)
+{
+
+	__atomic_store_n(&w->stat_seq, w->stat_seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+wrk_statcopy(const struct worker *w, struct perfstat *dst,
+    struct bdstat *bd)
+{
+	unsigned s1, s2;
+
+	do {
+		while ((s1 = __atomic_load_n(&w->stat_seq, __ATOMIC_ACQUIRE)) &
+		    1)
+			sched_yield();
+		memcpy(dst, &w->stat, sizeof(*dst));
+		memcpy(bd, w->bd, sizeof(*bd) * bd_nrow);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		s2 = __atomic_load_n(&w->stat_seq, __ATOMIC_RELAXED);
+	} while (s1 != s2);
+}
+
+#define	EPOLLEVENT_MAX	(64 * 1024)
+
+static void
+wrk_rusage(struct worker *w, uint64_t now)
+{
+	struct rusage ru;
+
+	VSC_SYS();
+	AZ(getrusage(RUSAGE_THREAD, &ru));
+	VSC_C_main->t_cpuuser = ru.ru_utime.tv_sec + 1e-6 * ru.ru_utime.tv_usec;
+	VSC_C_main->t_cpusys = ru.ru_stime.tv_sec + 1e-6 * ru.ru_stime.tv_usec;
+	w->t_ru = now;
+}
+
+/*
+ * Books a round of the event loop which got n events and started on
+ * them at t0.  The round's length is how late its last event was.
+ */
+
+static void
+wrk_loopacct(struct worker *w, int n, uint64_t t0)
+{
+	uint64_t now = VTIM_mono(), lag, cur;
+
+	wrk_tbatch = 0;
+	wrk_statbegin(w);
+	VSC_SYS();				/* epoll_wait(2) */
+	VSC_C_main->n_loop++;
+	if (n > 0) {
+		VSC_C_main->n_loopev += n;
+		VSC_C_main->t_loop += VTIM_dur(t0, now);
+	}
+	if (VTIM_dur(w->t_ru, now) >= 1. || w->t_ru == 0)
+		wrk_rusage(w, now);
+	wrk_statend(w);
+
+	lag = (now - t0) / 1000;
+	cur = __atomic_load_n(&w->lagmax, __ATOMIC_RELAXED);
+	while (lag > cur && !__atomic_compare_exchange_n(&w->lagmax, &cur,
+	    lag, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		continue;
+}
+
+static void *
+WRK_thread(void *arg)
+{
+	struct epoll_event *ev, *ep;
+	struct sess *sp;
+	struct worker *w;
+	uint64_t t0;
+	int i, n;
+
+	CAST_OBJ_NOTNULL(w, arg, WORKER_MAGIC);
+	w->owner = pthread_self();
+	VSC_C_main = &w->stat;
+	VSC_C_bd = w->bd;
+
+	ev = malloc(sizeof(*ev) * EPOLLEVENT_MAX);
+	AN(ev);
+
+	while (!stop) {
+		CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+
+		wrk_statbegin(w);
+		COT_ticks(&w->cb);
+		COT_clock(&w->cb);
+		wrk_statend(w);
+
+		n = epoll_wait(w->fd, ev, EPOLLEVENT_MAX, 1000);
+		t0 = wrk_tbatch = VTIM_mono();
+		for (ep = ev, i = 0; i < n; i++, ep++) {
+			wrk_statbegin(w);
+			VSC_C_main->t_evwait += VTIM_dur(t0, VTIM_mono());
+			if (ep->data.ptr == w) {
+				wrk_handleQueue(w);
+				wrk_statend(w);
+				continue;
+			}
+			CAST_OBJ_NOTNULL(sp, ep->data.ptr, SESS_MAGIC);
+			assert(w == sp->wrk);
+			sp->wrk = NULL;
+			callout_stop(&w->cb, &sp->co);
+			EVT_Del(w, sp->fd);
+			sp->wrk = w;
+			if (sp->zc_pending > 0)
+				ses_zcreap(sp);		/* or EPOLLERR again */
+			CNT_Session(sp);
+			wrk_statend(w);
+		}
+		wrk_loopacct(w, n, t0);
+	}
+	wrk_statbegin(w);
+	wrk_rusage(w, VTIM_mono());
+	wrk_statend(w);
+
+	if (params->diag_bitmap & 0x4)
+		fprintf(stdout, "[INFO] Finishing the worker thread.\n");
+	free(ev);
+	NEEDLESS_RETURN(NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+/*
+ * For marks which only need to be as good as one round of the event
+ * loop: every event of the round shares the time epoll_wait(2) returned.
+ */
+
+static uint64_t
+TIM_batch(void)
+{
+
+	return (wrk_tbatch != 0 ? wrk_tbatch : VTIM_mono());
+}
+
+static double
+TIM_real(void)
+{
+	struct timespec ts;
+
+	assert(clock_gettime(CLOCK_REALTIME, &ts) == 0);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+static void
+TIM_format(double t, char *p)
+{
+	struct tm tm;
+	time_t tt;
+
+	tt = (time_t) t;
+	(void)gmtime_r(&tt, &tm);
+	AN(strftime(p, TIM_FORMAT_SIZE, "%H:%M:%S", &tm));
+}
+
+static struct timespec
+TIM_timespec(double t)
+{
+	struct timespec tv;
+
+	tv.tv_sec = (time_t)trunc(t);
+	tv.tv_nsec = (int)(1e9 * (t - tv.tv_sec));
+	return (tv);
+}
+
+static void
+TIM_sleep(double t)
+{
+	struct timespec ts;
+
+	ts = TIM_timespec(t);
+	(void)nanosleep(&ts, NULL);
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+EVT_Add(struct worker *wrk, int want, int fd, void *arg)
+{
+	struct epoll_event ev;
+
+	AN(arg);
+	ev.data.ptr = arg;
+	ev.events = EPOLLERR;
+	switch (want) {
+	case SESS_WANT_READ:
+		ev.events |= EPOLLIN | EPOLLPRI;
+		break;
+	case SESS_WANT_WRITE:
+		ev.events |= EPOLLOUT;
+		break;
+	case SESS_WANT_READ | SESS_WANT_WRITE:
+		ev.events |= EPOLLIN | EPOLLPRI | EPOLLOUT;
+		break;
+	default:
+		WRONG("Unknown event type");
+		break;
+	}
+	VSC_SYS();
+	AZ(epoll_ctl(wrk->fd, EPOLL_CTL_ADD, fd, &ev));
+	assert(wrk->nwant >= 0);
+	wrk->nwant++;
+}
+
+static void
+EVT_Del(struct worker *wrk, int fd)
+{
+	struct epoll_event ev = { 0 , { 0 } };
+
+	assert(pthread_equal(wrk->owner, pthread_self()));
+
+	assert(fd >= 0);
+	VSC_SYS();
+	AZ(epoll_ctl(wrk->fd, EPOLL_CTL_DEL, fd, &ev));
+	assert(wrk->nwant > 0);
+	wrk->nwant--;
+}
+
+/*--------------------------------------------------------------------*/
+
+static struct sessmem *
+ses_sm_alloc(void)
+{
+	struct sessmem *sm;
+	unsigned l;
+
+	l = sizeof(*sm) + params->sess_workspace;
+	sm = malloc(l);
+	if (sm == NULL)
+		return (NULL);
+	sm->magic = SESSMEM_MAGIC;
+	sm->workspace = params->sess_workspace;
+	sm->wsp = (void *)(sm + 1);
+	return (sm);
+}
+
+/*--------------------------------------------------------------------
+ * This prepares a session for use, based on its sessmem structure.
+ */
+
+static void
+ses_setup(struct sessmem *sm)
+{
+	struct sess *sp;
+
+	CHECK_OBJ_NOTNULL(sm, SESSMEM_MAGIC);
+	sp = &sm->sess;
+	memset(sp, 0, sizeof *sp);
+
+	/* We assume that the sess has been zeroed by the time we get here */
+	AZ(sp->magic);
+	sp->magic = SESS_MAGIC;
+	sp->mem = sm;
+	sp->mysockaddr = (void*)(&sm->sockaddr[1]);
+	sp->mysockaddrlen = sizeof(sm->sockaddr[1]);
+	sp->mysockaddr->ss_family = PF_UNSPEC;
+	sp->srcidx = -1;
+	WS_Init(sp->ws, "sess workspace", sm->wsp, sm->workspace);
+}
+
+static void
+ses_lat(struct sess *sp, enum lat_phase ph, uint64_t start, uint64_t end)
+{
+	struct bdstat *r[3];
+	double d = VTIM_dur(start, end);
+	int i, n;
+
+	CHECK_OBJ_NOTNULL(sp->wrk, WORKER_MAGIC);
+	VHIST_Add(&sp->wrk->lat[ph], (uint64_t)(d * 1e6));
+	n = vsc_rows(sp, r);
+	for (i = 0; i < n; i++) {
+		if (r[i]->n_lat[ph] == 0 || d < r[i]->t_latmin[ph])
+			r[i]->t_latmin[ph] = d;
+		r[i]->t_latmax[ph] = MAX(r[i]->t_latmax[ph], d);
+		r[i]->n_lat[ph]++;
+		r[i]->t_lat[ph] += d;
+	}
+}
+
+static void
+SES_Acct(struct sess *sp)
+{
+
+	if (sp->t_connstart != 0 &&
+	    sp->t_connend != 0) {
+		ses_lat(sp, LAT_CONN, sp->t_connstart, sp->t_connend);
+		VSC_ADD(t_conntotal, VTIM_dur(sp->t_connstart, sp->t_connend));
+	}
+	if (sp->t_tlsstart != 0 &&
+	    sp->t_tlsend != 0) {
+		ses_lat(sp, LAT_TLS, sp->t_tlsstart, sp->t_tlsend);
+		VSC_ADD(t_tlstotal, VTIM_dur(sp->t_tlsstart, sp->t_tlsend));
+	}
+	SES_AcctReq(sp, 0, 0);
+}
+
+/*--------------------------------------------------------------------
+ * First byte and body times are per request, so this runs as each
+ * response completes rather than once per session.  The -T record of
+ * the request is written here too.
+ */
+
+static void
+SES_AcctReq(struct sess *sp, int status, ssize_t bytes)
+{
+
+	if (sp->wrk->tr != NULL &&
+	    (sp->t_fbstart != 0 || sp->err != 0))
+		TRC_Req(sp, status, bytes);
+	sp->err = 0;
+	if (sp->t_fbstart != 0 &&
+	    sp->t_fbend != 0) {
+		ses_lat(sp, LAT_FB, sp->t_fbstart, sp->t_fbend);
+		ses_lat(sp, LAT_TOTAL, sp->t_fbstart,
+		    sp->t_bodyend == 0 ? sp->t_fbend : sp->t_bodyend);
+		VSC_ADD(t_fbtotal, VTIM_dur(sp->t_fbstart, sp->t_fbend));
+	}
+	if (sp->t_bodystart != 0 &&
+	    sp->t_bodyend != 0) {
+		ses_lat(sp, LAT_BODY, sp->t_bodystart, sp->t_bodyend);
+		VSC_ADD(t_bodytotal, VTIM_dur(sp->t_bodystart, sp->t_bodyend));
+	}
+	sp->t_fbstart = sp->t_fbend = 0;
+	sp->t_bodystart = sp->t_bodyend = 0;
+}
+
+/*--------------------------------------------------------------------
+ * Get a new session, preferably by recycling an already ready one
+ */
+
+static struct sess *
+SES_New(void)
+{
+	struct sessmem *sm;
+	struct sess *sp;
+
+	assert(ses_qp <= 1);
+	sm = VTAILQ_FIRST(&ses_free_mem[ses_qp]);
+	if (sm == NULL) {
+		/*
+		 * If that queue is empty, flip queues holding the lock
+		 * and try the new unlocked queue.
+		 */
+		Lck_Lock(&ses_mem_mtx);
+		ses_qp = 1 - ses_qp;
+		Lck_Unlock(&ses_mem_mtx);
+		sm = VTAILQ_FIRST(&ses_free_mem[ses_qp]);
+	}
+	if (sm != NULL) {
+		VTAILQ_REMOVE(&ses_free_mem[ses_qp], sm, list);
+		sp = &sm->sess;
+		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	} else {
+		sm = ses_sm_alloc();
+		if (sm == NULL)
+			return (NULL);
+		ses_setup(sm);
+		sp = &sm->sess;
+		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	}
+	/* no lock needed */
+	n_sess_grab++;
+
+	return (sp);
+}
+
+/*--------------------------------------------------------------------
+ * Recycle a session.  If the workspace has changed, deleted it,
+ * otherwise wash it, and put it up for adoption.
+ */
+
+static void
+SES_Delete(struct sess *sp)
+{
+	struct sessmem *sm;
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	sm = sp->mem;
+	CHECK_OBJ_NOTNULL(sm, SESSMEM_MAGIC);
+
+	/* Clean and prepare for reuse */
+	ses_setup(sm);
+	Lck_Lock(&ses_mem_mtx);
+	VTAILQ_INSERT_HEAD(&ses_free_mem[1 - ses_qp], sm, list);
+	Lck_Unlock(&ses_mem_mtx);
+
+	/* Update statistics */
+	Lck_Lock(&ses_stat_mtx);
+	n_sess_rel++;
+	Lck_Unlock(&ses_stat_mtx);
+}
+
+static void
+SES_Wait(struct sess *sp, int want)
+{
+
+	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	CHECK_OBJ_NOTNULL(sp->wrk, WORKER_MAGIC);
+	assert(sp->fd >= 0);
+	EVT_Add(sp->wrk, want, sp->fd, sp);
+}
+
+/*--------------------------------------------------------------------
+ * Schedule a session back on a work-thread from its pool
+ */
+
+static int
+SES_Schedule(struct sess *sp)
+{
+
+	sp->wrk = NULL;
+	if (WRK_Queue(sp))
+		WRONG("failed to schedule the session");
+	return (0);
+}
+
+static void
+SES_Rush(void)
+{
+	struct sess *sp;
+
+	Lck_Lock(&waiting_mtx);
+	sp = VTAILQ_FIRST(&waiting_list);
+	if (sp != NULL) {
+		VTAILQ_REMOVE(&waiting_list, sp, poollist);
+		Lck_Unlock(&waiting_mtx);
+		AZ(WRK_Queue(sp));
+		return;
+	}
+	Lck_Unlock(&waiting_mtx);
+}
+
+static void
+SES_Sleep(struct sess *sp)
+{
+
+	sp->wrk = NULL;
+	Lck_Lock(&waiting_mtx);
+	VTAILQ_INSERT_TAIL(&waiting_list, sp, poollist);
+	Lck_Unlock(&waiting_mtx);
+}
+
+static void
+SES_errno(int error)
+{
+
+	switch (error) {
+	case 0:
+		VSC_INC(n_eof);
+		error = ECONNABORTED;
+		break;
+	case EADDRINUSE:
+		VSC_INC(n_eaddrinuse);
+		break;
+	case EADDRNOTAVAIL:
+		VSC_INC(n_eaddrnotavail);
+		break;
+	case EMFILE:
+		VSC_INC(n_emfile);
+		break;
+	case ECONNREFUSED:
+	case ENOENT:		/* no unix: socket there, nobody listening */
+		VSC_INC(n_econnrefused);
+		break;
+	case ECONNRESET:
+		VSC_INC(n_econnreset);
+		break;
+	default:
+		fprintf(stderr, "[ERROR] Unexpected error number: %d\n", error);
+		break;
+	}
+	if (VSC_C_sp != NULL)
+		VSC_C_sp->err = error;
+}
+
+/*--------------------------------------------------------------------*/
+
+/*--------------------------------------------------------------------
+ * Adds the scheduler's and every worker's shard up into `dst'.
+ */
+
+static void
+vsc_add(struct perfstat *dst, const struct perfstat *src)
+{
+	int i;
+
+	for (i = 0; i < PEFSTAT_STATUS_MAX; i++)
+		dst->n_status[i] += src->n_status[i];
+	dst->n_statusother += src->n_statusother;
+#define	PERFSTAT_u64(a, b, c, d)	dst->a += src->a;
+#define	PERFSTAT_dbl(a, b, c, d)	dst->a += src->a;
+#include "stats.h"
+#undef PERFSTAT_dbl
+#undef PERFSTAT_u64
+}
+
+static void
+bd_add(struct bdstat *dst, const struct bdstat *src)
+{
+	int i;
+
+#define	PERFSTAT_u64(a, b, c, d)	dst->a += src->a;
+#define	PERFSTAT_dbl(a, b, c, d)	dst->a += src->a;
+#include "stats.h"
+#undef PERFSTAT_dbl
+#undef PERFSTAT_u64
+	for (i = 0; i < LAT_N; i++) {
+		if (src->n_lat[i] == 0)
+			continue;
+		if (dst->n_lat[i] == 0 || src->t_latmin[i] < dst->t_latmin[i])
+			dst->t_latmin[i] = src->t_latmin[i];
+		dst->t_latmax[i] = MAX(dst->t_latmax[i], src->t_latmax[i]);
+		dst->n_lat[i] += src->n_lat[i];
+		dst->t_lat[i] += src->t_lat[i];
+	}
+}
+
+/*
+ * Also leaves the url, target and source IP rows summed up in bd_sum.
+ */
+
+static void
+VSC_Merge(struct perfstat *dst)
+{
+	static struct bdstat *tmpbd;
+	struct perfstat tmp;
+	struct worker *w;
+	unsigned u;
+
+	if (tmpbd == NULL) {
+		tmpbd = calloc(bd_nrow, sizeof(*tmpbd));
+		AN(tmpbd);
+	}
+	*dst = _perfstat;
+	memset(bd_sum, 0, sizeof(*bd_sum) * bd_nrow);
+	Lck_Lock(&workers_mtx);
+	VTAILQ_FOREACH(w, &workers, list) {
+		wrk_statcopy(w, &tmp, tmpbd);
+		vsc_add(dst, &tmp);
+		for (u = 0; u < bd_nrow; u++)
+			bd_add(&bd_sum[u], &tmpbd[u]);
+	}
+	Lck_Unlock(&workers_mtx);
+	Lck_Lock(&ses_stat_mtx);
+	dst->n_sess = n_sess_grab - n_sess_rel;
+	dst->n_conn = n_conn;
+	Lck_Unlock(&ses_stat_mtx);
+}
+
+struct sched {
+	unsigned		magic;
+#define	SCHED_MAGIC		0x5c43a3af
+	struct callout		co;
+	struct callout_block	cb;
+};
+
+static const double lat_pct[] = { 50., 90., 99., 99.9, 100. };
+#define	LAT_NPCT	(sizeof(lat_pct) / sizeof(lat_pct[0]))
+
+static int
+sch_skip(enum lat_phase ph)
+{
+
+	return (ph == LAT_TLS && tls_ctx == NULL);
+}
+
+static void
+SCH_bottom(void)
+{
+	int i;
+
+	fprintf(stdout, "[STAT] "
+	    "---------+----------+--------+----------------+");
+	for (i = 0; i < LAT_N; i++) {
+		if (sch_skip(i))
+			continue;
+		fprintf(stdout, "------------------------------+");
+	}
+	fprintf(stdout,
+	    "------------+-------+------------+-------+-------....\n");
+}
+
+static void
+SCH_hdr(void)
+{
+	char buf[64];
+	int i;
+
+	/* XXX WG: I'm sure you didn't use your brain. */
+	fprintf(stdout, "[STAT] "
+	    " time    | total    | req    | conn           |");
+	for (i = 0; i < LAT_N; i++) {
+		if (sch_skip(i))
+			continue;
+		snprintf(buf, sizeof(buf), "%s time [ms]", lat_name[i]);
+		fprintf(stdout, " %-29s |", buf);
+	}
+	fprintf(stdout,
+	    " tx         | tx    | rx         | rx    | errors\n");
+	fprintf(stdout, "[STAT] "
+	    "         |          |        | active   total |");
+	for (i = 0; i < LAT_N; i++) {
+		if (sch_skip(i))
+			continue;
+		fprintf(stdout, "   p50   p90   p99 p99.9   max |");
+	}
+	fprintf(stdout,
+	    "            |       |            |       |\n");
+	SCH_bottom();
+}
+
+/*
+ * Milliseconds in five columns, losing decimals as the value grows.
+ */
+
+static const char *
+sch_ms(char *buf, size_t len, uint64_t us)
+{
+	double ms = us / 1e3;
+
+	if (us < 10000)
+		snprintf(buf, len, "%5.3f", ms);
+	else if (us < 100000)
+		snprintf(buf, len, "%5.2f", ms);
+	else if (us < 1000000)
+		snprintf(buf, len, "%5.1f", ms);
+	else
+		snprintf(buf, len, "%5.0f", ms);
+	return (buf);
+}
+
+/*
+ * The workers' histograms only grow, so a second's worth is this
+ * snapshot minus the last one.
+ */
+
+static void
+sch_lat(struct vhist *now)
+{
+	struct worker *w;
+	int i;
+
+	bzero(now, sizeof(*now) * LAT_N);
+	Lck_Lock(&workers_mtx);
+	VTAILQ_FOREACH(w, &workers, list)
+		for (i = 0; i < LAT_N; i++)
+			VHIST_Merge(&now[i], &w->lat[i]);
+	Lck_Unlock(&workers_mtx);
+}
+
+/*--------------------------------------------------------------------
+ * Machine readable output: a JSON line (or CSV row with -o *.csv) per
+ * second and a JSON summary at the end.  The scheduler only formats;
+ * the write(2)s happen in a thread of their own so a slow disk never
+ * holds up the next second's sessions.
+ */
+
+struct outbuf {
+	FILE			*fp;
+	struct vsb		*vsb;
+	VTAILQ_ENTRY(outbuf)	list;
+};
+
+static const char	*o_arg;		/* per second */
+static const char	*O_arg;		/* summary */
+static FILE		*out_fp;
+static FILE		*out_sumfp;
+static int		out_csv;
+static struct lock	out_mtx;
+static pthread_cond_t	out_cond = PTHREAD_COND_INITIALIZER;
+static VTAILQ_HEAD(, outbuf) out_q = VTAILQ_HEAD_INITIALIZER(out_q);
+static int		out_stop;
+static pthread_t	out_tp;
+
+static const char * const lat_key[LAT_N] = {
+	"connect", "tls", "first_byte", "body", "total"
+};
+static const char * const lat_pctname[LAT_NPCT] = {
+	"p50", "p90", "p99", "p99.9", "max"
+};
+
+/* Where every stats.h field sits in struct perfstat and struct bdstat */
+static const struct {
+	const char	*name;
+	size_t		off;
+	size_t		bdoff;
+	int		dbl;
+} out_fields[] = {
+#define	PERFSTAT_u64(a, b, c, d)					\
+	{ #a, offsetof(struct perfstat, a), offsetof(struct bdstat, a), 0 },
+#define	PERFSTAT_dbl(a, b, c, d)					\
+	{ #a, offsetof(struct perfstat, a), offsetof(struct bdstat, a), 1 },
+#include "stats.h"
+#undef PERFSTAT_dbl
+#undef PERFSTAT_u64
+};
+#define	OUT_NFIELDS	(sizeof(out_fields) / sizeof(out_fields[0]))
+
+static void
+out_queue(FILE *fp, struct vsb *vsb)
+{
+	struct outbuf *ob;
+
+	AZ(VSB_finish(vsb));
+	ob = malloc(sizeof(*ob));
+	XXXAN(ob);
+	ob->fp = fp;
+	ob->vsb = vsb;
+	Lck_Lock(&out_mtx);
+	VTAILQ_INSERT_TAIL(&out_q, ob, list);
+	AZ(pthread_cond_signal(&out_cond));
+	Lck_Unlock(&out_mtx);
+}
+
+static void *
+OUT_thread(void *arg)
+{
+	VTAILQ_HEAD(, outbuf) q = VTAILQ_HEAD_INITIALIZER(q);
+	struct outbuf *ob;
+	int done;
+
+	(void)arg;
+	do {
+		Lck_Lock(&out_mtx);
+		while (VTAILQ_EMPTY(&out_q) && !out_stop)
+			Lck_CondWait(&out_cond, &out_mtx);
+		VTAILQ_CONCAT(&q, &out_q, list);
+		done = out_stop;
+		Lck_Unlock(&out_mtx);
+		while ((ob = VTAILQ_FIRST(&q)) != NULL) {
+			VTAILQ_REMOVE(&q, ob, list);
+			if (fwrite(VSB_data(ob->vsb), VSB_len(ob->vsb), 1,
+			    ob->fp) != 1 && (params->diag_bitmap & 0x2))
+				fprintf(stdout, "[ERROR] output write error: "
+				    "%d %s\n", errno, strerror(errno));
+			(void)fflush(ob->fp);
+			VSB_delete(ob->vsb);
+			free(ob);
 		}
-	}
+	} while (!done);
+	NEEDLESS_RETURN(NULL);
 }
 
-/*--------------------------------------------------------------------
- * Queue a workrequest if possible.
- */
-
-static int
-WRK_Queue(struct sess *sp)
+static FILE *
+out_open(const char *path)
 {
-	struct worker *w;
-	ssize_t l;
+	FILE *fp;
 
-	AZ(sp->wrk);
-	/* LRU */
-	Lck_Lock(&workers_mtx);
-	w = VTAILQ_FIRST(&workers);
-	AN(w);
-	VTAILQ_REMOVE(&workers, w, list);
-	VTAILQ_INSERT_TAIL(&workers, w, list);
-	Lck_Unlock(&workers_mtx);
-	/* Queue on the pipe */
-	l = write(w->queue[1], &sp, sizeof(sp));
-	if (l == -1) {
-		if (errno == EAGAIN)
-			return (-2);
-		return (-1);
+	fp = fopen(path, "w");
+	if (fp == NULL) {
+		fprintf(stdout, "[ERROR] can't open %s: %d %s\n", path, errno,
+		    strerror(errno));
+		exit(2);
 	}
-	assert(l == sizeof(sp));
-	return (0);
+	return (fp);
 }
 
 static void
-WRK_Init(struct worker *w)
+OUT_Init(void)
 {
-	int i;
+	size_t l;
 
-	bzero(w, sizeof(*w));
-	w->magic = WORKER_MAGIC;
-	w->fd = epoll_create(1);
-	assert(w->fd >= 0);
-	COT_init(&w->cb);
+	if (o_arg == NULL && O_arg == NULL)
+		return;
+	if (o_arg != NULL) {
+		out_fp = out_open(o_arg);
+		l = strlen(o_arg);
+		out_csv = l > 4 && !strcmp(o_arg + l - 4, ".csv");
+	}
+	if (O_arg != NULL)
+		out_sumfp = out_open(O_arg);
+	Lck_New(&out_mtx, "output queue");
+	AZ(pthread_create(&out_tp, NULL, OUT_thread, NULL));
+}
 
-	AZ(pipe(w->queue));
-	i = fcntl(w->queue[0], F_GETFL);
-	assert(i != -1);
-	i |= O_NONBLOCK;
-	i = fcntl(w->queue[0], F_SETFL, i);
-	assert(i != -1);
-	i = fcntl(w->queue[1], F_GETFL);
-	assert(i != -1);
-	i |= O_NONBLOCK;
-	i = fcntl(w->queue[1], F_SETFL, i);
-	assert(i != -1);
+static void
+OUT_Fini(void)
+{
 
-	EVT_Add(w, SESS_WANT_READ, w->queue[0], w);
+	if (o_arg == NULL && O_arg == NULL)
+		return;
+	Lck_Lock(&out_mtx);
+	out_stop = 1;
+	AZ(pthread_cond_signal(&out_cond));
+	Lck_Unlock(&out_mtx);
+	AZ(pthread_join(out_tp, NULL));
+	if (out_fp != NULL)
+		AZ(fclose(out_fp));
+	if (out_sumfp != NULL)
+		AZ(fclose(out_sumfp));
 }
 
 static void
-WRK_Fini(struct worker *w)
+out_str(struct vsb *vsb, const char *s)
 {
 
-	AZ(close(w->queue[0]));
-	AZ(close(w->queue[1]));
-	COT_fini(&w->cb);
-	AZ(close(w->fd));
+	VSB_putc(vsb, '"');
+	for (; *s != '\0'; s++) {
+		if (*s == '"' || *s == '\\')
+			VSB_printf(vsb, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			VSB_printf(vsb, "\\u%04x", *s);
+		else
+			VSB_putc(vsb, *s);
+	}
+	VSB_putc(vsb, '"');
 }
 
+/*
+ * All stats.h fields of a struct perfstat (bd == 0) or bdstat.
+ */
+
 static void
-wrk_handleQueue(struct worker *w)
+out_stats(struct vsb *vsb, const void *p, int bd)
 {
-	ssize_t l;
-
-	l = read(w->queue[0], &w->sp, sizeof(w->sp));
-	assert(l == sizeof(w->sp));
+	const char *b = p;
+	size_t off;
+	unsigned u;
 
-	AZ(w->sp->wrk);
-	w->sp->wrk = w;
-	CNT_Session(w->sp);
-	w->sp = NULL;
+	VSB_putc(vsb, '{');
+	for (u = 0; u < OUT_NFIELDS; u++) {
+		off = bd ? out_fields[u].bdoff : out_fields[u].off;
+		VSB_printf(vsb, "%s\"%s\": ", u == 0 ? "" : ", ",
+		    out_fields[u].name);
+		if (out_fields[u].dbl)
+			VSB_printf(vsb, "%.6f", *(const double *)(b + off));
+		else
+			VSB_printf(vsb, "%ju",
+			    (uintmax_t)*(const uint64_t *)(b + off));
+	}
+	VSB_putc(vsb, '}');
 }
 
-#define	EPOLLEVENT_MAX	(64 * 1024)
-
-static void *
-WRK_thread(void *arg)
+static void
+out_lat(struct vsb *vsb, const struct vhist *h)
 {
-	struct epoll_event *ev, *ep;
-	struct sess *sp;
-	struct worker *w;
-	int i, n;
+	unsigned j;
+	int i;
 
-	CAST_OBJ_NOTNULL(w, arg, WORKER_MAGIC);
-	w->owner = pthread_self();
+	VSB_putc(vsb, '{');
+	for (i = 0; i < LAT_N; i++) {
+		VSB_printf(vsb, "%s\"%s\": {\"count\": %ju", i == 0 ? "" : ", ",
+		    lat_key[i], (uintmax_t)h[i].n);
+		for (j = 0; j < LAT_NPCT; j++)
+			VSB_printf(vsb, ", \"%s\": %.3f", lat_pctname[j],
+			    VHIST_Percentile(&h[i], lat_pct[j]) / 1e3);
+		VSB_putc(vsb, '}');
+	}
+	VSB_putc(vsb, '}');
+}
 
-	ev = malloc(sizeof(*ev) * EPOLLEVENT_MAX);
-	AN(ev);
+static void
+out_bdrow(struct vsb *vsb, const char *key, const char *name,
+    const struct bdstat *b)
+{
+	int i;
 
-	while (!stop) {
-		CHECK_OBJ_NOTNULL(w, WORKER_MAGIC);
+	VSB_printf(vsb, "{\"%s\": ", key);
+	out_str(vsb, name);
+	VSB_cat(vsb, ", \"stats\": ");
+	out_stats(vsb, b, 1);
+	VSB_cat(vsb, ", \"latency_ms\": {");
+	for (i = 0; i < LAT_N; i++)
+		VSB_printf(vsb, "%s\"%s\": {\"count\": %ju, \"avg\": %.3f, "
+		    "\"min\": %.3f, \"max\": %.3f}", i == 0 ? "" : ", ",
+		    lat_key[i], (uintmax_t)b->n_lat[i],
+		    b->n_lat[i] == 0 ? 0. : b->t_lat[i] / b->n_lat[i] * 1e3,
+		    b->t_latmin[i] * 1e3, b->t_latmax[i] * 1e3);
+	VSB_cat(vsb, "}}");
+}
 
-		COT_ticks(&w->cb);
-		COT_clock(&w->cb);
+/*
+ * The url, target and source IP rows; with `all' unset only the
+ * dimensions having more than one of them.
+ */
 
-		n = epoll_wait(w->fd, ev, EPOLLEVENT_MAX, 1000);
-		for (ep = ev, i = 0; i < n; i++, ep++) {
-			if (ep->data.ptr == w) {
-				wrk_handleQueue(w);
-				continue;
-			}
-			CAST_OBJ_NOTNULL(sp, ep->data.ptr, SESS_MAGIC);
-			assert(w == sp->wrk);
-			sp->wrk = NULL;
-			callout_stop(&w->cb, &sp->co);
-			EVT_Del(w, sp->fd);
-			sp->wrk = w;
-			CNT_Session(sp);
+static void
+out_bd(struct vsb *vsb, int all)
+{
+	struct target *tgt;
+	int i, n;
+
+	if (all || num_urls > 1) {
+		VSB_cat(vsb, ", \"urls\": [");
+		for (i = 0; i < num_urls; i++) {
+			if (i > 0)
+				VSB_cat(vsb, ", ");
+			out_bdrow(vsb, "label", urls[i]->label,
+			    &bd_sum[urls[i]->bdidx]);
 		}
+		VSB_putc(vsb, ']');
+	}
+	if (all ||
+	    VTAILQ_FIRST(&targets) != VTAILQ_LAST(&targets, targethead)) {
+		VSB_cat(vsb, ", \"targets\": [");
+		n = 0;
+		VTAILQ_FOREACH(tgt, &targets, list) {
+			if (n++ > 0)
+				VSB_cat(vsb, ", ");
+			out_bdrow(vsb, "address", tgt->name,
+			    &bd_sum[tgt->bdidx]);
+		}
+		VSB_putc(vsb, ']');
+	}
+	if (all || num_srcips > 1) {
+		VSB_cat(vsb, ", \"sources\": [");
+		for (i = 0; i < num_srcips; i++) {
+			if (i > 0)
+				VSB_cat(vsb, ", ");
+			out_bdrow(vsb, "address", srcips[i].ip,
+			    &bd_sum[bd_srcbase + i]);
+		}
+		VSB_putc(vsb, ']');
 	}
-
-	if (params->diag_bitmap & 0x4)
-		fprintf(stdout, "[INFO] Finishing the worker thread.\n");
-	free(ev);
-	NEEDLESS_RETURN(NULL);
 }
 
-/*--------------------------------------------------------------------*/
+/*
+ * Counters are running totals, latencies are of the last second.
+ */
 
-static double
-TIM_real(void)
+static void
+OUT_Interval(double now, const struct vhist *l1s)
 {
-	struct timespec ts;
+	static int first = 1;
+	struct vsb *vsb;
+	unsigned u, j;
+	int i;
 
-	assert(clock_gettime(CLOCK_REALTIME, &ts) == 0);
-	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+	if (out_fp == NULL)
+		return;
+	vsb = VSB_new_auto();
+	AN(vsb);
+	if (out_csv) {
+		if (first) {
+			VSB_cat(vsb, "time,elapsed");
+			for (u = 0; u < OUT_NFIELDS; u++)
+				VSB_printf(vsb, ",%s", out_fields[u].name);
+			for (i = 0; i < LAT_N; i++)
+				for (j = 0; j < LAT_NPCT; j++)
+					VSB_printf(vsb, ",%s_%s_ms",
+					    lat_key[i], lat_pctname[j]);
+			VSB_putc(vsb, '\n');
+			first = 0;
+		}
+		VSB_printf(vsb, "%.3f,%.3f", now, now - boottime);
+		for (u = 0; u < OUT_NFIELDS; u++) {
+			if (out_fields[u].dbl)
+				VSB_printf(vsb, ",%.6f", *(const double *)
+				    ((const char *)VSC_C_sum +
+				    out_fields[u].off));
+			else
+				VSB_printf(vsb, ",%ju", (uintmax_t)
+				    *(const uint64_t *)((const char *)VSC_C_sum
+				    + out_fields[u].off));
+		}
+		for (i = 0; i < LAT_N; i++)
+			for (j = 0; j < LAT_NPCT; j++)
+				VSB_printf(vsb, ",%.3f", VHIST_Percentile(
+				    &l1s[i], lat_pct[j]) / 1e3);
+		VSB_putc(vsb, '\n');
+	} else {
+		VSB_printf(vsb, "{\"time\": %.3f, \"elapsed\": %.3f, "
+		    "\"stats\": ", now, now - boottime);
+		out_stats(vsb, VSC_C_sum, 0);
+		VSB_cat(vsb, ", \"latency_ms\": ");
+		out_lat(vsb, l1s);
+		out_bd(vsb, 0);
+		VSB_cat(vsb, "}\n");
+	}
+	out_queue(out_fp, vsb);
 }
 
 static void
-TIM_format(double t, char *p)
+OUT_Summary(void)
 {
-	struct tm tm;
-	time_t tt;
+	struct vsb *vsb;
+	int i;
 
-	tt = (time_t) t;
-	(void)gmtime_r(&tt, &tm);
-	AN(strftime(p, TIM_FORMAT_SIZE, "%H:%M:%S", &tm));
+	if (out_sumfp == NULL)
+		return;
+	vsb = VSB_new_auto();
+	AN(vsb);
+	VSB_printf(vsb, "{\"duration\": %.3f, \"stats\": ",
+	    TIM_real() - boottime);
+	out_stats(vsb, VSC_C_sum, 0);
+	VSB_cat(vsb, ", \"status\": {");
+	for (i = 0; i < PEFSTAT_STATUS_MAX; i++)
+		if (VSC_C_sum->n_status[i] != 0)
+			VSB_printf(vsb, "\"%d\": %d, ", i,
+			    VSC_C_sum->n_status[i]);
+	VSB_printf(vsb, "\"other\": %d}, \"latency_ms\": ",
+	    VSC_C_sum->n_statusother);
+	out_lat(vsb, lat_sum);
+	out_bd(vsb, 1);
+	VSB_cat(vsb, "}\n");
+	out_queue(out_sumfp, vsb);
 }
 
-static struct timespec
-TIM_timespec(double t)
-{
-	struct timespec tv;
+/*--------------------------------------------------------------------
+ * Request trace (-T).  Each worker maps a file of its own and puts a
+ * struct vtrace_rec per sampled request into the ring there, nothing
+ * is locked and nothing is formatted.  vtrace_dump turns the files
+ * into CSV afterwards.
+ */
 
-	tv.tv_sec = (time_t)trunc(t);
-	tv.tv_nsec = (int)(1e9 * (t - tv.tv_sec));
-	return (tv);
-}
+static const char	*T_arg;
 
-static void
-TIM_sleep(double t)
+static uint64_t
+trc_ns(uint64_t t)
 {
-	struct timespec ts;
 
-	ts = TIM_timespec(t);
-	(void)nanosleep(&ts, NULL);
+	return (t == 0 ? 0 : t + tim_mono2real);
 }
 
-/*--------------------------------------------------------------------*/
-
 static void
-EVT_Add(struct worker *wrk, int want, int fd, void *arg)
+TRC_Open(struct worker *w)
 {
-	struct epoll_event ev;
+	struct vtrace_hdr *h;
+	char path[PATH_MAX];
+	int fd, i;
 
-	AN(arg);
-	ev.data.ptr = arg;
-	ev.events = EPOLLERR;
-	switch (want) {
-	case SESS_WANT_READ:
-		ev.events |= EPOLLIN | EPOLLPRI;
-		break;
-	case SESS_WANT_WRITE:
-		ev.events |= EPOLLOUT;
-		break;
-	default:
-		WRONG("Unknown event type");
-		break;
+	if (T_arg == NULL)
+		return;
+	i = snprintf(path, sizeof(path), "%s.%u", T_arg, w->id);
+	assert(i > 0 && i < (int)sizeof(path));
+	w->trlen = sizeof(*h) +
+	    (size_t)params->trace_size * sizeof(struct vtrace_rec);
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stdout, "[ERROR] can't open %s: %d %s\n", path, errno,
+		    strerror(errno));
+		exit(2);
 	}
-	AZ(epoll_ctl(wrk->fd, EPOLL_CTL_ADD, fd, &ev));
-	assert(wrk->nwant >= 0);
-	wrk->nwant++;
+	/* Blocks up front, so a full disk can't SIGBUS us later on */
+	i = posix_fallocate(fd, 0, w->trlen);
+	if (i != 0) {
+		fprintf(stdout, "[ERROR] can't allocate %zu bytes for %s: "
+		    "%d %s\n", w->trlen, path, i, strerror(i));
+		exit(2);
+	}
+	h = mmap(NULL, w->trlen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (h == MAP_FAILED) {
+		fprintf(stdout, "[ERROR] can't mmap %s: %d %s\n", path, errno,
+		    strerror(errno));
+		exit(2);
+	}
+	AZ(close(fd));
+	memcpy(h->magic, VTRACE_MAGIC, sizeof(h->magic));
+	h->version = VTRACE_VERSION;
+	h->recsize = sizeof(struct vtrace_rec);
+	h->nrec = params->trace_size;
+	h->sample = params->trace_sample;
+	h->worker = w->id;
+	h->t_open = (uint64_t)(TIM_real() * 1e9);
+	w->tr = h;
+	w->trrec = (struct vtrace_rec *)(void *)(h + 1);
+	w->trskip = 1;
 }
 
 static void
-EVT_Del(struct worker *wrk, int fd)
+TRC_Close(struct worker *w)
 {
-	struct epoll_event ev = { 0 , { 0 } };
-
-	assert(pthread_equal(wrk->owner, pthread_self()));
 
-	assert(fd >= 0);
-	AZ(epoll_ctl(wrk->fd, EPOLL_CTL_DEL, fd, &ev));
-	assert(wrk->nwant > 0);
-	wrk->nwant--;
+	if (w->tr == NULL)
+		return;
+	AZ(munmap(w->tr, w->trlen));
+	w->tr = NULL;
+	w->trrec = NULL;
 }
 
-/*--------------------------------------------------------------------*/
-
-static struct sessmem *
-ses_sm_alloc(void)
+static void
+TRC_Req(struct sess *sp, int status, ssize_t bytes)
 {
-	struct sessmem *sm;
-	unsigned l;
+	struct worker *w = sp->wrk;
+	struct vtrace_rec *r;
 
-	l = sizeof(*sm) + params->sess_workspace;
-	sm = malloc(l);
-	if (sm == NULL)
-		return (NULL);
-	sm->magic = SESSMEM_MAGIC;
-	sm->workspace = params->sess_workspace;
-	sm->wsp = (void *)(sm + 1);
-	return (sm);
+	w->trseq++;
+	if (--w->trskip > 0)
+		return;
+	w->trskip = params->trace_sample;
+	r = &w->trrec[w->trpos];
+	if (++w->trpos == w->tr->nrec)
+		w->trpos = 0;
+	r->t_start = trc_ns(sp->t_start);
+	r->t_tx = trc_ns(sp->t_fbstart);
+	r->t_connect = trc_ns(sp->t_connend);
+	r->t_fb = trc_ns(sp->t_fbend);
+	r->t_body = trc_ns(sp->t_bodyend);
+	r->bytes = bytes;
+	r->seq = w->trseq;
+	r->status = MAX(status, 0);
+	r->url = sp->url->bdidx;		/* see BD_Init() */
+	r->tgt = sp->tgt->bdidx - num_urls;
+	r->worker = w->id;
+	r->error = sp->err;
+	r->flags = (sp->tgt->tls ? VTRACE_F_TLS : 0) |
+	    (sp->tgt->h2 ? VTRACE_F_H2 : 0);
+	w->tr->head++;
 }
 
 /*--------------------------------------------------------------------
- * This prepares a session for use, based on its sessmem structure.
+ * Shared memory stats (-n).  Once a second SCH_stat() copies the merged
+ * counters and the last second's percentiles into a segment which
+ * varnishperfstat attaches to, see vsm.h.  Only the scheduler thread
+ * writes it and nobody waits for anybody.
  */
 
-static void
-ses_setup(struct sessmem *sm)
-{
-	struct sess *sp;
+static const char	*n_arg;
+static char		vsm_path[NAME_MAX];
+static struct vsm_head	*vsm_head;
+static size_t		vsm_len;
 
-	CHECK_OBJ_NOTNULL(sm, SESSMEM_MAGIC);
-	sp = &sm->sess;
-	memset(sp, 0, sizeof *sp);
+static const struct vsm_field vsm_fields[] = {
+#define	PERFSTAT_u64(a, b, c, d)	{ #a, 'u', b, "", c, d },
+#define	PERFSTAT_dbl(a, b, c, d)	{ #a, 'd', b, "", c, d },
+#include "stats.h"
+#undef PERFSTAT_dbl
+#undef PERFSTAT_u64
+};
+#define	VSM_NFIELDS	(sizeof(vsm_fields) / sizeof(vsm_fields[0]))
+
+/*
+ * A segment of the same name is only taken over if whoever made it is
+ * gone.
+ */
+
+static int
+vsm_stale(void)
+{
+	struct vsm_head h;
+	int fd;
+	ssize_t l;
 
-	/* We assume that the sess has been zeroed by the time we get here */
-	AZ(sp->magic);
-	sp->magic = SESS_MAGIC;
-	sp->mem = sm;
-	sp->mysockaddr = (void*)(&sm->sockaddr[1]);
-	sp->mysockaddrlen = sizeof(sm->sockaddr[1]);
-	sp->mysockaddr->ss_family = PF_UNSPEC;
-	WS_Init(sp->ws, "sess workspace", sm->wsp, sm->workspace);
+	fd = shm_open(vsm_path, O_RDONLY, 0);
+	if (fd == -1)
+		return (errno == ENOENT);
+	l = pread(fd, &h, sizeof(h), 0);
+	AZ(close(fd));
+	if (l != sizeof(h) || memcmp(h.magic, VSM_MAGIC, sizeof(h.magic)))
+		return (1);
+	return (h.done || (kill((pid_t)h.pid, 0) == -1 && errno == ESRCH));
 }
 
 static void
-SES_Acct(struct sess *sp)
+VSM_Init(void)
 {
-	double diff;
+	struct vsm_head *h;
+	struct vsm_lat *vl;
+	unsigned i;
+	int fd;
 
-	if (!isnan(sp->t_connstart) &&
-	    !isnan(sp->t_connend)) {
-		diff = sp->t_connend - sp->t_connstart;
-		VSC_C_1s->n_conn++;
-		VSC_C_1s->t_conntotal += diff;
-		VSC_C_1s->t_connmin = MIN(VSC_C_1s->t_connmin, diff);
-		VSC_C_1s->t_connmax = MAX(VSC_C_1s->t_connmax, diff);
-		VSC_C_main->t_conntotal += diff;
+	if (n_arg == NULL)
+		return;
+	assert(OUT_NFIELDS == VSM_NFIELDS);
+	assert(LAT_NPCT <= VSM_MAXPCT);
+	i = snprintf(vsm_path, sizeof(vsm_path), "/%s%s", VSM_PREFIX, n_arg);
+	if (i >= sizeof(vsm_path) || strchr(n_arg, '/') != NULL) {
+		fprintf(stdout, "[ERROR] illegal name for -n: %s\n", n_arg);
+		exit(1);
 	}
-	if (!isnan(sp->t_fbstart) &&
-	    !isnan(sp->t_fbend)) {
-		diff = sp->t_fbend - sp->t_fbstart;
-		VSC_C_1s->n_fb++;
-		VSC_C_1s->t_fbtotal += diff;
-		VSC_C_1s->t_fbmin = MIN(VSC_C_1s->t_fbmin, diff);
-		VSC_C_1s->t_fbmax = MAX(VSC_C_1s->t_fbmax, diff);
-		VSC_C_main->t_fbtotal += diff;
+	fd = shm_open(vsm_path, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1 && errno == EEXIST) {
+		if (!vsm_stale()) {
+			fprintf(stdout, "[ERROR] -n %s is taken by another "
+			    "varnishperf\n", n_arg);
+			exit(2);
+		}
+		(void)shm_unlink(vsm_path);
+		fd = shm_open(vsm_path, O_RDWR | O_CREAT | O_EXCL, 0644);
 	}
-	if (!isnan(sp->t_bodystart) &&
-	    !isnan(sp->t_bodyend)) {
-		diff = sp->t_bodyend - sp->t_bodystart;
-		VSC_C_1s->n_body++;
-		VSC_C_1s->t_bodytotal += diff;
-		VSC_C_1s->t_bodymin = MIN(VSC_C_1s->t_bodymin, diff);
-		VSC_C_1s->t_bodymax = MAX(VSC_C_1s->t_bodymax, diff);
-		VSC_C_main->t_bodytotal += diff;
+	if (fd == -1) {
+		fprintf(stdout, "[ERROR] can't create shared memory %s: "
+		    "%d %s\n", vsm_path, errno, strerror(errno));
+		exit(2);
 	}
-}
-
-/*--------------------------------------------------------------------
- * Get a new session, preferably by recycling an already ready one
- */
-
-static struct sess *
-SES_New(void)
-{
-	struct sessmem *sm;
-	struct sess *sp;
+	vsm_len = sizeof(*h) + sizeof(vsm_fields) +
+	    VSM_NFIELDS * sizeof(union vsm_val) + LAT_N * sizeof(*vl);
+	AZ(ftruncate(fd, vsm_len));
+	h = mmap(NULL, vsm_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	assert(h != MAP_FAILED);
+	AZ(close(fd));
 
-	assert(ses_qp <= 1);
-	sm = VTAILQ_FIRST(&ses_free_mem[ses_qp]);
-	if (sm == NULL) {
-		/*
-		 * If that queue is empty, flip queues holding the lock
-		 * and try the new unlocked queue.
-		 */
-		Lck_Lock(&ses_mem_mtx);
-		ses_qp = 1 - ses_qp;
-		Lck_Unlock(&ses_mem_mtx);
-		sm = VTAILQ_FIRST(&ses_free_mem[ses_qp]);
-	}
-	if (sm != NULL) {
-		VTAILQ_REMOVE(&ses_free_mem[ses_qp], sm, list);
-		sp = &sm->sess;
-		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
-	} else {
-		sm = ses_sm_alloc();
-		if (sm == NULL)
-			return (NULL);
-		ses_setup(sm);
-		sp = &sm->sess;
-		CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
+	h->version = VSM_VERSION;
+	h->nfield = VSM_NFIELDS;
+	h->nlat = LAT_N;
+	h->npct = LAT_NPCT;
+	h->pid = getpid();
+	h->t_boot = boottime;
+	for (i = 0; i < LAT_NPCT; i++) {
+		h->pct[i] = lat_pct[i];
+		strncpy(h->pctname[i], lat_pctname[i],
+		    sizeof(h->pctname[i]) - 1);
 	}
-	/* no lock needed */
-	n_sess_grab++;
-	Lck_Lock(&ses_stat_mtx);
-	VSC_C_main->n_sess = n_sess_grab - n_sess_rel;
-	Lck_Unlock(&ses_stat_mtx);
-
-	return (sp);
+	h->off_field = sizeof(*h);
+	h->off_val = h->off_field + sizeof(vsm_fields);
+	h->off_lat = h->off_val + VSM_NFIELDS * sizeof(union vsm_val);
+	memcpy((char *)h + h->off_field, vsm_fields, sizeof(vsm_fields));
+	vl = (struct vsm_lat *)(void *)((char *)h + h->off_lat);
+	for (i = 0; i < LAT_N; i++)
+		strncpy(vl[i].name, lat_key[i], sizeof(vl[i].name) - 1);
+	/* Readers go by the magic, so it's the last thing in */
+	__sync_synchronize();
+	memcpy(h->magic, VSM_MAGIC, sizeof(h->magic));
+	vsm_head = h;
 }
 
-/*--------------------------------------------------------------------
- * Recycle a session.  If the workspace has changed, deleted it,
- * otherwise wash it, and put it up for adoption.
- */
-
 static void
-SES_Delete(struct sess *sp)
+VSM_Update(double now, const struct vhist *l1s)
 {
-	struct sessmem *sm;
-
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
-	sm = sp->mem;
-	CHECK_OBJ_NOTNULL(sm, SESSMEM_MAGIC);
-
-	/* Clean and prepare for reuse */
-	ses_setup(sm);
-	Lck_Lock(&ses_mem_mtx);
-	VTAILQ_INSERT_HEAD(&ses_free_mem[1 - ses_qp], sm, list);
-	Lck_Unlock(&ses_mem_mtx);
+	struct vsm_head *h = vsm_head;
+	union vsm_val *val;
+	struct vsm_lat *vl;
+	unsigned i, j;
 
-	/* Update statistics */
-	Lck_Lock(&ses_stat_mtx);
-	n_sess_rel++;
-	VSC_C_main->n_sess = n_sess_grab - n_sess_rel;
-	Lck_Unlock(&ses_stat_mtx);
+	if (h == NULL)
+		return;
+	val = (union vsm_val *)(void *)((char *)h + h->off_val);
+	vl = (struct vsm_lat *)(void *)((char *)h + h->off_lat);
+	h->seq++;
+	__sync_synchronize();
+	for (i = 0; i < VSM_NFIELDS; i++)
+		memcpy(&val[i], (const char *)VSC_C_sum + out_fields[i].off,
+		    sizeof(val[i]));
+	for (i = 0; i < LAT_N; i++) {
+		vl[i].n = l1s[i].n;
+		for (j = 0; j < LAT_NPCT; j++)
+			vl[i].ms[j] = l1s[i].n == 0 ? 0. :
+			    VHIST_Percentile(&l1s[i], lat_pct[j]) / 1e3;
+	}
+	h->t_update = now;
+	__sync_synchronize();
+	h->seq++;
 }
 
 static void
-SES_Wait(struct sess *sp, int want)
+VSM_Fini(void)
 {
 
-	CHECK_OBJ_NOTNULL(sp, SESS_MAGIC);
-	CHECK_OBJ_NOTNULL(sp->wrk, WORKER_MAGIC);
-	assert(sp->fd >= 0);
-	EVT_Add(sp->wrk, want, sp->fd, sp);
+	if (vsm_head == NULL)
+		return;
+	vsm_head->done = 1;
+	AZ(munmap(vsm_head, vsm_len));
+	vsm_head = NULL;
+	(void)shm_unlink(vsm_path);
 }
 
 /*--------------------------------------------------------------------
- * Schedule a session back on a work-thread from its pool
+ * Prometheus metrics (-M).  A thread of its own answers GET /metrics,
+ * one scrape at a time, from the copy SCH_stat() leaves under met_mtx
+ * once a second.  The workers never see it.
  */
 
-static int
-SES_Schedule(struct sess *sp)
+static const char	*M_arg;
+static int		met_fd = -1;
+static int		met_stop;
+static pthread_t	met_tp;
+static struct lock	met_mtx;
+static struct perfstat	met_stat;
+static struct vhist	met_lat[LAT_N];
+static double		met_latsum[LAT_N];
+
+/* Histogram buckets, in seconds */
+static const double met_le[] = {
+	.0001, .00025, .0005, .001, .0025, .005, .01, .025, .05, .1, .25, .5,
+	1., 2.5, 5., 10.
+};
+
+static void
+MET_Update(const struct vhist *lnow)
 {
+	int i, j;
 
-	sp->wrk = NULL;
-	if (WRK_Queue(sp))
-		WRONG("failed to schedule the session");
-	return (0);
+	if (met_fd == -1)
+		return;
+	Lck_Lock(&met_mtx);
+	met_stat = *VSC_C_sum;
+	memcpy(met_lat, lnow, sizeof(met_lat));
+	for (i = 0; i < LAT_N; i++) {
+		met_latsum[i] = 0.;
+		for (j = 0; j < num_urls; j++)
+			met_latsum[i] += bd_sum[urls[j]->bdidx].t_lat[i];
+	}
+	Lck_Unlock(&met_mtx);
 }
 
 static void
-SES_Rush(void)
+met_body(struct vsb *vsb)
 {
-	struct sess *sp;
+	struct perfstat st;
+	static struct vhist lat[LAT_N];
+	double latsum[LAT_N];
+	const char *p, *sfx, *tot;
+	unsigned u;
+	int i;
 
-	Lck_Lock(&waiting_mtx);
-	sp = VTAILQ_FIRST(&waiting_list);
-	if (sp != NULL) {
-		VTAILQ_REMOVE(&waiting_list, sp, poollist);
-		Lck_Unlock(&waiting_mtx);
-		AZ(WRK_Queue(sp));
-		return;
+	Lck_Lock(&met_mtx);
+	st = met_stat;
+	memcpy(lat, met_lat, sizeof(lat));
+	memcpy(latsum, met_latsum, sizeof(latsum));
+	Lck_Unlock(&met_mtx);
+
+	for (u = 0; u < OUT_NFIELDS; u++) {
+		p = (const char *)&st + out_fields[u].off;
+		/* Prometheus wants the unit and, for counters, _total. */
+		if (!strcmp(vsm_fields[u].unit, "seconds"))
+			sfx = "_seconds";
+		else if (!strcmp(vsm_fields[u].unit, "bytes"))
+			sfx = "_bytes";
+		else
+			sfx = "";
+		tot = vsm_fields[u].flag == 'c' ? "_total" : "";
+		VSB_printf(vsb, "# HELP varnishperf_%s%s%s %s\n",
+		    vsm_fields[u].name, sfx, tot, vsm_fields[u].desc);
+		VSB_printf(vsb, "# TYPE varnishperf_%s%s%s %s\n",
+		    vsm_fields[u].name, sfx, tot,
+		    vsm_fields[u].flag == 'c' ? "counter" : "gauge");
+		VSB_printf(vsb, "varnishperf_%s%s%s ", vsm_fields[u].name,
+		    sfx, tot);
+		if (out_fields[u].dbl)
+			VSB_printf(vsb, "%.6f\n",
+			    *(const double *)(const void *)p);
+		else
+			VSB_printf(vsb, "%ju\n",
+			    (uintmax_t)*(const uint64_t *)(const void *)p);
+	}
+
+	VSB_cat(vsb, "# HELP varnishperf_responses_total HTTP responses by "
+	    "status code\n# TYPE varnishperf_responses_total counter\n");
+	for (i = 0; i < PEFSTAT_STATUS_MAX; i++)
+		if (st.n_status[i] != 0)
+			VSB_printf(vsb,
+			    "varnishperf_responses_total{code=\"%d\"} %d\n",
+			    i, st.n_status[i]);
+	VSB_printf(vsb, "varnishperf_responses_total{code=\"other\"} %d\n",
+	    st.n_statusother);
+
+	VSB_cat(vsb, "# HELP varnishperf_latency_seconds Time spent per "
+	    "phase of a request\n# TYPE varnishperf_latency_seconds "
+	    "histogram\n");
+	for (i = 0; i < LAT_N; i++) {
+		if (sch_skip(i))
+			continue;
+		for (u = 0; u < sizeof(met_le) / sizeof(met_le[0]); u++)
+			VSB_printf(vsb, "varnishperf_latency_seconds_bucket"
+			    "{phase=\"%s\",le=\"%g\"} %ju\n", lat_key[i],
+			    met_le[u], (uintmax_t)VHIST_Count(&lat[i],
+			    (uint64_t)(met_le[u] * 1e6)));
+		VSB_printf(vsb, "varnishperf_latency_seconds_bucket"
+		    "{phase=\"%s\",le=\"+Inf\"} %ju\n", lat_key[i],
+		    (uintmax_t)lat[i].n);
+		VSB_printf(vsb, "varnishperf_latency_seconds_sum"
+		    "{phase=\"%s\"} %.6f\n", lat_key[i], latsum[i]);
+		VSB_printf(vsb, "varnishperf_latency_seconds_count"
+		    "{phase=\"%s\"} %ju\n", lat_key[i],
+		    (uintmax_t)lat[i].n);
 	}
-	Lck_Unlock(&waiting_mtx);
 }
 
 static void
-SES_Sleep(struct sess *sp)
+met_write(int fd, const char *p, size_t len)
 {
+	ssize_t l;
 
-	sp->wrk = NULL;
-	Lck_Lock(&waiting_mtx);
-	VTAILQ_INSERT_TAIL(&waiting_list, sp, poollist);
-	Lck_Unlock(&waiting_mtx);
+	while (len > 0) {
+		l = write(fd, p, len);
+		if (l <= 0)
+			return;
+		p += l;
+		len -= l;
+	}
 }
 
 static void
-SES_errno(int error)
+met_serve(int fd)
 {
+	struct timeval tv = { 1, 0 };
+	struct vsb *body, *vsb;
+	char buf[2048];
+	size_t len = 0;
+	ssize_t l;
 
-	switch (error) {
-	case 0:
-		VSC_C_main->n_eof++;
-		break;
-	case EADDRINUSE:
-		VSC_C_main->n_eaddrinuse++;
-		break;
-	case EMFILE:
-		VSC_C_main->n_emfile++;
-		break;
-	case ECONNREFUSED:
-		VSC_C_main->n_econnrefused++;
-		break;
-	case ECONNRESET:
-		VSC_C_main->n_econnreset++;
-		break;
-	default:
-		fprintf(stderr, "[ERROR] Unexpected error number: %d\n", error);
-		break;
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	do {
+		l = read(fd, buf + len, sizeof(buf) - 1 - len);
+		if (l <= 0)
+			return;
+		len += l;
+		buf[len] = '\0';
+	} while (strstr(buf, "\r\n\r\n") == NULL && len < sizeof(buf) - 1);
+
+	body = VSB_new_auto();
+	AN(body);
+	vsb = VSB_new_auto();
+	AN(vsb);
+	if (!strncmp(buf, "GET /metrics ", 13) ||
+	    !strncmp(buf, "GET /metrics?", 13)) {
+		met_body(body);
+		VSB_cat(vsb, "HTTP/1.1 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n");
+	} else {
+		VSB_cat(body, "Try /metrics\n");
+		VSB_cat(vsb, "HTTP/1.1 404 Not Found\r\n"
+		    "Content-Type: text/plain\r\n");
 	}
+	AZ(VSB_finish(body));
+	VSB_printf(vsb, "Content-Length: %zd\r\nConnection: close\r\n\r\n",
+	    VSB_len(body));
+	AZ(VSB_finish(vsb));
+	met_write(fd, VSB_data(vsb), VSB_len(vsb));
+	met_write(fd, VSB_data(body), VSB_len(body));
+	VSB_delete(vsb);
+	VSB_delete(body);
 }
 
-/*--------------------------------------------------------------------*/
+static void *
+MET_thread(void *arg)
+{
+	struct pollfd pfd;
+	int fd;
 
-struct sched {
-	unsigned		magic;
-#define	SCHED_MAGIC		0x5c43a3af
-	struct callout		co;
-	struct callout_block	cb;
-};
+	(void)arg;
+	while (!met_stop) {
+		pfd.fd = met_fd;
+		pfd.events = POLLIN;
+		/* Wakes up now and then to see if we're done */
+		if (poll(&pfd, 1, 200) <= 0)
+			continue;
+		fd = accept(met_fd, NULL, NULL);
+		if (fd == -1)
+			continue;
+		met_serve(fd);
+		AZ(close(fd));
+	}
+	NEEDLESS_RETURN(NULL);
+}
 
 static void
-SCH_hdr(void)
+MET_Init(void)
 {
+	struct vss_addr **va;
+	int i, n, val = 1;
 
-	/* XXX WG: I'm sure you didn't use your brain. */
-	fprintf(stdout, "[STAT] "
-	    " time    | total    | req    | conn           |"
-	    " connect time          |"
-	    " first byte time       |"
-	    " body time             |"
-	    " tx         | tx    | rx         | rx    | errors\n");
-	fprintf(stdout, "[STAT] "
-	    "         |          |        | active   total |"
-	    "   min     avg     max |"
-	    "   min     avg     max |"
-	    "   min     avg     max |"
-	    "            |       |            |       |\n");
-	fprintf(stdout, "[STAT] "
-	    "---------+----------+--------+----------------+"
-	    "-----------------------+"
-	    "-----------------------+"
-	    "-----------------------+"
-	    "------------+-------+------------+-------+-------....\n");
+	if (M_arg == NULL)
+		return;
+	if (strchr(M_arg, ':') == NULL)
+		n = VSS_resolve("127.0.0.1", M_arg, &va);
+	else
+		n = VSS_resolve(M_arg, NULL, &va);
+	if (n == 0) {
+		fprintf(stdout, "[ERROR] failed to resolve %s\n", M_arg);
+		exit(1);
+	}
+	met_fd = socket(va[0]->va_family, SOCK_STREAM, va[0]->va_protocol);
+	assert(met_fd >= 0);
+	AZ(setsockopt(met_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val)));
+	if (bind(met_fd, (struct sockaddr *)&va[0]->va_addr,
+	    va[0]->va_addrlen) || listen(met_fd, 16)) {
+		fprintf(stdout, "[ERROR] can't listen on %s: %d %s\n", M_arg,
+		    errno, strerror(errno));
+		exit(2);
+	}
+	for (i = 0; i < n; i++)
+		free(va[i]);
+	free(va);
+	Lck_New(&met_mtx, "metrics snapshot");
+	AZ(pthread_create(&met_tp, NULL, MET_thread, NULL));
 }
 
 static void
-SCH_bottom(void)
+MET_Fini(void)
 {
 
-	/* XXX WG: I'm sure you didn't use your brain. */
-	fprintf(stdout, "[STAT] "
-	    "---------+----------+--------+----------------+"
-	    "-----------------------+"
-	    "-----------------------+"
-	    "-----------------------+"
-	    "------------+-------+------------+-------+-------....\n");
+	if (met_fd == -1)
+		return;
+	met_stop = 1;
+	AZ(pthread_join(met_tp, NULL));
+	AZ(close(met_fd));
+	met_fd = -1;
+}
+
+/*--------------------------------------------------------------------
+ * Longest event loop round any worker had since we last asked, in usec.
+ */
+
+static uint64_t
+SCH_lag(void)
+{
+	struct worker *w;
+	uint64_t lag, max = 0;
+
+	Lck_Lock(&workers_mtx);
+	VTAILQ_FOREACH(w, &workers, list) {
+		lag = __atomic_exchange_n(&w->lagmax, 0, __ATOMIC_RELAXED);
+		if (lag > max)
+			max = lag;
+	}
+	Lck_Unlock(&workers_mtx);
+	return (max);
 }
 
 static void
 SCH_stat(void)
 {
 	static struct perfstat prev = { { 0, }, };
+	static struct vhist lprev[LAT_N], lnow[LAT_N], l1s[LAT_N];
 	static int first = 1;
 	double now = TIM_real();
-	char buf[TIM_FORMAT_SIZE], sbuf[5];
+	char buf[TIM_FORMAT_SIZE], sbuf[5], mbuf[16];
+	uint64_t lag;
+	unsigned j;
+	int i;
 
 	if (first == 1) {
 		SCH_hdr();
 		first = 0;
 	}
 
+	VSC_Merge(VSC_C_sum);
 	TIM_format(now - boottime, buf);
 	fprintf(stdout, "[STAT] %s", buf);
-	fprintf(stdout, " | %8jd", VSC_C_main->n_req);
-	fprintf(stdout, " | %6jd", VSC_C_main->n_req - prev.n_req);
-	fprintf(stdout, " | %5jd / %6jd", VSC_C_main->n_conn,
-	    VSC_C_main->n_conntotal - prev.n_conntotal);
-
-	if (VSC_C_1s->t_connmin == 1000.0)
-		fprintf(stdout, " |    na");
-	else
-		fprintf(stdout, " | %2.3f", VSC_C_1s->t_connmin);
-	if (VSC_C_1s->n_conn == 0)
-		fprintf(stdout, " /    na");
-	else
-		fprintf(stdout, " / %2.3f",
-		    VSC_C_1s->t_conntotal / VSC_C_1s->n_conn);
-	if (VSC_C_1s->t_connmax == -1.0)
-		fprintf(stdout, " /    na");
-	else
-		fprintf(stdout, " / %2.3f", VSC_C_1s->t_connmax);
-
-	if (VSC_C_1s->t_fbmin == 1000.0)
-		fprintf(stdout, " |    na");
-	else
-		fprintf(stdout, " | %2.3f", VSC_C_1s->t_fbmin);
-	if (VSC_C_1s->n_fb == 0)
-		fprintf(stdout, " /    na");
-	else
-		fprintf(stdout, " / %2.3f",
-		    VSC_C_1s->t_fbtotal / VSC_C_1s->n_fb);
-	if (VSC_C_1s->t_fbmax == -1.0)
-		fprintf(stdout, " /    na");
-	else
-		fprintf(stdout, " / %2.3f", VSC_C_1s->t_fbmax);
-
-	if (VSC_C_1s->t_bodymin == 1000.0)
-		fprintf(stdout, " |    na");
-	else
-		fprintf(stdout, " | %2.3f", VSC_C_1s->t_bodymin);
-	if (VSC_C_1s->n_body == 0)
-		fprintf(stdout, " /    na");
-	else
-		fprintf(stdout, " / %2.3f",
-		    VSC_C_1s->t_bodytotal / VSC_C_1s->n_body);
-	if (VSC_C_1s->t_bodymax == -1.0)
-		fprintf(stdout, " /    na");
-	else
-		fprintf(stdout, " / %2.3f", VSC_C_1s->t_bodymax);
+	fprintf(stdout, " | %8jd", VSC_C_sum->n_req);
+	fprintf(stdout, " | %6jd", VSC_C_sum->n_req - prev.n_req);
+	fprintf(stdout, " | %5jd / %6jd", VSC_C_sum->n_conn,
+	    VSC_C_sum->n_conntotal - prev.n_conntotal);
+
+	sch_lat(lnow);
+	for (i = 0; i < LAT_N; i++) {
+		VHIST_Diff(&l1s[i], &lnow[i], &lprev[i]);
+		if (sch_skip(i))
+			continue;
+		fprintf(stdout, " |");
+		for (j = 0; j < LAT_NPCT; j++) {
+			if (l1s[i].n == 0)
+				fprintf(stdout, "    na");
+			else
+				fprintf(stdout, " %s", sch_ms(mbuf,
+				    sizeof(mbuf),
+				    VHIST_Percentile(&l1s[i], lat_pct[j])));
+		}
+	}
 
-	fprintf(stdout, " | %10ju", VSC_C_main->n_txbytes - prev.n_txbytes);
+	fprintf(stdout, " | %10ju", VSC_C_sum->n_txbytes - prev.n_txbytes);
 	humanize_number(sbuf, sizeof(sbuf),
-	    (int64_t)(VSC_C_main->n_txbytes - prev.n_txbytes), "",
+	    (int64_t)(VSC_C_sum->n_txbytes - prev.n_txbytes), "",
 	    HN_AUTOSCALE, HN_NOSPACE | HN_DECIMAL);
  	fprintf(stdout, " | %5s", sbuf);
-	fprintf(stdout, " | %10ju", VSC_C_main->n_rxbytes - prev.n_rxbytes);
+	fprintf(stdout, " | %10ju", VSC_C_sum->n_rxbytes - prev.n_rxbytes);
 	humanize_number(sbuf, sizeof(sbuf),
-	    (int64_t)(VSC_C_main->n_rxbytes - prev.n_rxbytes), "",
+	    (int64_t)(VSC_C_sum->n_rxbytes - prev.n_rxbytes), "",
 	    HN_AUTOSCALE, HN_NOSPACE | HN_DECIMAL);
  	fprintf(stdout, " | %5s", sbuf);
-	fprintf(stdout, " | %jd / %jd\n", VSC_C_main->n_timeout,
-	    VSC_C_main->n_econnreset);
+	fprintf(stdout, " | %jd / %jd", VSC_C_sum->n_timeout,
+	    VSC_C_sum->n_econnreset);
+	lag = SCH_lag();
+	if (params->loop_lag_warn > 0 &&
+	    lag > (uint64_t)params->loop_lag_warn * 1000)
+		fprintf(stdout, " | generator saturated (loop lag %.1f ms)",
+		    lag / 1e3);
+	fprintf(stdout, "\n");
+
+	OUT_Interval(now, l1s);
+	VSM_Update(now, l1s);
+	MET_Update(lnow);
 
 	/* Reset and Prepare */
-	prev = *VSC_C_main;
-	bzero(VSC_C_1s, sizeof(*VSC_C_1s));
-	VSC_C_1s->t_connmin = 1000.;
-	VSC_C_1s->t_connmax = -1.0;
-	VSC_C_1s->t_fbmin = 1000.;
-	VSC_C_1s->t_fbmax = -1.0;
-	VSC_C_1s->t_bodymin = 1000.;
-	VSC_C_1s->t_bodymax = -1.0;
+	prev = *VSC_C_sum;
+	memcpy(lprev, lnow, sizeof(lprev));
+}
+
+/*--------------------------------------------------------------------
+ * A conn we closed first holds its port in TIME_WAIT for 60 seconds
+ * (TCP_TIMEWAIT_LEN on Linux), so what we closed during the last
+ * minute is about what's still there.
+ */
+
+#define	SCH_TIMEWAIT		60
+
+static void
+SCH_ports(void)
+{
+	static uint64_t ring[SCH_TIMEWAIT], last;
+	static unsigned n;
+	uint64_t *r = &ring[n++ % SCH_TIMEWAIT];
+
+	VSC_Merge(VSC_C_sum);
+	VSC_C_main->n_timewait -= *r;
+	*r = VSC_C_sum->n_closeactive - last;
+	last += *r;
+	VSC_C_main->n_timewait += *r;
+	if (VSC_C_main->n_portspace > 0)
+		VSC_C_main->n_portuse =
+		    (VSC_C_sum->n_conn + VSC_C_main->n_timewait) * 100 /
+		    VSC_C_main->n_portspace;
 }
 
 static void
@@ -2208,11 +6101,12 @@ SCH_tick_1s(void *arg)
 
 	CAST_OBJ_NOTNULL(scp, arg, SCHED_MAGIC);
 
+	SCH_ports();
 	SCH_stat();
 
 	for (i = 0; i < r_arg && !stop; i++) {
-		if (VSC_C_main->n_sess >= r_arg) {
-			VSC_C_main->n_hitlimit++;
+		if (n_sess_grab - n_sess_rel >= r_arg) {
+			VSC_INC(n_hitlimit);
 			break;
 		}
 		if (c_arg != 0) {
@@ -2274,11 +6168,122 @@ SCH_thread(void *arg)
 
 /*--------------------------------------------------------------------*/
 
+static void
+pef_bdhdr(const char *what, const char *name)
+{
+
+	fprintf(stdout, "[STAT] Per %s:\n", what);
+	fprintf(stdout, "[STAT]    %-47s %-10s %-10s %-10s %-10s %-10s %-10s"
+	    " %-10s %-10s %-10s %-10s\n", name, "conns", "reqs", "ok",
+	    "errors", "timeouts", "connect ms", "fb ms", "fb max ms",
+	    "total ms", "total max");
+}
+
+static double
+pef_bdavg(const struct bdstat *b, enum lat_phase ph)
+{
+
+	return (b->n_lat[ph] == 0 ? 0. : b->t_lat[ph] / b->n_lat[ph] * 1e3);
+}
+
+static void
+pef_bdrow(const char *name, const struct bdstat *b)
+{
+
+	fprintf(stdout, "[STAT]    %-47s %-10ju %-10ju %-10ju %-10ju %-10ju"
+	    " %-10.3f %-10.3f %-10.3f %-10.3f %-10.3f\n", name,
+	    (uintmax_t)b->n_conntotal, (uintmax_t)b->n_req,
+	    (uintmax_t)b->n_httpok, (uintmax_t)b->n_httperror,
+	    (uintmax_t)b->n_timeout, pef_bdavg(b, LAT_CONN),
+	    pef_bdavg(b, LAT_FB), b->t_latmax[LAT_FB] * 1e3,
+	    pef_bdavg(b, LAT_TOTAL), b->t_latmax[LAT_TOTAL] * 1e3);
+}
+
+/*
+ * What it cost us to make the load; if the workers were near a full CPU
+ * the numbers above say more about us than about the server.
+ */
+
+static void
+pef_overhead(void)
+{
+	const struct perfstat *s = VSC_C_sum;
+	double wall = (TIM_real() - boottime) * t_arg, cpu;
+
+	if (s->n_loop == 0 || wall <= 0.)
+		return;
+	cpu = s->t_cpuuser + s->t_cpusys;
+	fprintf(stdout, "[STAT] Generator overhead:\n");
+	fprintf(stdout, "[STAT]    %-20.2f %-10s # %s\n",
+	    (double)s->n_loopev / s->n_loop, "events", "Events per loop round");
+	fprintf(stdout, "[STAT]    %-20.3f %-10s # %s\n",
+	    s->n_loopev == 0 ? 0. : s->t_evwait / s->n_loopev * 1e3, "ms",
+	    "Mean wait of an event for its turn");
+	fprintf(stdout, "[STAT]    %-20.1f %-10s # %s\n",
+	    s->t_loop / wall * 100., "%", "Worker loops busy");
+	fprintf(stdout, "[STAT]    %-20.1f %-10s # CPU per worker"
+	    " (user %.2f s, sys %.2f s)\n", cpu / wall * 100., "%",
+	    s->t_cpuuser, s->t_cpusys);
+	if (s->n_req > 0)
+		fprintf(stdout, "[STAT]    %-20.1f %-10s # %s\n",
+		    (double)s->n_syscall / s->n_req, "calls",
+		    "Syscalls per request");
+}
+
+static void
+pef_tcpinfo(void)
+{
+	static const double scale[TCPI_N] = { 1e-3, 1e-3, 1., 1., 8e-6 };
+	struct vhist *h, *sum;
+	struct target *tgt;
+	struct worker *w;
+	const char *name;
+	unsigned j, k, ntgt = bd_srcbase - num_urls;
+
+	if (params->tcpinfo_sample == 0 || VSC_C_sum->n_tcpinfo == 0)
+		return;
+	sum = calloc(ntgt * TCPI_N, sizeof(*sum));
+	AN(sum);
+	Lck_Lock(&workers_mtx);
+	VTAILQ_FOREACH(w, &workers, list)
+		for (j = 0; j < ntgt * TCPI_N; j++)
+			VHIST_Merge(&sum[j], &w->tcpi[j]);
+	Lck_Unlock(&workers_mtx);
+
+	fprintf(stdout, "[STAT] TCP_INFO per target (1 in %u connections):\n",
+	    params->tcpinfo_sample);
+	fprintf(stdout, "[STAT]    %-47s %-12s %-10s %-10s %-10s %-10s "
+	    "%-10s\n", "address", "metric", "count", "p50", "p90", "p99",
+	    "max");
+	VTAILQ_FOREACH(tgt, &targets, list) {
+		h = &sum[(tgt->bdidx - num_urls) * TCPI_N];
+		name = tgt->name;
+		for (k = 0; k < TCPI_N; k++) {
+			if (h[k].n == 0)
+				continue;
+			fprintf(stdout, "[STAT]    %-47s %-12s %-10ju",
+			    name, tcpi_name[k], (uintmax_t)h[k].n);
+			name = "";
+			fprintf(stdout, " %-10.3f %-10.3f %-10.3f %-10.3f\n",
+			    VHIST_Percentile(&h[k], 50) * scale[k],
+			    VHIST_Percentile(&h[k], 90) * scale[k],
+			    VHIST_Percentile(&h[k], 99) * scale[k],
+			    VHIST_Percentile(&h[k], 100) * scale[k]);
+		}
+	}
+	free(sum);
+}
+
 static void
 PEF_summary(void)
 {
+	struct target *tgt;
+	unsigned j;
+	int i;
 
 	SCH_bottom();
+	VSC_Merge(VSC_C_sum);
+	sch_lat(lat_sum);
 
 /*
 Total: connections 34184 requests 34166 replies 33894 test-duration 1.388 s
@@ -2309,19 +6314,53 @@ Errors: closednoresp 0 sslerror 0 sslerror_syscall 0 other 0
 #define FMT_u64 "[STAT]    %-20ju %-10s %c # %s\n"
 #define FMT_dbl "[STAT]    %-20f %-10s %c # %s\n"
 #define	PERFSTAT_u64(a, b, c, d)	do {				\
-	if (z_flag == 0 && VSC_C_main->a == 0)				\
+	if (z_flag == 0 && VSC_C_sum->a == 0)				\
 		break;							\
-	fprintf(stdout, FMT_u64, VSC_C_main->a, d, b, c);		\
+	fprintf(stdout, FMT_u64, VSC_C_sum->a, d, b, c);		\
 } while (0);
 #define	PERFSTAT_dbl(a, b, c, d)	do {				\
-	if (z_flag == 0 && VSC_C_main->a == 0.)				\
+	if (z_flag == 0 && VSC_C_sum->a == 0.)				\
 		break;							\
-	fprintf(stdout, FMT_dbl, VSC_C_main->a, d, b, c);		\
+	fprintf(stdout, FMT_dbl, VSC_C_sum->a, d, b, c);		\
 } while (0);
 #include "stats.h"
 #undef PERFSTAT
 #undef FMT_dbl
 #undef FMT_u64
+
+	fprintf(stdout, "[STAT] Latency [ms]:\n");
+	fprintf(stdout, "[STAT]    %-20s %-10s %-10s %-10s %-10s %-10s %-10s\n",
+	    "phase", "count", "p50", "p90", "p99", "p99.9", "max");
+	for (i = 0; i < LAT_N; i++) {
+		if (z_flag == 0 && lat_sum[i].n == 0)
+			continue;
+		fprintf(stdout, "[STAT]    %-20s %-10ju", lat_name[i],
+		    (uintmax_t)lat_sum[i].n);
+		for (j = 0; j < LAT_NPCT; j++)
+			fprintf(stdout, " %-10.3f",
+			    VHIST_Percentile(&lat_sum[i], lat_pct[j]) / 1e3);
+		fprintf(stdout, "\n");
+	}
+
+	pef_overhead();
+	pef_tcpinfo();
+
+	if (num_urls > 1) {
+		pef_bdhdr("url", "label");
+		for (i = 0; i < num_urls; i++)
+			pef_bdrow(urls[i]->label, &bd_sum[urls[i]->bdidx]);
+	}
+	if (VTAILQ_FIRST(&targets) != VTAILQ_LAST(&targets, targethead)) {
+		pef_bdhdr("target", "address");
+		VTAILQ_FOREACH(tgt, &targets, list)
+			pef_bdrow(tgt->name, &bd_sum[tgt->bdidx]);
+	}
+	if (num_srcips > 1) {
+		pef_bdhdr("source IP", "address");
+		for (i = 0; i < num_srcips; i++)
+			pef_bdrow(srcips[i].ip, &bd_sum[bd_srcbase + i]);
+	}
+	OUT_Summary();
 }
 
 static void
@@ -2337,27 +6376,100 @@ PEF_Init(void)
 {
 
 	boottime = TIM_real();
+	tim_mono2real = (uint64_t)(boottime * 1e9) - VTIM_mono();
 	Lck_New(&waiting_mtx, "waiting list lock");
 	Lck_New(&ses_mem_mtx, "Session Memory");
 	Lck_New(&ses_stat_mtx, "Session Statistics");
 }
 
+/*--------------------------------------------------------------------
+ * Number of ports the kernel picks from when we don't bind one.
+ */
+
+static unsigned
+PEF_ephemeral_ports(void)
+{
+	FILE *fp;
+	unsigned lo, hi;
+	int i;
+
+	fp = fopen("/proc/sys/net/ipv4/ip_local_port_range", "r");
+	if (fp == NULL)
+		return (0);
+	i = fscanf(fp, "%u %u", &lo, &hi);
+	AZ(fclose(fp));
+	if (i != 2 || hi < lo)
+		return (0);
+	return (hi - lo + 1);
+}
+
+/*--------------------------------------------------------------------
+ * Hands out the breakdown rows once every url and target is known.
+ */
+
+static void
+BD_Init(void)
+{
+	struct target *tgt;
+	unsigned n = 0;
+	int i;
+
+	for (i = 0; i < num_urls; i++)
+		urls[i]->bdidx = n++;
+	VTAILQ_FOREACH(tgt, &targets, list)
+		tgt->bdidx = n++;
+	bd_srcbase = n;
+	bd_nrow = n + num_srcips;
+	bd_sum = calloc(bd_nrow, sizeof(*bd_sum));
+	AN(bd_sum);
+}
+
 static void
 PEF_Run(void)
 {
 	struct worker w[t_arg];
 	pthread_t tp[t_arg], schedtp;
+	unsigned n = 0;
 	int i;
 
 	Lck_New(&workers_mtx, "workers list mtx");
+	BD_Init();
+
+	if (T_arg != NULL && (num_urls > UINT16_MAX ||
+	    bd_srcbase - num_urls > UINT16_MAX)) {
+		/* struct vtrace_rec keeps them in 16 bits */
+		fprintf(stdout, "[ERROR] -T takes at most %u urls and %u "
+		    "targets\n", UINT16_MAX, UINT16_MAX);
+		exit(2);
+	}
+
+	if (params->src_port_lo != 0) {
+		n = (params->src_port_hi - params->src_port_lo + 1) / t_arg;
+		if (n == 0) {
+			fprintf(stdout,
+			    "[ERROR] src_port_range has less ports than -t\n");
+			exit(2);
+		}
+		VSC_C_main->n_portspace = n * t_arg;
+	} else
+		VSC_C_main->n_portspace = PEF_ephemeral_ports();
+	VSC_C_main->n_portspace *= MAX(num_srcips, 1);
 
 	for (i = 0; i < t_arg; i++) {
 		WRK_Init(&w[i]);
+		w[i].id = i;
+		w[i].rng = (i + 1) * 0x9e3779b97f4a7c15ULL ^
+		    (uint64_t)(TIM_real() * 1e6);
+		TRC_Open(&w[i]);
+		if (n != 0) {
+			w[i].port_lo = params->src_port_lo + i * n;
+			w[i].port_hi = w[i].port_lo + n - 1;
+		}
 		Lck_Lock(&workers_mtx);
 		VTAILQ_INSERT_TAIL(&workers, &w[i], list);
 		Lck_Unlock(&workers_mtx);
 		AZ(pthread_create(&tp[i], NULL, WRK_thread, &w[i]));
-		VSC_C_main->n_worker++;
+		VSC_INC(n_worker);
 	}
 	AZ(pthread_create(&schedtp, NULL, SCH_thread, NULL));
 	if (params->diag_bitmap & 0x4)
@@ -2367,9 +6479,12 @@ PEF_Run(void)
 		if (params->diag_bitmap & 0x4)
 			fprintf(stdout, "[INFO] Joining the worker thread\n");
 		AZ(pthread_join(tp[i], NULL));
-		WRK_Fini(&w[i]);
 	}
 	PEF_summary();
+	for (i = 0; i < t_arg; i++) {
+		TRC_Close(&w[i]);
+		WRK_Fini(&w[i]);
+	}
 }
 
 /*--------------------------------------------------------------------*/
@@ -2582,7 +6697,70 @@ tweak_uint(const struct parspec *par, const char *arg)
 
 /*--------------------------------------------------------------------*/
 
+static void
+tweak_hdr_scan(const struct parspec *par, const char *arg)
+{
+
+	(void)par;
+	if (arg == NULL) {
+		fprintf(stdout, "%s", VFIND_name);
+		return;
+	}
+	if (!strcmp(arg, "auto")) {
+		VFIND_Init();
+		return;
+	}
+	if (VFIND_Select(arg)) {
+		fprintf(stdout,
+		    "[ERROR] \"%s\" is unknown or unsupported by this CPU\n",
+		    arg);
+		exit(2);
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+tweak_port_range(const struct parspec *par, const char *arg)
+{
+	unsigned lo, hi;
+	char *end;
+
+	(void)par;
+	if (arg == NULL) {
+		if (master.src_port_lo == 0)
+			fprintf(stdout, "off");
+		else
+			fprintf(stdout, "%u-%u", master.src_port_lo,
+			    master.src_port_hi);
+		return;
+	}
+	if (!strcmp(arg, "off")) {
+		master.src_port_lo = master.src_port_hi = 0;
+		return;
+	}
+	lo = strtoul(arg, &end, 10);
+	if (*end == '-')
+		hi = strtoul(end + 1, &end, 10);
+	else
+		hi = 0;
+	if (*end != '\0' || lo == 0 || hi < lo || hi > 65535) {
+		fprintf(stdout, "[ERROR] use \"off\" or \"low-high\"\n");
+		exit(2);
+	}
+	master.src_port_lo = lo;
+	master.src_port_hi = hi;
+}
+
+/*--------------------------------------------------------------------*/
+
 static const struct parspec input_parspec[] = {
+	{ "bind_no_port", tweak_bool, &master.bind_no_port, 0, 0,
+		"With -s, bind(2) only the source IP and let connect(2) "
+		"pick the port (IP_BIND_ADDRESS_NO_PORT).  The port then "
+		"only has to be unique per destination, not per source "
+		"IP.  Ignored if src_port_range is set.",
+		"on", "bool" },
 	{ "connect_timeout", tweak_timeout,
 		&master.connect_timeout, 0, UINT_MAX,
 		"Default connection timeout for backend connections. "
@@ -2597,8 +6775,50 @@ static const struct parspec input_parspec[] = {
 		"  0x00000008 - workspace.\n"
 		"Use 0x notation and do the bitor in your head :-)\n",
 		"0", "bitmap" },
+	{ "h2_window", tweak_uint, &master.h2_window, 65535, 0x7fffffff,
+		"HTTP/2 receive window we advertise per stream.  A "
+		"WINDOW_UPDATE goes out whenever half of it has been used.  "
+		"The connection window is fixed at 1GB.",
+		"1048576", "bytes" },
+	{ "http_resp_size", tweak_uint, &master.http_resp_size,
+		1024, HBF_MINSIZE << (HBF_NCLASS - 1),
+		"Maximum number of bytes of HTTP response header we will "
+		"deal with.  Headers which don't fit into sess_workspace "
+		"are moved to buffers borrowed from the worker thread, so "
+		"this doesn't cost anything unless a response needs it.",
+		"65536", "bytes" },
+	{ "loop_lag_warn", tweak_uint, &master.loop_lag_warn, 0, UINT_MAX,
+		"Flag a [STAT] row with \"generator saturated\" when a "
+		"worker thread took longer than this over one round of "
+		"its event loop in that second: sessions then waited on "
+		"us, not on the server.  Zero turns it off.",
+		"50", "milliseconds" },
+	{ "pool_max_age", tweak_uint, &master.pool_max_age, 1, UINT_MAX,
+		"Idle connections older than this are closed instead of "
+		"being reused.",
+		"60", "seconds" },
+	{ "pool_max_idle", tweak_uint, &master.pool_max_idle, 0, UINT_MAX,
+		"Idle keep-alive connections kept per target address.  A "
+		"session starts on one of these, no matter which url or "
+		"session opened it, before connecting itself.  Zero "
+		"disables the pool and connections are closed once their "
+		"session is done.",
+		"0", "connections" },
+	{ "pool_max_reqs", tweak_uint, &master.pool_max_reqs, 1, UINT_MAX,
+		"Requests sent over one connection before it's closed.",
+		"unlimited", "requests" },
+	{ "hdr_scan", tweak_hdr_scan, 0, 0, 0,
+		"Byte search kernel used to split HTTP response headers.\n"
+		"  auto   - memchr.\n"
+		"  memchr - libc's memchr(3), vectorized by libc.\n"
+		"  avx2   - 32 bytes per compare.\n"
+		"  sse2   - 16 bytes per compare.\n"
+		"  scalar - one byte at a time.\n",
+		"auto", "" },
 	{ "linger", tweak_bool, &master.linger, 0, 0,
-		"Sets the linger.",
+		"Close connections with a RST (SO_LINGER with zero "
+		"timeout) instead of a FIN, so they don't sit in "
+		"TIME_WAIT holding a source port for a minute.",
 		"off", "bool" },
 	{ "read_timeout", tweak_timeout,
 		&master.read_timeout, 1, UINT_MAX,
@@ -2608,15 +6828,64 @@ static const struct parspec input_parspec[] = {
 		"6", "seconds" },
 	{ "sess_workspace", tweak_uint, &master.sess_workspace, 1024, UINT_MAX,
 		"Bytes of HTTP protocol workspace allocated for sessions. "
-		"This space must be big enough for the entire HTTP protocol "
-		"header.\n"
+		"Response headers bigger than this are moved to buffers "
+		"of up to http_resp_size bytes.\n"
 		"Minimum is 1024 bytes.",
 		"4096", "bytes" },
+	{ "src_port_range", tweak_port_range, 0, 0, 0,
+		"Source ports to bind(2) explicitly, as \"low-high\".  The "
+		"range is split evenly between the worker threads and "
+		"each walks its own share together with the -s source "
+		"IPs, trying the next port if one is busy.  \"off\" "
+		"leaves the port to the kernel.",
+		"off", "ports" },
+	{ "tcp_fastopen", tweak_bool, &master.tcp_fastopen, 0, 0,
+		"Send the first request of a new connection with the SYN "
+		"(TCP_FASTOPEN_CONNECT) once the server has handed out a "
+		"TFO cookie.  Connect time isn't measured for those "
+		"connections, the handshake is part of first byte time.  "
+		"Needs net.ipv4.tcp_fastopen & 1 on this host and TFO "
+		"enabled on the listen side.",
+		"off", "bool" },
+	{ "tcpinfo_sample", tweak_uint, &master.tcpinfo_sample, 0, UINT_MAX,
+		"Read TCP_INFO off one in this many connections as they "
+		"finish, and show the RTT, RTT variance, retransmits, "
+		"congestion window and delivery rate the kernel saw per "
+		"target in the summary.  Zero turns it off.",
+		"0", "connections" },
+	{ "tls_ktls", tweak_bool, &master.tls_ktls, 0, 0,
+		"Ask OpenSSL to hand the TLS records to the kernel (kTLS) "
+		"once the handshake is done, so the bulk of the transfer "
+		"skips user-space crypto.  Needs the tls kernel module "
+		"and a cipher it supports; otherwise OpenSSL quietly "
+		"keeps doing it.",
+		"off", "bool" },
+	{ "tls_resume", tweak_bool, &master.tls_resume, 0, 0,
+		"Resume TLS sessions.  The last session ticket or ID "
+		"each target handed out is offered on the next handshake "
+		"to it.",
+		"on", "bool" },
+	{ "trace_sample", tweak_uint, &master.trace_sample, 1, UINT_MAX,
+		"With -T, write the record of one request in this many.",
+		"1", "requests" },
+	{ "trace_size", tweak_uint, &master.trace_size, 1, UINT_MAX,
+		"With -T, records kept per worker thread.  The ring wraps "
+		"around when full, so the file of a worker stays at 64 "
+		"bytes per record however long the run.",
+		"1048576", "records" },
 	{ "write_timeout", tweak_timeout, &master.write_timeout, 0, 0,
 		"Send timeout for client connections. "
 		"If the HTTP response hasn't been transmitted in this many\n"
 		"seconds the session is closed. \n",
 		"6", "seconds" },
+	{ "zerocopy_min", tweak_uint, &master.zerocopy_min, 0, UINT_MAX,
+		"Requests with a body at least this big are written with "
+		"MSG_ZEROCOPY, so the kernel sends straight from our "
+		"copy of the body instead of copying it for every "
+		"request.  Plain TCP only.  Over loopback the kernel "
+		"copies anyway, see \"Zerocopy writes the kernel copied\".  "
+		"Zero disables it.",
+		"1048576", "bytes" },
 	{ NULL, NULL, NULL }
 };
 
@@ -2635,6 +6904,7 @@ static void
 SIP_readfile(const char* file)
 {
 	struct sockaddr_in *sin4;
+	struct sockaddr_in6 *sin6;
 	FILE* fp;
 	char line[5000];
 
@@ -2667,13 +6937,19 @@ SIP_readfile(const char* file)
 		(void)memset((void *)&srcips[num_srcips].sockaddr, 0,
 		    sizeof(srcips[num_srcips].sockaddr));
 		sin4 = (struct sockaddr_in *)&srcips[num_srcips].sockaddr;
-		if (!inet_aton(srcips[num_srcips].ip, &sin4->sin_addr)) {
+		sin6 = (struct sockaddr_in6 *)&srcips[num_srcips].sockaddr;
+		if (inet_pton(AF_INET, line, &sin4->sin_addr) == 1) {
+			sin4->sin_family = AF_INET;
+			srcips[num_srcips].sockaddrlen = sizeof(*sin4);
+		} else if (inet_pton(AF_INET6, line, &sin6->sin6_addr) == 1) {
+			sin6->sin6_family = AF_INET6;
+			srcips[num_srcips].sockaddrlen = sizeof(*sin6);
+		} else {
 			(void)fprintf(stdout,
 			    "[ERROR] cannot convert source IP address %s\n",
 			    srcips[num_srcips].ip);
 			exit(1);
 		}
-		srcips[num_srcips].sockaddrlen = sizeof(*sin4);
 		++num_srcips;
 	}
 
@@ -2788,6 +7064,212 @@ VAV_BackSlash(const char *s, char *res)
 	} while (0)
 
 
+/**********************************************************************
+ * Request template slots.  Their names aren't macros: macro_expand()
+ * leaves them in place and cmd_url() compiles what's left.
+ *
+ *   ${seq}		0, 1, 2... per url, over all sessions
+ *   ${seq:N}		the same modulo N
+ *   ${rand:LO-HI}	random integer, both ends included
+ *   ${worker}		worker thread number
+ *   ${reqid}		unique request ID, run-worker-number
+ *   ${list:a,b,c}	one of the values, picked at random
+ *
+ * ${seq} and ${reqid} have the same value everywhere in one request.
+ */
+
+static const char * const tslot_names[] = {
+	[TSLOT_SEQ] =		"seq",
+	[TSLOT_RAND] =		"rand",
+	[TSLOT_WORKER] =	"worker",
+	[TSLOT_REQID] =		"reqid",
+	[TSLOT_LIST] =		"list",
+};
+
+static unsigned
+tslot_type(const char *b, const char *e)
+{
+	const char *p;
+	unsigned u;
+
+	p = memchr(b, ':', e - b);
+	if (p == NULL)
+		p = e;
+	for (u = 1; u < sizeof tslot_names / sizeof *tslot_names; u++)
+		if (strlen(tslot_names[u]) == p - b &&
+		    !memcmp(b, tslot_names[u], p - b))
+			return (u);
+	return (0);
+}
+
+static unsigned
+tslot_digits(uint64_t v)
+{
+	unsigned n;
+
+	for (n = 1; v >= 10; v /= 10)
+		n++;
+	return (n);
+}
+
+static void
+tslot_bad(const char *b, const char *e)
+{
+
+	fprintf(stdout, "[ERROR] bad template slot ${%.*s}\n", (int)(e - b), b);
+	exit(2);
+}
+
+/* Between "${" and "}" */
+static struct tslot *
+tslot_parse(const char *b, const char *e)
+{
+	struct tslot *ts;
+	const char *a, *p, *q;
+	char *end;
+	size_t l;
+
+	ts = calloc(1, sizeof *ts);
+	XXXAN(ts);
+	ts->type = tslot_type(b, e);
+	a = memchr(b, ':', e - b);
+	if (a != NULL)
+		a++;
+	errno = 0;
+	switch (ts->type) {
+	case TSLOT_SEQ:
+		ts->maxlen = 20;
+		if (a == NULL)
+			break;
+		ts->hi = strtoull(a, &end, 10);
+		if (errno != 0 || end != e || ts->hi == 0)
+			tslot_bad(b, e);
+		ts->maxlen = tslot_digits(ts->hi - 1);
+		break;
+	case TSLOT_RAND:
+		if (a == NULL)
+			tslot_bad(b, e);
+		ts->lo = strtoull(a, &end, 10);
+		if (errno != 0 || end == a || *end != '-')
+			tslot_bad(b, e);
+		p = end + 1;
+		ts->hi = strtoull(p, &end, 10);
+		if (errno != 0 || end == p || end != e || ts->hi < ts->lo)
+			tslot_bad(b, e);
+		ts->maxlen = tslot_digits(ts->hi);
+		break;
+	case TSLOT_WORKER:
+	case TSLOT_REQID:
+		if (a != NULL)
+			tslot_bad(b, e);
+		ts->maxlen = ts->type == TSLOT_WORKER ? 10 : 8 + 1 + 10 + 1 + 20;
+		break;
+	case TSLOT_LIST:
+		if (a == NULL || a == e)
+			tslot_bad(b, e);
+		for (p = a; p <= e; p = q + 1) {
+			q = memchr(p, ',', e - p);
+			if (q == NULL)
+				q = e;
+			l = q - p;
+			ts->list = realloc(ts->list,
+			    (ts->nlist + 1) * sizeof *ts->list);
+			XXXAN(ts->list);
+			ts->list[ts->nlist] = malloc(l + 1);
+			XXXAN(ts->list[ts->nlist]);
+			memcpy(ts->list[ts->nlist], p, l);
+			ts->list[ts->nlist++][l] = '\0';
+			ts->maxlen = MAX(ts->maxlen, l);
+		}
+		break;
+	default:
+		WRONG("slot type");
+	}
+	return (ts);
+}
+
+/*
+ * Split s, NUL terminated, into static text and slots.  Returns NULL if
+ * there are no slots, and the request goes out as one piece.
+ */
+
+static struct tmpl *
+tmpl_compile(char *s, size_t len)
+{
+	struct tmpl *t = NULL;
+	struct tseg *sg;
+	struct tslot *ts;
+	char *p, *q, *r, *e = s + len;
+
+	for (p = s; (q = strstr(p, "${")) != NULL && q < e; p = r + 1) {
+		r = memchr(q, '}', e - q);
+		if (r == NULL)
+			break;
+		if (tslot_type(q + 2, r) == 0) {
+			r = q + 1;		/* not ours, stays as it is */
+			continue;
+		}
+		ts = tslot_parse(q + 2, r);
+		if (t == NULL) {
+			t = calloc(1, sizeof *t);
+			XXXAN(t);
+		}
+		t->seg = realloc(t->seg, (t->nseg + 1) * sizeof *t->seg);
+		XXXAN(t->seg);
+		sg = &t->seg[t->nseg++];
+		sg->p = p;
+		sg->len = q - p;
+		sg->slot = ts;
+		t->statlen += sg->len;
+		t->slotlen += ts->maxlen;
+		t->nslot++;
+		if (ts->type == TSLOT_SEQ)
+			t->flags |= TMPL_F_SEQ;
+		else if (ts->type == TSLOT_REQID)
+			t->flags |= TMPL_F_REQID;
+	}
+	if (t == NULL)
+		return (NULL);
+	t->seg = realloc(t->seg, (t->nseg + 1) * sizeof *t->seg);
+	XXXAN(t->seg);
+	sg = &t->seg[t->nseg++];
+	sg->p = p;
+	sg->len = e - p;
+	sg->slot = NULL;
+	t->statlen += sg->len;
+	if (t->statlen + t->slotlen > TMPL_MAXLEN) {
+		fprintf(stdout, "[ERROR] request template can grow to %zu "
+		    "bytes, more than %d\n", t->statlen + t->slotlen,
+		    TMPL_MAXLEN);
+		exit(2);
+	}
+	if (tmpl_runid == 0)
+		tmpl_runid = (uint32_t)time(NULL) ^ (uint32_t)getpid() << 16;
+	return (t);
+}
+
+/* The text the segments point into isn't ours */
+static void
+tmpl_free(struct tmpl *t)
+{
+	struct tslot *ts;
+	unsigned i, j;
+
+	if (t == NULL)
+		return;
+	for (i = 0; i < t->nseg; i++) {
+		ts = t->seg[i].slot;
+		if (ts == NULL)
+			continue;
+		for (j = 0; j < ts->nlist; j++)
+			free(ts->list[j]);
+		free(ts->list);
+		free(ts);
+	}
+	free(t->seg);
+	free(t);
+}
+
 struct macro {
 	VTAILQ_ENTRY(macro)	list;
 	char			*name;
@@ -2857,6 +7339,12 @@ macro_expand(const char *text)
 		assert(p[1] == '{');
 		assert(q[0] == '}');
 		p += 2;
+		if (tslot_type(p, q) != 0) {
+			/* filled per request, see tmpl_compile() */
+			VSB_bcat(vsb, p - 2, q + 1 - (p - 2));
+			text = q + 1;
+			continue;
+		}
 		m = macro_get(p, q);
 		if (m == NULL) {
 			VSB_delete(vsb);
@@ -2951,7 +7439,7 @@ parse_string(char *buf, const struct cmds *cmd, void *priv)
 				token_e[tn++] = p++;
 			} else { /* other tokens */
 				token_s[tn] = p;
-				for (; *p != '\0' && !vct_issp(*p); p++)
+				for (; *p != '\0' && !vct_islws(*p); p++)
 					;
 				token_e[tn++] = p;
 			}
@@ -3077,6 +7565,32 @@ VSS_parse(const char *str, char **addr, char **port)
 	return (0);
 }
 
+/* Unix domain socket, the "unix:" prefix already stripped */
+static int
+VSS_unix(const char *path, struct vss_addr ***vap)
+{
+	struct sockaddr_un *sun;
+	struct vss_addr **va;
+
+	if (*path == '\0' ||
+	    strlen(path) >= sizeof ((struct sockaddr_un *)0)->sun_path)
+		return (0);
+	va = calloc(1, sizeof *va);
+	XXXAN(va);
+	va[0] = calloc(1, sizeof(**va));
+	XXXAN(va[0]);
+	va[0]->va_family = AF_UNIX;
+	va[0]->va_socktype = SOCK_STREAM;
+	va[0]->va_protocol = 0;
+	sun = (struct sockaddr_un *)&va[0]->va_addr;
+	sun->sun_family = AF_UNIX;
+	strcpy(sun->sun_path, path);
+	va[0]->va_addrlen = offsetof(struct sockaddr_un, sun_path) +
+	    strlen(path) + 1;
+	*vap = va;
+	return (1);
+}
+
 /*
  * For a given host and port, return a list of struct vss_addr, which
  * contains all the information necessary to open and bind a socket.  One
@@ -3092,6 +7606,8 @@ VSS_parse(const char *str, char **addr, char **port)
  * If the addr argument contains a port specification, that takes
  * precedence over the port argument.
  *
+ * "unix:/path" gives the one AF_UNIX address of that socket.
+ *
  * XXX: We need a function to free the allocated addresses.
  */
 static int
@@ -3104,6 +7620,8 @@ VSS_resolve(const char *addr, const char *port, struct vss_addr ***vap)
 	char *adp, *hop;
 
 	*vap = NULL;
+	if (!strncmp(addr, "unix:", 5))
+		return (VSS_unix(addr + 5, vap));
 	memset(&hints, 0, sizeof hints);
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
@@ -3154,16 +7672,149 @@ VSS_resolve(const char *addr, const char *port, struct vss_addr ***vap)
 /* XXX: we may want to vary this */
 static const char * const nl = "\r\n";
 
+static void
+url_connect(struct url *u, const char *host, unsigned weight)
+{
+	struct vss_addr **va;
+	int i, n;
+
+	n = VSS_resolve(host, NULL, &va);
+	if (n == 0) {
+		fprintf(stdout, "[ERROR] failed to resolve %s\n", host);
+		exit(1);
+	}
+	u->vaddr = realloc(u->vaddr, (u->nvaddr + n) * sizeof *u->vaddr);
+	XXXAN(u->vaddr);
+	u->weight = realloc(u->weight, (u->nvaddr + n) * sizeof *u->weight);
+	XXXAN(u->weight);
+	for (i = 0; i < n; i++) {
+		u->vaddr[u->nvaddr] = va[i];
+		u->weight[u->nvaddr] = weight;
+		u->nvaddr++;
+	}
+	free(va);
+}
+
+/*
+ * HTTP/2 header fields are kept apart, names in lower case, and HPACK
+ * encoded for every stream so the server sees our dynamic table in use.
+ */
+
+/* A literal with both strings at their longest, and slack */
+static size_t
+h2field_maxlen(const struct h2field *f)
+{
+
+	return (f->nlen + 11 +
+	    (f->t != NULL ? f->t->statlen + f->t->slotlen : f->vlen));
+}
+
+static void
+url_h2field(struct url *u, const char *name, size_t nlen, const char *val,
+    size_t vlen)
+{
+	struct h2field *f;
+	char *p;
+	size_t i;
+
+	u->h2f = realloc(u->h2f, (u->nh2f + 1) * sizeof *u->h2f);
+	XXXAN(u->h2f);
+	f = &u->h2f[u->nh2f++];
+	p = malloc(nlen + vlen + 2);
+	XXXAN(p);
+	for (i = 0; i < nlen; i++)
+		p[i] = tolower((unsigned char)name[i]);
+	p[nlen] = '\0';
+	memcpy(p + nlen + 1, val, vlen);
+	p[nlen + 1 + vlen] = '\0';
+	f->name = p;
+	f->nlen = nlen;
+	f->val = p + nlen + 1;
+	f->vlen = vlen;
+	f->t = tmpl_compile(f->val, vlen);
+	if (f->t != NULL)
+		u->tflags |= f->t->flags;
+	u->h2hdrlen += h2field_maxlen(f);
+}
+
+static void
+url_h2hdr(struct url *u, const char *hdr)
+{
+	static const char * const hop[] = {
+		"connection", "keep-alive", "proxy-connection",
+		"transfer-encoding", "upgrade", NULL
+	};
+	const char * const *hp;
+	const char *p, *v, *e;
+	int i;
+
+	p = strchr(hdr, ':');
+	if (p == NULL || p == hdr) {
+		fprintf(stdout, "[ERROR] bad -hdr \"%s\"\n", hdr);
+		exit(2);
+	}
+	for (hp = hop; *hp != NULL; hp++)
+		if (strlen(*hp) == (size_t)(p - hdr) &&
+		    !strncasecmp(hdr, *hp, p - hdr))
+			return;		/* connection specific, not in h2 */
+	for (v = p + 1; vct_issp(*v); v++)
+		continue;
+	for (e = strchr(v, '\0'); e > v && vct_islws(e[-1]); e--)
+		continue;
+	if (p - hdr == 4 && !strncasecmp(hdr, "host", 4)) {
+		for (i = 0; i < u->nh2f; i++) {
+			if (strcmp(u->h2f[i].name, ":authority"))
+				continue;
+			/* In place, pseudo-headers must stay in front */
+			u->h2hdrlen -= h2field_maxlen(&u->h2f[i]);
+			tmpl_free(u->h2f[i].t);
+			free(u->h2f[i].name);
+			url_h2field(u, ":authority", 10, v, e - v);
+			u->h2f[i] = u->h2f[--u->nh2f];
+			u->tflags = u->tmpl != NULL ? u->tmpl->flags : 0;
+			for (i = 0; i < u->nh2f; i++)
+				if (u->h2f[i].t != NULL)
+					u->tflags |= u->h2f[i].t->flags;
+			return;
+		}
+	}
+	url_h2field(u, hdr, p - hdr, v, e - v);
+}
+
+/*
+ * The body lives apart from the header, followed by the CRLF we've
+ * always sent after it, in pages of its own that are read-only from
+ * here on: every session sends from them, MSG_ZEROCOPY included.
+ */
+
+static void
+url_body(struct url *u, const char *body)
+{
+	size_t len = strlen(body);
+	char *p;
+
+	p = mmap(NULL, len + 2, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	XXXAN(p != MAP_FAILED);
+	memcpy(p, body, len);
+	memcpy(p + len, nl, 2);
+	AZ(mprotect(p, len + 2, PROT_READ));
+	u->body = p;
+	u->bodylen = len;
+}
+
 static void
 cmd_url(CMD_ARGS)
 {
 	struct url *u;
-	struct vss_addr *vaddr;
-	const char *host = "127.0.0.1:80";
+	const char *host = NULL;
+	unsigned weight = 1;
 	const char *req = "GET";
 	const char *url = "/";
 	const char *proto = "HTTP/1.1";
 	const char *body = NULL;
+	char *end, *p, clen[24];
+	char *synth = NULL;
 
 	(void)cmd;
 	(void)priv;
@@ -3174,6 +7825,13 @@ cmd_url(CMD_ARGS)
 	AN(u);
 	u->vsb = VSB_new_auto();
 	AN(u->vsb);
+	/*
+	 * Every worker bumps this per request; away from the fields they
+	 * all read it doesn't drag those from core to core with it.
+	 */
+	AZ(posix_memalign((void **)&u->tseq, 64, 64));
+	*u->tseq = 0;
+	u->pipeline = 1;
 	VTAILQ_INSERT_TAIL(&url_list, u, list);
 	num_urls++;
 
@@ -3182,7 +7840,31 @@ cmd_url(CMD_ARGS)
 			url = av[1];
 			av++;
 		} else if (!strcmp(*av, "-connect")) {
+			if (host != NULL)
+				url_connect(u, host, weight);
 			host = av[1];
+			weight = 1;
+			av++;
+		} else if (!strcmp(*av, "-weight")) {
+			AN(av[1]);
+			weight = strtoul(av[1], NULL, 0);
+			if (host == NULL || weight < 1 || weight > 100) {
+				fprintf(stdout, "[ERROR] -weight must follow "
+				    "-connect and be 1 to 100\n");
+				exit(2);
+			}
+			av++;
+		} else if (!strcmp(*av, "-tls")) {
+			u->tls = 1;
+		} else if (!strcmp(*av, "-sni")) {
+			AN(av[1]);
+			u->sni = strdup(av[1]);
+			XXXAN(u->sni);
+			av++;
+		} else if (!strcmp(*av, "-label")) {
+			AN(av[1]);
+			u->label = strdup(av[1]);
+			XXXAN(u->label);
 			av++;
 		} else if (!strcmp(*av, "-proto")) {
 			proto = av[1];
@@ -3193,19 +7875,33 @@ cmd_url(CMD_ARGS)
 		} else
 			break;
 	}
-	u->nvaddr = VSS_resolve(host, NULL, &u->vaddr);
-	if (u->nvaddr == 0) {
-		fprintf(stdout, "[ERROR] failed to resolve %s\n", host);
-		exit(1);
+	if (host == NULL)
+		host = "127.0.0.1:80";
+	url_connect(u, host, weight);
+	if (u->label == NULL) {
+		u->label = strdup(url);
+		XXXAN(u->label);
 	}
-	vaddr = u->vaddr[0];
-	AN(vaddr);
-	VTCP_name(&vaddr->va_addr, vaddr->va_addrlen, u->addr, sizeof(u->addr),
-	    u->port, sizeof(u->port));
 
+	if (!strcmp(proto, "HTTP/2")) {
+		u->h2 = 1;
+		u->streams = 1;
+		url_h2field(u, ":method", 7, req, strlen(req));
+		url_h2field(u, ":scheme", 7, u->tls ? "https" : "http",
+		    u->tls ? 5 : 4);
+		if (!strncmp(host, "unix:", 5))
+			url_h2field(u, ":authority", 10, "localhost", 9);
+		else
+			url_h2field(u, ":authority", 10, host, strlen(host));
+		url_h2field(u, ":path", 5, url, strlen(url));
+		u->h2hdrlen += 16;
+	}
 	VSB_printf(u->vsb, "%s %s %s%s", req, url, proto, nl);
 	for (; *av != NULL; av++) {
 		if (!strcmp(*av, "-hdr")) {
+			AN(av[1]);
+			if (u->h2)
+				url_h2hdr(u, av[1]);
 			VSB_printf(u->vsb, "%s%s", av[1], nl);
 			av++;
 		} else
@@ -3218,7 +7914,71 @@ cmd_url(CMD_ARGS)
 			av++;
 		} else if (!strcmp(*av, "-bodylen")) {
 			AZ(body);
-			body = synth_body(av[1], 0);
+			body = synth = synth_body(av[1], 0);
+			av++;
+		} else
+			break;
+	}
+	for (; *av != NULL; av++) {
+		if (!strcmp(*av, "-expect_len")) {
+			AN(av[1]);
+			u->vflags |= URL_V_LEN;
+			u->vlen = strtoul(av[1], NULL, 0);
+			av++;
+		} else if (!strcmp(*av, "-expect_synth")) {
+			AN(av[1]);
+			u->vflags |= URL_V_LEN | URL_V_SYNTH;
+			u->vlen = strtoul(av[1], NULL, 0);
+			if (u->vlen <= 0) {
+				fprintf(stdout,
+				    "[ERROR] wrong length for -expect_synth\n");
+				exit(2);
+			}
+			if (synth_pat == NULL)
+				synth_pat = synth_body("5953", 0);
+			av++;
+		} else if (!strcmp(*av, "-expect_hash")) {
+			AN(av[1]);
+			p = strchr(av[1], ':');
+			if (p != NULL) {
+				*p++ = '\0';
+				u->vhtype = VHASH_Type(av[1]);
+				errno = 0;
+				u->vdigest = strtoull(p, &end, 16);
+			}
+			if (p == NULL || u->vhtype == VHASH_NONE ||
+			    errno != 0 || end == p || *end != '\0') {
+				fprintf(stdout,
+				    "[ERROR] -expect_hash wants "
+				    "\"crc32c:<hex>\" or \"xxh64:<hex>\"\n");
+				exit(2);
+			}
+			u->vflags |= URL_V_HASH;
+			av++;
+		} else
+			break;
+	}
+	for (; *av != NULL; av++) {
+		if (!strcmp(*av, "-pipeline")) {
+			AN(av[1]);
+			u->pipeline = strtoul(av[1], NULL, 0);
+			if (u->pipeline < 1 || u->pipeline > URL_PIPELINE_MAX) {
+				fprintf(stdout,
+				    "[ERROR] -pipeline must be 1 to %d\n",
+				    URL_PIPELINE_MAX);
+				exit(2);
+			}
+			av++;
+		} else if (!strcmp(*av, "-streams")) {
+			AN(av[1]);
+			u->streams = strtoul(av[1], NULL, 0);
+			if (!u->h2 || u->streams < 1 ||
+			    u->streams > URL_STREAMS_MAX) {
+				fprintf(stdout,
+				    "[ERROR] -streams wants -proto \"HTTP/2\" "
+				    "and 1 to %d\n", URL_STREAMS_MAX);
+				exit(2);
+			}
 			av++;
 		} else
 			break;
@@ -3227,15 +7987,27 @@ cmd_url(CMD_ARGS)
 		fprintf(stdout, "[ERROR] Unknown http txreq spec: %s\n", *av);
 		exit(2);
 	}
-	if (body != NULL)
-		VSB_printf(u->vsb, "Content-Length: %ju%s",
-		    (uintmax_t)strlen(body), nl);
-	VSB_cat(u->vsb, nl);
+	if (u->h2 && u->pipeline > 1) {
+		fprintf(stdout,
+		    "[ERROR] HTTP/2 multiplexes, use -streams not -pipeline\n");
+		exit(2);
+	}
 	if (body != NULL) {
-		VSB_cat(u->vsb, body);
-		VSB_cat(u->vsb, nl);
+		url_body(u, body);
+		free(synth);
+		bprintf(clen, "%ju", (uintmax_t)u->bodylen);
+		if (u->h2)
+			url_h2field(u, "content-length", 14, clen,
+			    strlen(clen));
+		VSB_printf(u->vsb, "Content-Length: %s%s", clen, nl);
 	}
+	VSB_cat(u->vsb, nl);
 	VSB_finish(u->vsb);
+	if (!u->h2) {
+		u->tmpl = tmpl_compile(VSB_data(u->vsb), VSB_len(u->vsb));
+		if (u->tmpl != NULL)
+			u->tflags |= u->tmpl->flags;
+	}
 }
 
 static const struct cmds url_cmds[] = {
@@ -3262,6 +8034,43 @@ URL_readfile(const char *file)
 	    num_urls, file);
 }
 
+/*--------------------------------------------------------------------
+ * Smooth weighted round-robin: each pick goes to the address furthest
+ * behind its share, so weights 5,1,1 give a a b a c a a rather than
+ * five a's in a row.  Done once here; sessions just walk the result.
+ */
+
+static void
+url_sched(struct url *u)
+{
+	int *cur, i, j, best;
+	unsigned total;
+
+	AN(u->nvaddr);
+	u->tgts = calloc(u->nvaddr, sizeof *u->tgts);
+	XXXAN(u->tgts);
+	cur = calloc(u->nvaddr, sizeof *cur);
+	XXXAN(cur);
+	for (i = 0, total = 0; i < u->nvaddr; i++) {
+		u->tgts[i] = TGT_Find(u->vaddr[i], u->tls, u->sni, u->h2);
+		total += u->weight[i];
+	}
+	u->sched = calloc(total, sizeof *u->sched);
+	XXXAN(u->sched);
+	u->nsched = total;
+	for (j = 0; j < total; j++) {
+		best = 0;
+		for (i = 0; i < u->nvaddr; i++) {
+			cur[i] += u->weight[i];
+			if (cur[i] > cur[best])
+				best = i;
+		}
+		cur[best] -= total;
+		u->sched[j] = best;
+	}
+	free(cur);
+}
+
 static void
 URL_postjob(void)
 {
@@ -3270,8 +8079,10 @@ URL_postjob(void)
 
 	urls = (struct url **)malloc(sizeof(struct url *) * num_urls);
 	AN(urls);
-	VTAILQ_FOREACH(u, &url_list, list)
+	VTAILQ_FOREACH(u, &url_list, list) {
 		urls[i++] = u;
+		url_sched(u);
+	}
 }
 
 static void
@@ -3283,10 +8094,17 @@ usage(void)
 	fprintf(stdout, FMT, "-c N", "Limits total TCP connections");
 	fprintf(stdout, FMT, "-C N", "Sets request number per a conn");
 	fprintf(stdout, FMT, "-m N", "Limits concurrent TCP connections");
+	fprintf(stdout, FMT, "-M [address:]port", "Serves Prometheus /metrics");
+	fprintf(stdout, FMT, "-n name", "Publishes stats for varnishperfstat");
+	fprintf(stdout, FMT, "-o file", "Writes each second as JSON lines "
+	    "(CSV if *.csv)");
+	fprintf(stdout, FMT, "-O file", "Writes the summary as JSON");
 	fprintf(stderr, FMT, "-p param=value", "set parameter");
 	fprintf(stdout, FMT, "-r N", "Sets rate");
 	fprintf(stdout, FMT, "-s file", "Sets file path containing src IP");
 	fprintf(stdout, FMT, "-t N", "Sets number of threads");
+	fprintf(stdout, FMT, "-T prefix",
+	    "Traces requests into prefix.<thread>");
 	fprintf(stdout, FMT, "-z", "Shows all statistic fields");
 	exit(1);
 }
@@ -3294,13 +8112,13 @@ usage(void)
 int
 main(int argc, char *argv[])
 {
-	int ch;
+	int ch, i;
 	char *end, *p;
 	const char *s_arg = NULL;
 
 	MCF_ParamInit();
 
-	while ((ch = getopt(argc, argv, "c:C:m:p:r:s:t:z")) != -1) {
+	while ((ch = getopt(argc, argv, "c:C:m:M:n:o:O:p:r:s:t:T:z")) != -1) {
 		switch (ch) {
 		case 'c':
 			errno = 0;
@@ -3334,6 +8152,18 @@ main(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case 'M':
+			M_arg = optarg;
+			break;
+		case 'n':
+			n_arg = optarg;
+			break;
+		case 'o':
+			o_arg = optarg;
+			break;
+		case 'O':
+			O_arg = optarg;
+			break;
 		case 'p':
 			p = strchr(optarg, '=');
 			if (p == NULL)
@@ -3363,6 +8193,9 @@ main(int argc, char *argv[])
 				exit(1);
 			}
 			break;
+		case 'T':
+			T_arg = optarg;
+			break;
 		case 'z':
 			z_flag = 1 - z_flag;
 			break;
@@ -3379,6 +8212,9 @@ main(int argc, char *argv[])
 
 	LCK_Init();
 	init_macro();
+	HDR_Init();
+	VHASH_Init();
+	VHPACK_Init();
 
 	if (s_arg != NULL)
 		SIP_readfile(s_arg);
@@ -3389,7 +8225,18 @@ main(int argc, char *argv[])
 		fprintf(stdout, "[ERROR] No URLs found.\n");
 		usage();
 	}
+	for (i = 0; i < num_urls; i++)
+		if (urls[i]->tls) {
+			TLS_Init();
+			break;
+		}
 	PEF_Init();
+	OUT_Init();
+	VSM_Init();
+	MET_Init();
 	PEF_Run();
+	MET_Fini();
+	VSM_Fini();
+	OUT_Fini();
 	return (0);
 }
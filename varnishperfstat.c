@@ -0,0 +1,416 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Shows what running varnishperf -n instances publish, see vsm.h.
+ * With no -n, a line per generator found on this host.
+ *
+ *	$ ./varnishperfstat [-1jz] [-n name] [-w seconds]
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "vqueue.h"
+#include "vsm.h"
+
+struct seg {
+	char			name[NAME_MAX];
+	int			seen;
+	const struct vsm_head	*h;
+	size_t			len;
+
+	/* Last consistent copy and the one before */
+	double			t;
+	double			t_prev;
+	union vsm_val		*val;
+	union vsm_val		*prev;
+	struct vsm_lat		*lat;
+
+	VTAILQ_ENTRY(seg)	list;
+};
+static VTAILQ_HEAD(, seg)	segs = VTAILQ_HEAD_INITIALIZER(segs);
+
+static int			once;
+static int			json;
+static int			all;
+
+static void
+seg_free(struct seg *sg)
+{
+
+	VTAILQ_REMOVE(&segs, sg, list);
+	(void)munmap((void *)(uintptr_t)sg->h, sg->len);
+	free(sg->val);
+	free(sg->prev);
+	free(sg->lat);
+	free(sg);
+}
+
+static struct seg *
+seg_attach(const char *name)
+{
+	const struct vsm_head *h;
+	struct seg *sg;
+	struct stat st;
+	char path[NAME_MAX + 2];
+	void *p;
+	int fd;
+
+	snprintf(path, sizeof(path), "/%s", name);
+	fd = shm_open(path, O_RDONLY, 0);
+	if (fd == -1)
+		return (NULL);
+	if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*h)) {
+		(void)close(fd);
+		return (NULL);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (p == MAP_FAILED)
+		return (NULL);
+	h = p;
+	if (memcmp(h->magic, VSM_MAGIC, sizeof(h->magic)) ||
+	    h->version != VSM_VERSION || h->npct > VSM_MAXPCT ||
+	    h->off_lat + h->nlat * sizeof(struct vsm_lat) >
+	    (uint64_t)st.st_size ||
+	    h->off_val + h->nfield * sizeof(union vsm_val) > h->off_lat ||
+	    h->off_field + h->nfield * sizeof(struct vsm_field) >
+	    h->off_val) {
+		(void)munmap(p, st.st_size);
+		return (NULL);
+	}
+	sg = calloc(1, sizeof(*sg));
+	if (sg == NULL)
+		exit(2);
+	snprintf(sg->name, sizeof(sg->name), "%s",
+	    name + strlen(VSM_PREFIX));
+	sg->h = h;
+	sg->len = st.st_size;
+	sg->val = calloc(h->nfield, sizeof(*sg->val));
+	sg->prev = calloc(h->nfield, sizeof(*sg->prev));
+	sg->lat = calloc(h->nlat, sizeof(*sg->lat));
+	if (sg->val == NULL || sg->prev == NULL || sg->lat == NULL)
+		exit(2);
+	VTAILQ_INSERT_TAIL(&segs, sg, list);
+	return (sg);
+}
+
+/*
+ * Copies the values out while the writer isn't in the middle of them.
+ */
+
+static void
+seg_snap(struct seg *sg)
+{
+	const struct vsm_head *h = sg->h;
+	union vsm_val *v;
+	uint32_t seq;
+
+	v = sg->prev;
+	sg->prev = sg->val;
+	sg->val = v;
+	sg->t_prev = sg->t;
+	do {
+		while ((seq = h->seq) & 1)
+			(void)usleep(100);
+		__sync_synchronize();
+		memcpy(sg->val, (const char *)h + h->off_val,
+		    h->nfield * sizeof(*sg->val));
+		memcpy(sg->lat, (const char *)h + h->off_lat,
+		    h->nlat * sizeof(*sg->lat));
+		sg->t = h->t_update;
+		__sync_synchronize();
+	} while (h->seq != seq);
+}
+
+static const struct vsm_field *
+seg_field(const struct seg *sg, unsigned i)
+{
+
+	return ((const struct vsm_field *)(const void *)
+	    ((const char *)sg->h + sg->h->off_field) + i);
+}
+
+static double
+seg_val(const struct seg *sg, const union vsm_val *v, const char *name)
+{
+	unsigned i;
+
+	for (i = 0; i < sg->h->nfield; i++)
+		if (!strcmp(seg_field(sg, i)->name, name))
+			return (seg_field(sg, i)->type == 'd' ? v[i].d :
+			    (double)v[i].u);
+	return (0.);
+}
+
+/*
+ * Per second since the last look, or since the start on the first one.
+ */
+
+static double
+seg_rate(const struct seg *sg, const char *name)
+{
+
+	if (sg->t_prev == 0.)
+		return (sg->t > sg->h->t_boot ? seg_val(sg, sg->val, name) /
+		    (sg->t - sg->h->t_boot) : 0.);
+	if (sg->t <= sg->t_prev)
+		return (0.);
+	return ((seg_val(sg, sg->val, name) - seg_val(sg, sg->prev, name)) /
+	    (sg->t - sg->t_prev));
+}
+
+/*
+ * Picks up generators which started since the last look and drops the
+ * ones which are gone.
+ */
+
+static void
+seg_scan(const char *only)
+{
+	struct seg *sg, *sg2;
+	struct dirent *de;
+	DIR *d;
+
+	VTAILQ_FOREACH(sg, &segs, list)
+		sg->seen = 0;
+	d = opendir("/dev/shm");
+	if (d != NULL) {
+		while ((de = readdir(d)) != NULL) {
+			if (strncmp(de->d_name, VSM_PREFIX,
+			    strlen(VSM_PREFIX)))
+				continue;
+			if (only != NULL &&
+			    strcmp(de->d_name + strlen(VSM_PREFIX), only))
+				continue;
+			VTAILQ_FOREACH(sg, &segs, list)
+				if (!strcmp(sg->name,
+				    de->d_name + strlen(VSM_PREFIX)))
+					break;
+			if (sg == NULL)
+				sg = seg_attach(de->d_name);
+			if (sg != NULL)
+				sg->seen = 1;
+		}
+		(void)closedir(d);
+	}
+	VTAILQ_FOREACH_SAFE(sg, &segs, list, sg2) {
+		if (!sg->seen || sg->h->done)
+			seg_free(sg);
+		else
+			seg_snap(sg);
+	}
+}
+
+/*--------------------------------------------------------------------*/
+
+static void
+show_list(void)
+{
+	const struct seg *sg;
+	double now;
+	unsigned i;
+
+	now = (double)time(NULL);
+	printf("%-16s %8s %9s %9s %9s %7s %7s %7s", "name", "pid", "uptime",
+	    "req/s", "ok/s", "err/s", "conns", "timeout");
+	for (i = 0; i < 2; i++)
+		printf(" %9s", i == 0 ? "p50 ms" : "p99 ms");
+	printf("\n");
+	VTAILQ_FOREACH(sg, &segs, list) {
+		const struct vsm_lat *tot = &sg->lat[sg->h->nlat - 1];
+
+		printf("%-16s %8jd %9.0f %9.0f %9.0f %7.0f %7.0f %7.0f",
+		    sg->name, (intmax_t)sg->h->pid, now - sg->h->t_boot,
+		    seg_rate(sg, "n_req"), seg_rate(sg, "n_httpok"),
+		    seg_rate(sg, "n_httperror"),
+		    seg_val(sg, sg->val, "n_conn"),
+		    seg_val(sg, sg->val, "n_timeout"));
+		/* "total" is the last phase, p50 and p99 the 1st and 3rd */
+		if (tot->n == 0 || sg->h->npct < 3)
+			printf(" %9s %9s\n", "na", "na");
+		else
+			printf(" %9.3f %9.3f\n", tot->ms[0], tot->ms[2]);
+	}
+}
+
+static void
+show_one(const struct seg *sg)
+{
+	const struct vsm_field *f;
+	unsigned i, j;
+	double v;
+
+	printf("%s (pid %jd)\n\n", sg->name, (intmax_t)sg->h->pid);
+	for (i = 0; i < sg->h->nfield; i++) {
+		f = seg_field(sg, i);
+		v = f->type == 'd' ? sg->val[i].d : (double)sg->val[i].u;
+		if (v == 0. && !all)
+			continue;
+		if (f->type == 'd')
+			printf("%-20s %14.3f", f->name, v);
+		else
+			printf("%-20s %14ju", f->name, (uintmax_t)sg->val[i].u);
+		if (f->flag == 'c')
+			printf(" %12.2f", seg_rate(sg, f->name));
+		else
+			printf(" %12s", ".");
+		printf("  %s\n", f->desc);
+	}
+	printf("\n%-12s %8s", "last 1s ms", "n");
+	for (j = 0; j < sg->h->npct; j++)
+		printf(" %9s", sg->h->pctname[j]);
+	printf("\n");
+	for (i = 0; i < sg->h->nlat; i++) {
+		if (sg->lat[i].n == 0 && !all)
+			continue;
+		printf("%-12s %8ju", sg->lat[i].name,
+		    (uintmax_t)sg->lat[i].n);
+		for (j = 0; j < sg->h->npct; j++)
+			printf(" %9.3f", sg->lat[i].ms[j]);
+		printf("\n");
+	}
+}
+
+static void
+show_json(void)
+{
+	const struct vsm_field *f;
+	const struct seg *sg;
+	unsigned i, j;
+
+	printf("{");
+	VTAILQ_FOREACH(sg, &segs, list) {
+		printf("%s\"%s\": {\"pid\": %jd, \"time\": %.3f, "
+		    "\"counters\": {", sg == VTAILQ_FIRST(&segs) ? "" : ", ",
+		    sg->name, (intmax_t)sg->h->pid, sg->t);
+		for (i = 0; i < sg->h->nfield; i++) {
+			f = seg_field(sg, i);
+			printf("%s\"%s\": ", i == 0 ? "" : ", ", f->name);
+			if (f->type == 'd')
+				printf("%.6f", sg->val[i].d);
+			else
+				printf("%ju", (uintmax_t)sg->val[i].u);
+		}
+		printf("}, \"latency_ms\": {");
+		for (i = 0; i < sg->h->nlat; i++) {
+			printf("%s\"%s\": {\"n\": %ju", i == 0 ? "" : ", ",
+			    sg->lat[i].name, (uintmax_t)sg->lat[i].n);
+			for (j = 0; j < sg->h->npct; j++)
+				printf(", \"%s\": %.3f", sg->h->pctname[j],
+				    sg->lat[i].ms[j]);
+			printf("}");
+		}
+		printf("}}");
+	}
+	printf("}\n");
+}
+
+static void
+usage(void)
+{
+
+	fprintf(stderr, "usage: varnishperfstat [-1jz] [-n name] "
+	    "[-w seconds]\n");
+	fprintf(stderr, "    -1          # Shows the stats once and exits\n");
+	fprintf(stderr, "    -j          # Prints JSON once and exits\n");
+	fprintf(stderr, "    -n name     # Shows all of the generator "
+	    "started with -n name\n");
+	fprintf(stderr, "    -w seconds  # Refresh interval\n");
+	fprintf(stderr, "    -z          # Shows zero values too\n");
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *n_arg = NULL;
+	unsigned w_arg = 1;
+	char *end;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "1jn:w:z")) != -1) {
+		switch (ch) {
+		case '1':
+			once = 1;
+			break;
+		case 'j':
+			json = 1;
+			break;
+		case 'n':
+			n_arg = optarg;
+			break;
+		case 'w':
+			w_arg = strtoul(optarg, &end, 10);
+			if (end == optarg || *end || w_arg == 0)
+				usage();
+			break;
+		case 'z':
+			all = 1;
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc)
+		usage();
+
+	seg_scan(n_arg);
+	if (n_arg != NULL && VTAILQ_EMPTY(&segs)) {
+		fprintf(stderr, "No varnishperf -n %s running\n", n_arg);
+		exit(1);
+	}
+	if (json) {
+		show_json();
+		return (0);
+	}
+	for (;;) {
+		if (!once) {
+			(void)sleep(w_arg);
+			seg_scan(n_arg);
+			printf("\033[H\033[2J");
+		}
+		if (n_arg == NULL)
+			show_list();
+		else if (!VTAILQ_EMPTY(&segs))
+			show_one(VTAILQ_FIRST(&segs));
+		else
+			printf("varnishperf -n %s is gone\n", n_arg);
+		(void)fflush(stdout);
+		if (once)
+			break;
+	}
+	return (0);
+}
@@ -0,0 +1,180 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define	VFIND_X86	1
+#endif
+
+#include "vfind.h"
+
+/* Same contract as strchr(3): the caller owns the buffer. */
+static inline char *
+vfind_unconst(const char *p)
+{
+
+	return ((char *)(uintptr_t)p);
+}
+
+/*--------------------------------------------------------------------
+ * Portable fallback and the default: libc's memchr(3) is vectorized on
+ * about every platform and, on the headers we see, keeps up with the
+ * kernels below.
+ */
+
+static char *
+vfind_memchr(const char *b, const char *e, int c)
+{
+
+	if (b >= e)
+		return (NULL);
+	return (memchr(b, c, e - b));
+}
+
+/*--------------------------------------------------------------------
+ * One byte at a time, for comparison.
+ */
+
+static char *
+vfind_scalar(const char *b, const char *e, int c)
+{
+
+	for (; b < e; b++)
+		if (*b == (char)c)
+			return (vfind_unconst(b));
+	return (NULL);
+}
+
+#ifdef VFIND_X86
+/*--------------------------------------------------------------------
+ * 16 bytes per compare.  SSE2 is part of the x86_64 baseline so this
+ * needs no CPU check there.
+ */
+
+__attribute__((target("sse2")))
+static char *
+vfind_sse2(const char *b, const char *e, int c)
+{
+	__m128i n, v;
+	unsigned m;
+
+	n = _mm_set1_epi8((char)c);
+	for (; e - b >= 16; b += 16) {
+		v = _mm_loadu_si128((const __m128i *)(const void *)b);
+		m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, n));
+		if (m != 0)
+			return (vfind_unconst(b + __builtin_ctz(m)));
+	}
+	return (vfind_scalar(b, e, c));
+}
+
+/*--------------------------------------------------------------------
+ * 32 bytes per compare, then let SSE2 deal with the tail.
+ */
+
+__attribute__((target("avx2")))
+static char *
+vfind_avx2(const char *b, const char *e, int c)
+{
+	__m256i n, v;
+	unsigned m;
+
+	n = _mm256_set1_epi8((char)c);
+	for (; e - b >= 32; b += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(const void *)b);
+		m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, n));
+		if (m != 0)
+			return (vfind_unconst(b + __builtin_ctz(m)));
+	}
+	return (vfind_sse2(b, e, c));
+}
+#endif
+
+/*--------------------------------------------------------------------*/
+
+static const struct vfind_impl {
+	const char	*name;
+	vfind_f		*func;
+} vfind_impls[] = {
+	{ "memchr",	vfind_memchr },
+#ifdef VFIND_X86
+	{ "avx2",	vfind_avx2 },
+	{ "sse2",	vfind_sse2 },
+#endif
+	{ "scalar",	vfind_scalar },
+	{ NULL,		NULL }
+};
+
+vfind_f		*VFIND_chr = vfind_memchr;
+const char	*VFIND_name = "memchr";
+
+static int
+vfind_usable(const char *name)
+{
+
+#ifdef VFIND_X86
+	__builtin_cpu_init();
+	if (!strcmp(name, "avx2"))
+		return (__builtin_cpu_supports("avx2"));
+	if (!strcmp(name, "sse2"))
+		return (__builtin_cpu_supports("sse2"));
+#endif
+	return (!strcmp(name, "memchr") || !strcmp(name, "scalar"));
+}
+
+/*--------------------------------------------------------------------
+ * Use the named kernel.  Returns -1 if it's unknown or this CPU can't
+ * run it.
+ */
+
+int
+VFIND_Select(const char *name)
+{
+	const struct vfind_impl *vi;
+
+	for (vi = vfind_impls; vi->name != NULL; vi++) {
+		if (strcmp(vi->name, name))
+			continue;
+		if (!vfind_usable(name))
+			return (-1);
+		VFIND_chr = vi->func;
+		VFIND_name = vi->name;
+		return (0);
+	}
+	return (-1);
+}
+
+void
+VFIND_Init(void)
+{
+	const struct vfind_impl *vi;
+
+	for (vi = vfind_impls; vi->name != NULL; vi++)
+		if (VFIND_Select(vi->name) == 0)
+			return;
+}
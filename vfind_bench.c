@@ -0,0 +1,184 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Microbenchmark for the header splitting kernels in vfind.c, against
+ * the vct-based byte loop the parser used before.
+ *
+ *	$ make bench && ./vfind_bench [loops]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "vct.h"
+#include "vfind.h"
+
+static const char * const hdrs[] = {
+	/* A cache hit for a small object */
+	"HTTP/1.1 200 OK\r\n"
+	"Server: Apache/2.2.15 (CentOS)\r\n"
+	"Last-Modified: Fri, 09 Nov 2012 07:05:31 GMT\r\n"
+	"ETag: \"1a0d4c-1-4ce0a3e1e2cc0\"\r\n"
+	"Content-Type: text/plain; charset=UTF-8\r\n"
+	"Content-Length: 1\r\n"
+	"Accept-Ranges: bytes\r\n"
+	"Date: Fri, 09 Nov 2012 07:10:02 GMT\r\n"
+	"X-Varnish: 1897263451 1897263012\r\n"
+	"Age: 31\r\n"
+	"Via: 1.1 varnish\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+	/* A pass with the usual application baggage */
+	"HTTP/1.1 200 OK\r\n"
+	"Server: nginx\r\n"
+	"Date: Fri, 09 Nov 2012 07:10:02 GMT\r\n"
+	"Content-Type: text/html; charset=utf-8\r\n"
+	"Transfer-Encoding: chunked\r\n"
+	"Cache-Control: private, no-cache, no-store, must-revalidate\r\n"
+	"Set-Cookie: SESSIONID=4f6e2b1c9d0a8e7f3b5c1d2e4f6a8b0c; path=/; "
+	"HttpOnly\r\n"
+	"Set-Cookie: prefs=lang%3Den%7Ctz%3DAsia%2FSeoul%7Ctheme%3Ddark; "
+	"expires=Sat, 09-Nov-2013 07:10:02 GMT; path=/\r\n"
+	"Content-Security-Policy: default-src 'self'; script-src 'self' "
+	"https://cdn.example.com https://www.google-analytics.com; img-src "
+	"'self' data: https://*.example.com; style-src 'self' "
+	"'unsafe-inline'\r\n"
+	"X-Frame-Options: SAMEORIGIN\r\n"
+	"Vary: Accept-Encoding, Cookie\r\n"
+	"X-Varnish: 1897263452\r\n"
+	"Age: 0\r\n"
+	"Via: 1.1 varnish\r\n"
+	"Connection: keep-alive\r\n"
+	"\r\n",
+	NULL
+};
+
+/* What http_probe_splitheader() used to do per line. */
+static unsigned
+split_vct(const char *b, const char *e)
+{
+	const char *p;
+	unsigned sum = 0;
+
+	for (p = b; p < e; ) {
+		b = p;
+		while (p < e && !vct_iscrlf(*p))
+			p++;
+		if (p == b)
+			break;
+		while (b < p && *b != ':')
+			b++;
+		sum += p - b;
+		p += vct_skipcrlf(p);
+	}
+	return (sum);
+}
+
+static unsigned
+split_memchr(const char *b, const char *e)
+{
+	const char *p, *q;
+	unsigned sum = 0;
+
+	for (; b < e; b = p + 1) {
+		p = memchr(b, '\n', e - b);
+		if (p == NULL || p - b <= 1)
+			break;
+		q = memchr(b, ':', p - b);
+		sum += p - (q == NULL ? p : q) - 1;
+	}
+	return (sum);
+}
+
+static unsigned
+split_vfind(const char *b, const char *e)
+{
+	const char *p, *q;
+	unsigned sum = 0;
+
+	for (; b < e; b = p + 1) {
+		p = VFIND_chr(b, e, '\n');
+		if (p == NULL || p - b <= 1)
+			break;
+		q = VFIND_chr(b, p, ':');
+		sum += p - (q == NULL ? p : q) - 1;
+	}
+	return (sum);
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+static void
+run(const char *name, unsigned (*func)(const char *, const char *),
+    const char *h, long loops)
+{
+	volatile unsigned sink = 0;
+	double t0, t1;
+	size_t l;
+	long i;
+
+	l = strlen(h);
+	t0 = now();
+	for (i = 0; i < loops; i++)
+		sink += func(h, h + l);
+	t1 = now();
+	printf("  %-8s %8.1f ns/hdr %8.2f GB/s\n", name,
+	    1e9 * (t1 - t0) / loops, l * loops / (t1 - t0) / 1e9);
+	(void)sink;
+}
+
+int
+main(int argc, char **argv)
+{
+	static const char * const kernels[] = { "scalar", "sse2", "avx2",
+	    NULL };
+	const char * const *k;
+	int i;
+	long loops = 1000000;
+
+	if (argc > 1)
+		loops = strtol(argv[1], NULL, 0);
+	for (i = 0; hdrs[i] != NULL; i++) {
+		printf("header #%d (%zu bytes)\n", i, strlen(hdrs[i]));
+		run("vct", split_vct, hdrs[i], loops);
+		run("memchr", split_memchr, hdrs[i], loops);
+		for (k = kernels; *k != NULL; k++) {
+			if (VFIND_Select(*k))
+				continue;
+			run(*k, split_vfind, hdrs[i], loops);
+		}
+	}
+	return (0);
+}
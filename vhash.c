@@ -0,0 +1,306 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * XXH64 follows the reference implementation by Yann Collet
+ * (https://github.com/Cyan4973/xxHash), CRC32C is the Castagnoli
+ * polynomial as used by iSCSI and SSE4.2.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define	VHASH_X86_64	1
+#endif
+
+#include "vhash.h"
+
+/*--------------------------------------------------------------------
+ * CRC32C
+ */
+
+static uint32_t crc32c_tab[8][256];
+
+static uint32_t
+crc32c_sw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t w;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		crc = crc32c_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+		len--;
+	}
+	/* Slicing-by-8 */
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		w ^= crc;
+		crc = crc32c_tab[7][w & 0xff] ^
+		    crc32c_tab[6][(w >> 8) & 0xff] ^
+		    crc32c_tab[5][(w >> 16) & 0xff] ^
+		    crc32c_tab[4][(w >> 24) & 0xff] ^
+		    crc32c_tab[3][(w >> 32) & 0xff] ^
+		    crc32c_tab[2][(w >> 40) & 0xff] ^
+		    crc32c_tab[1][(w >> 48) & 0xff] ^
+		    crc32c_tab[0][w >> 56];
+	}
+	while (len-- > 0)
+		crc = crc32c_tab[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return (crc);
+}
+
+#ifdef VHASH_X86_64
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32c_hw(uint32_t crc, const unsigned char *p, size_t len)
+{
+	uint64_t c = crc, w;
+
+	while (len > 0 && ((uintptr_t)p & 7) != 0) {
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+		len--;
+	}
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, 8);
+		c = _mm_crc32_u64(c, w);
+	}
+	while (len-- > 0)
+		c = _mm_crc32_u8((uint32_t)c, *p++);
+	return ((uint32_t)c);
+}
+#endif
+
+static uint32_t (*crc32c)(uint32_t, const unsigned char *, size_t) =
+    crc32c_sw;
+
+/*--------------------------------------------------------------------
+ * XXH64, seed 0
+ */
+
+#define	XXH_P1		11400714785074694791ULL
+#define	XXH_P2		14029467366897019727ULL
+#define	XXH_P3		1609587929392839161ULL
+#define	XXH_P4		9650029242287828579ULL
+#define	XXH_P5		2870177450012600261ULL
+
+static inline uint64_t
+xxh_rotl(uint64_t x, int r)
+{
+
+	return ((x << r) | (x >> (64 - r)));
+}
+
+static inline uint64_t
+xxh_read64(const unsigned char *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, 8);
+	return (v);
+}
+
+static inline uint32_t
+xxh_read32(const unsigned char *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return (v);
+}
+
+static inline uint64_t
+xxh_round(uint64_t acc, uint64_t input)
+{
+
+	acc += input * XXH_P2;
+	acc = xxh_rotl(acc, 31);
+	return (acc * XXH_P1);
+}
+
+static inline uint64_t
+xxh_merge(uint64_t acc, uint64_t val)
+{
+
+	acc ^= xxh_round(0, val);
+	return (acc * XXH_P1 + XXH_P4);
+}
+
+static void
+xxh64_update(struct vhash *vh, const unsigned char *p, size_t len)
+{
+	const unsigned char *e = p + len;
+
+	vh->total += len;
+	if (vh->memsize + len < 32) {
+		memcpy(vh->mem + vh->memsize, p, len);
+		vh->memsize += len;
+		return;
+	}
+	if (vh->memsize > 0) {
+		memcpy(vh->mem + vh->memsize, p, 32 - vh->memsize);
+		p += 32 - vh->memsize;
+		vh->v[0] = xxh_round(vh->v[0], xxh_read64(vh->mem));
+		vh->v[1] = xxh_round(vh->v[1], xxh_read64(vh->mem + 8));
+		vh->v[2] = xxh_round(vh->v[2], xxh_read64(vh->mem + 16));
+		vh->v[3] = xxh_round(vh->v[3], xxh_read64(vh->mem + 24));
+		vh->memsize = 0;
+	}
+	for (; e - p >= 32; p += 32) {
+		vh->v[0] = xxh_round(vh->v[0], xxh_read64(p));
+		vh->v[1] = xxh_round(vh->v[1], xxh_read64(p + 8));
+		vh->v[2] = xxh_round(vh->v[2], xxh_read64(p + 16));
+		vh->v[3] = xxh_round(vh->v[3], xxh_read64(p + 24));
+	}
+	if (p < e) {
+		memcpy(vh->mem, p, e - p);
+		vh->memsize = e - p;
+	}
+}
+
+static uint64_t
+xxh64_final(const struct vhash *vh)
+{
+	const unsigned char *p = vh->mem, *e = vh->mem + vh->memsize;
+	uint64_t h;
+
+	if (vh->total >= 32) {
+		h = xxh_rotl(vh->v[0], 1) + xxh_rotl(vh->v[1], 7) +
+		    xxh_rotl(vh->v[2], 12) + xxh_rotl(vh->v[3], 18);
+		h = xxh_merge(h, vh->v[0]);
+		h = xxh_merge(h, vh->v[1]);
+		h = xxh_merge(h, vh->v[2]);
+		h = xxh_merge(h, vh->v[3]);
+	} else
+		h = XXH_P5;
+	h += vh->total;
+	for (; e - p >= 8; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (e - p >= 4) {
+		h ^= (uint64_t)xxh_read32(p) * XXH_P1;
+		h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < e; p++) {
+		h ^= *p * XXH_P5;
+		h = xxh_rotl(h, 11) * XXH_P1;
+	}
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return (h);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+VHASH_Init(void)
+{
+	uint32_t c;
+	int i, j;
+
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (j = 0; j < 8; j++)
+			c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+		crc32c_tab[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		c = crc32c_tab[0][i];
+		for (j = 1; j < 8; j++) {
+			c = crc32c_tab[0][c & 0xff] ^ (c >> 8);
+			crc32c_tab[j][i] = c;
+		}
+	}
+#ifdef VHASH_X86_64
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse4.2"))
+		crc32c = crc32c_hw;
+#endif
+}
+
+enum vhash_type
+VHASH_Type(const char *name)
+{
+
+	if (!strcmp(name, "crc32c"))
+		return (VHASH_CRC32C);
+	if (!strcmp(name, "xxh64"))
+		return (VHASH_XXH64);
+	return (VHASH_NONE);
+}
+
+void
+VHASH_Start(struct vhash *vh, enum vhash_type type)
+{
+
+	memset(vh, 0, sizeof(*vh));
+	vh->type = type;
+	switch (type) {
+	case VHASH_CRC32C:
+		vh->crc = 0xffffffff;
+		break;
+	case VHASH_XXH64:
+		vh->v[0] = XXH_P1 + XXH_P2;
+		vh->v[1] = XXH_P2;
+		vh->v[2] = 0;
+		vh->v[3] = -XXH_P1;
+		break;
+	default:
+		break;
+	}
+}
+
+void
+VHASH_Update(struct vhash *vh, const void *p, size_t len)
+{
+
+	switch (vh->type) {
+	case VHASH_CRC32C:
+		vh->crc = crc32c(vh->crc, p, len);
+		break;
+	case VHASH_XXH64:
+		xxh64_update(vh, p, len);
+		break;
+	default:
+		break;
+	}
+}
+
+uint64_t
+VHASH_Final(const struct vhash *vh)
+{
+
+	switch (vh->type) {
+	case VHASH_CRC32C:
+		return (vh->crc ^ 0xffffffff);
+	case VHASH_XXH64:
+		return (xxh64_final(vh));
+	default:
+		return (0);
+	}
+}
@@ -0,0 +1,52 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Incremental body digests.  CRC32C uses the SSE4.2 crc32 instruction
+ * when the CPU has it.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum vhash_type {
+	VHASH_NONE = 0,
+	VHASH_CRC32C,
+	VHASH_XXH64,
+};
+
+struct vhash {
+	enum vhash_type		type;
+	uint32_t		crc;
+	uint64_t		v[4];
+	uint64_t		total;
+	unsigned char		mem[32];
+	unsigned		memsize;
+};
+
+void		VHASH_Init(void);
+enum vhash_type	VHASH_Type(const char *name);
+void		VHASH_Start(struct vhash *vh, enum vhash_type type);
+void		VHASH_Update(struct vhash *vh, const void *p, size_t len);
+uint64_t	VHASH_Final(const struct vhash *vh);
@@ -0,0 +1,146 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "vhist.h"
+
+#define	VHIST_HALF		(1 << (VHIST_SUBBITS - 1))
+#define	VHIST_MAX		((1ULL << VHIST_MAXBITS) - 1)
+
+static unsigned
+vhist_index(uint64_t v)
+{
+	unsigned m;
+
+	if (v > VHIST_MAX)
+		v = VHIST_MAX;
+	if (v < (1 << VHIST_SUBBITS))
+		return (v);
+	m = 63 - __builtin_clzll(v);
+	return ((1 << VHIST_SUBBITS) + (m - VHIST_SUBBITS) * VHIST_HALF +
+	    (v >> (m - VHIST_SUBBITS + 1)) - VHIST_HALF);
+}
+
+/*
+ * The largest value that lands in bucket `idx'.
+ */
+
+static uint64_t
+vhist_value(unsigned idx)
+{
+	unsigned k, m;
+
+	if (idx < (1 << VHIST_SUBBITS))
+		return (idx);
+	k = idx - (1 << VHIST_SUBBITS);
+	m = VHIST_SUBBITS + k / VHIST_HALF;
+	return ((((uint64_t)(k % VHIST_HALF + VHIST_HALF) + 1) <<
+	    (m - VHIST_SUBBITS + 1)) - 1);
+}
+
+/*
+ * Only the owner may call this; readers copy the buckets racily and
+ * recount n from them, which is fine for whole 64-bit words.
+ */
+
+void
+VHIST_Add(struct vhist *h, uint64_t v)
+{
+
+	h->bucket[vhist_index(v)]++;
+	h->n++;
+}
+
+void
+VHIST_Merge(struct vhist *dst, const struct vhist *src)
+{
+	uint64_t b;
+	unsigned i;
+
+	for (i = 0; i < VHIST_NBUCKET; i++) {
+		b = src->bucket[i];
+		dst->bucket[i] += b;
+		dst->n += b;
+	}
+}
+
+void
+VHIST_Diff(struct vhist *dst, const struct vhist *now,
+    const struct vhist *prev)
+{
+	unsigned i;
+
+	dst->n = 0;
+	for (i = 0; i < VHIST_NBUCKET; i++) {
+		dst->bucket[i] = now->bucket[i] - prev->bucket[i];
+		dst->n += dst->bucket[i];
+	}
+}
+
+/*
+ * Returns the value at or below which `p' percent of the samples fall,
+ * rounded up to its bucket.  p = 100 gives the maximum.
+ */
+
+uint64_t
+VHIST_Percentile(const struct vhist *h, double p)
+{
+	uint64_t want, sum = 0;
+	unsigned i;
+
+	if (h->n == 0)
+		return (0);
+	want = (uint64_t)ceil(p / 100. * h->n);
+	if (want == 0)
+		want = 1;
+	if (want > h->n)
+		want = h->n;
+	for (i = 0; i < VHIST_NBUCKET; i++) {
+		sum += h->bucket[i];
+		if (sum >= want)
+			return (vhist_value(i));
+	}
+	return (VHIST_MAX);
+}
+
+/*
+ * Returns how many samples are no bigger than `v', as far as the
+ * buckets tell: a bucket only counts once all of it is at or below v.
+ */
+
+uint64_t
+VHIST_Count(const struct vhist *h, uint64_t v)
+{
+	uint64_t sum = 0;
+	unsigned i;
+
+	for (i = 0; i < VHIST_NBUCKET && vhist_value(i) <= v; i++)
+		sum += h->bucket[i];
+	return (sum);
+}
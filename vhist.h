@@ -0,0 +1,51 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Log-linear latency histograms in the spirit of HdrHistogram: values
+ * below 2^VHIST_SUBBITS get a bucket each, every power of two above
+ * that is split into 2^(VHIST_SUBBITS - 1) buckets, so the reported
+ * value is never more than 1/64 off.  Memory is fixed and recording
+ * is a couple of shifts and an increment.
+ */
+
+#include <stdint.h>
+
+#define	VHIST_SUBBITS		7
+#define	VHIST_MAXBITS		36		/* about 19 hours in usec */
+#define	VHIST_NBUCKET							\
+	((1 << VHIST_SUBBITS) +						\
+	 (VHIST_MAXBITS - VHIST_SUBBITS) * (1 << (VHIST_SUBBITS - 1)))
+
+struct vhist {
+	uint64_t		n;
+	uint64_t		bucket[VHIST_NBUCKET];
+};
+
+void		VHIST_Add(struct vhist *h, uint64_t v);
+void		VHIST_Merge(struct vhist *dst, const struct vhist *src);
+void		VHIST_Diff(struct vhist *dst, const struct vhist *now,
+		    const struct vhist *prev);
+uint64_t	VHIST_Percentile(const struct vhist *h, double p);
+uint64_t	VHIST_Count(const struct vhist *h, uint64_t v);
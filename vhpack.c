@@ -0,0 +1,809 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * The static table and the Huffman code are the ones from RFC 7541,
+ * appendices A and B.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "miniobj.h"
+#include "vas.h"
+#include "vhpack.h"
+
+/*--------------------------------------------------------------------
+ * The dynamic table.  Entries are appended to an arena twice the size
+ * of the table, which is compacted when the end is reached, so names
+ * and values are always contiguous.  ent[] is a ring, oldest first.
+ */
+
+#define	VHP_ENTOVERHEAD		32	/* RFC 7541 4.1 */
+#define	VHP_STATIC		61
+
+struct vhp_ent {
+	uint32_t		off;
+	uint32_t		nlen;
+	uint32_t		vlen;
+	uint32_t		nhash;
+	uint32_t		hash;
+};
+
+struct vhpack {
+	unsigned		magic;
+#define	VHPACK_MAGIC		0x5a1c93e7
+	unsigned		maxsize;	/* what we may be asked for */
+	unsigned		limit;		/* table size in force */
+	unsigned		minlimit;	/* lowest since last Begin */
+	unsigned		pending;	/* encoder owes a size update */
+	unsigned		size;
+
+	struct vhp_ent		*ent;
+	unsigned		nent;
+	unsigned		head;
+	unsigned		maxent;
+
+	char			*arena;
+	unsigned		asize;
+	unsigned		afree;
+
+	char			*scratch;
+	size_t			scratchlen;
+};
+
+static const struct {
+	const char		*name;
+	const char		*val;
+} vhp_static[VHP_STATIC] = {
+	{ ":authority",			"" },
+	{ ":method",			"GET" },
+	{ ":method",			"POST" },
+	{ ":path",			"/" },
+	{ ":path",			"/index.html" },
+	{ ":scheme",			"http" },
+	{ ":scheme",			"https" },
+	{ ":status",			"200" },
+	{ ":status",			"204" },
+	{ ":status",			"206" },
+	{ ":status",			"304" },
+	{ ":status",			"400" },
+	{ ":status",			"404" },
+	{ ":status",			"500" },
+	{ "accept-charset",		"" },
+	{ "accept-encoding",		"gzip, deflate" },
+	{ "accept-language",		"" },
+	{ "accept-ranges",		"" },
+	{ "accept",			"" },
+	{ "access-control-allow-origin", "" },
+	{ "age",			"" },
+	{ "allow",			"" },
+	{ "authorization",		"" },
+	{ "cache-control",		"" },
+	{ "content-disposition",	"" },
+	{ "content-encoding",		"" },
+	{ "content-language",		"" },
+	{ "content-length",		"" },
+	{ "content-location",		"" },
+	{ "content-range",		"" },
+	{ "content-type",		"" },
+	{ "cookie",			"" },
+	{ "date",			"" },
+	{ "etag",			"" },
+	{ "expect",			"" },
+	{ "expires",			"" },
+	{ "from",			"" },
+	{ "host",			"" },
+	{ "if-match",			"" },
+	{ "if-modified-since",		"" },
+	{ "if-none-match",		"" },
+	{ "if-range",			"" },
+	{ "if-unmodified-since",	"" },
+	{ "last-modified",		"" },
+	{ "link",			"" },
+	{ "location",			"" },
+	{ "max-forwards",		"" },
+	{ "proxy-authenticate",		"" },
+	{ "proxy-authorization",	"" },
+	{ "range",			"" },
+	{ "referer",			"" },
+	{ "refresh",			"" },
+	{ "retry-after",		"" },
+	{ "server",			"" },
+	{ "set-cookie",			"" },
+	{ "strict-transport-security",	"" },
+	{ "transfer-encoding",		"" },
+	{ "user-agent",			"" },
+	{ "vary",			"" },
+	{ "via",			"" },
+	{ "www-authenticate",		"" },
+};
+
+static struct vhp_ent		vhp_sent[VHP_STATIC];
+
+/*--------------------------------------------------------------------
+ * Huffman code
+ */
+
+static const uint32_t huf_code[256] = {
+	0x00001ff8, 0x007fffd8, 0x0fffffe2, 0x0fffffe3, 0x0fffffe4, 0x0fffffe5,
+	0x0fffffe6, 0x0fffffe7, 0x0fffffe8, 0x00ffffea, 0x3ffffffc, 0x0fffffe9,
+	0x0fffffea, 0x3ffffffd, 0x0fffffeb, 0x0fffffec, 0x0fffffed, 0x0fffffee,
+	0x0fffffef, 0x0ffffff0, 0x0ffffff1, 0x0ffffff2, 0x3ffffffe, 0x0ffffff3,
+	0x0ffffff4, 0x0ffffff5, 0x0ffffff6, 0x0ffffff7, 0x0ffffff8, 0x0ffffff9,
+	0x0ffffffa, 0x0ffffffb, 0x00000014, 0x000003f8, 0x000003f9, 0x00000ffa,
+	0x00001ff9, 0x00000015, 0x000000f8, 0x000007fa, 0x000003fa, 0x000003fb,
+	0x000000f9, 0x000007fb, 0x000000fa, 0x00000016, 0x00000017, 0x00000018,
+	0x00000000, 0x00000001, 0x00000002, 0x00000019, 0x0000001a, 0x0000001b,
+	0x0000001c, 0x0000001d, 0x0000001e, 0x0000001f, 0x0000005c, 0x000000fb,
+	0x00007ffc, 0x00000020, 0x00000ffb, 0x000003fc, 0x00001ffa, 0x00000021,
+	0x0000005d, 0x0000005e, 0x0000005f, 0x00000060, 0x00000061, 0x00000062,
+	0x00000063, 0x00000064, 0x00000065, 0x00000066, 0x00000067, 0x00000068,
+	0x00000069, 0x0000006a, 0x0000006b, 0x0000006c, 0x0000006d, 0x0000006e,
+	0x0000006f, 0x00000070, 0x00000071, 0x00000072, 0x000000fc, 0x00000073,
+	0x000000fd, 0x00001ffb, 0x0007fff0, 0x00001ffc, 0x00003ffc, 0x00000022,
+	0x00007ffd, 0x00000003, 0x00000023, 0x00000004, 0x00000024, 0x00000005,
+	0x00000025, 0x00000026, 0x00000027, 0x00000006, 0x00000074, 0x00000075,
+	0x00000028, 0x00000029, 0x0000002a, 0x00000007, 0x0000002b, 0x00000076,
+	0x0000002c, 0x00000008, 0x00000009, 0x0000002d, 0x00000077, 0x00000078,
+	0x00000079, 0x0000007a, 0x0000007b, 0x00007ffe, 0x000007fc, 0x00003ffd,
+	0x00001ffd, 0x0ffffffc, 0x000fffe6, 0x003fffd2, 0x000fffe7, 0x000fffe8,
+	0x003fffd3, 0x003fffd4, 0x003fffd5, 0x007fffd9, 0x003fffd6, 0x007fffda,
+	0x007fffdb, 0x007fffdc, 0x007fffdd, 0x007fffde, 0x00ffffeb, 0x007fffdf,
+	0x00ffffec, 0x00ffffed, 0x003fffd7, 0x007fffe0, 0x00ffffee, 0x007fffe1,
+	0x007fffe2, 0x007fffe3, 0x007fffe4, 0x001fffdc, 0x003fffd8, 0x007fffe5,
+	0x003fffd9, 0x007fffe6, 0x007fffe7, 0x00ffffef, 0x003fffda, 0x001fffdd,
+	0x000fffe9, 0x003fffdb, 0x003fffdc, 0x007fffe8, 0x007fffe9, 0x001fffde,
+	0x007fffea, 0x003fffdd, 0x003fffde, 0x00fffff0, 0x001fffdf, 0x003fffdf,
+	0x007fffeb, 0x007fffec, 0x001fffe0, 0x001fffe1, 0x003fffe0, 0x001fffe2,
+	0x007fffed, 0x003fffe1, 0x007fffee, 0x007fffef, 0x000fffea, 0x003fffe2,
+	0x003fffe3, 0x003fffe4, 0x007ffff0, 0x003fffe5, 0x003fffe6, 0x007ffff1,
+	0x03ffffe0, 0x03ffffe1, 0x000fffeb, 0x0007fff1, 0x003fffe7, 0x007ffff2,
+	0x003fffe8, 0x01ffffec, 0x03ffffe2, 0x03ffffe3, 0x03ffffe4, 0x07ffffde,
+	0x07ffffdf, 0x03ffffe5, 0x00fffff1, 0x01ffffed, 0x0007fff2, 0x001fffe3,
+	0x03ffffe6, 0x07ffffe0, 0x07ffffe1, 0x03ffffe7, 0x07ffffe2, 0x00fffff2,
+	0x001fffe4, 0x001fffe5, 0x03ffffe8, 0x03ffffe9, 0x0ffffffd, 0x07ffffe3,
+	0x07ffffe4, 0x07ffffe5, 0x000fffec, 0x00fffff3, 0x000fffed, 0x001fffe6,
+	0x003fffe9, 0x001fffe7, 0x001fffe8, 0x007ffff3, 0x003fffea, 0x003fffeb,
+	0x01ffffee, 0x01ffffef, 0x00fffff4, 0x00fffff5, 0x03ffffea, 0x007ffff4,
+	0x03ffffeb, 0x07ffffe6, 0x03ffffec, 0x03ffffed, 0x07ffffe7, 0x07ffffe8,
+	0x07ffffe9, 0x07ffffea, 0x07ffffeb, 0x0ffffffe, 0x07ffffec, 0x07ffffed,
+	0x07ffffee, 0x07ffffef, 0x07fffff0, 0x03ffffee,
+};
+
+static const uint8_t huf_len[256] = {
+	13, 23, 28, 28, 28, 28, 28, 28, 28, 24, 30, 28, 28, 30, 28, 28,
+	28, 28, 28, 28, 28, 28, 30, 28, 28, 28, 28, 28, 28, 28, 28, 28,
+	6, 10, 10, 12, 13, 6, 8, 11, 10, 10, 8, 11, 8, 6, 6, 6,
+	5, 5, 5, 6, 6, 6, 6, 6, 6, 6, 7, 8, 15, 6, 12, 10,
+	13, 6, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7, 7,
+	7, 7, 7, 7, 7, 7, 7, 7, 8, 7, 8, 13, 19, 13, 14, 6,
+	15, 5, 6, 5, 6, 5, 6, 6, 6, 5, 7, 7, 6, 6, 6, 5,
+	6, 7, 6, 5, 5, 6, 7, 7, 7, 7, 7, 15, 11, 14, 13, 28,
+	20, 22, 20, 20, 22, 22, 22, 23, 22, 23, 23, 23, 23, 23, 24, 23,
+	24, 24, 22, 23, 24, 23, 23, 23, 23, 21, 22, 23, 22, 23, 23, 24,
+	22, 21, 20, 22, 22, 23, 23, 21, 23, 22, 22, 24, 21, 22, 23, 23,
+	21, 21, 22, 21, 23, 22, 23, 23, 20, 22, 22, 22, 23, 22, 22, 23,
+	26, 26, 20, 19, 22, 23, 22, 25, 26, 26, 26, 27, 27, 26, 24, 25,
+	19, 21, 26, 27, 27, 26, 27, 24, 21, 21, 26, 26, 28, 27, 27, 27,
+	20, 24, 20, 21, 22, 21, 21, 23, 22, 22, 25, 25, 24, 24, 26, 23,
+	26, 27, 26, 26, 27, 27, 27, 27, 27, 28, 27, 27, 27, 27, 27, 26,
+};
+
+#define	HUF_EOS_CODE		0x3fffffff
+#define	HUF_EOS_LEN		30
+
+/*
+ * The decoder eats four bits at a time.  huf_fsm[state][nibble] says
+ * where that leaves us in the code tree, and which symbol was completed
+ * on the way; codes are at least five bits so there's never more than
+ * one.  A string may only end in a state reached by at most seven one
+ * bits from the root, i.e. padding with the start of EOS.
+ */
+
+#define	HUF_EMIT		(1 << 0)
+#define	HUF_ACCEPT		(1 << 1)
+#define	HUF_FAIL		(1 << 2)
+
+struct huf_state {
+	uint8_t			next;
+	uint8_t			flags;
+	uint8_t			sym;
+};
+
+static struct huf_state		huf_fsm[256][16];
+
+static void
+huf_build(void)
+{
+	int16_t tree[256][2];
+	int8_t ones[256];
+	struct huf_state *hs;
+	uint32_t code;
+	unsigned len;
+	int b, i, k, n, nib, nnode, st, sym;
+
+	memset(tree, 0, sizeof tree);
+	ones[0] = 0;
+	nnode = 1;
+	for (sym = 0; sym <= 256; sym++) {
+		code = sym < 256 ? huf_code[sym] : HUF_EOS_CODE;
+		len = sym < 256 ? huf_len[sym] : HUF_EOS_LEN;
+		for (n = 0, i = len - 1; i > 0; i--) {
+			b = (code >> i) & 1;
+			if (tree[n][b] == 0) {
+				assert(nnode < 256);
+				tree[n][b] = nnode;
+				ones[nnode] = (b && ones[n] >= 0) ?
+				    ones[n] + 1 : -1;
+				nnode++;
+			}
+			n = tree[n][b];
+			assert(n > 0);
+		}
+		AZ(tree[n][code & 1]);
+		tree[n][code & 1] = -(sym + 1);
+	}
+	assert(nnode == 256);
+
+	for (n = 0; n < 256; n++) {
+		for (nib = 0; nib < 16; nib++) {
+			hs = &huf_fsm[n][nib];
+			st = n;
+			for (i = 3; i >= 0; i--) {
+				k = tree[st][(nib >> i) & 1];
+				assert(k != 0);
+				if (k > 0) {
+					st = k;
+					continue;
+				}
+				if (k == -257) {
+					hs->flags = HUF_FAIL;
+					break;
+				}
+				hs->sym = -k - 1;
+				hs->flags |= HUF_EMIT;
+				st = 0;
+			}
+			if (hs->flags & HUF_FAIL)
+				continue;
+			hs->next = st;
+			if (ones[st] >= 0 && ones[st] <= 7)
+				hs->flags |= HUF_ACCEPT;
+		}
+	}
+}
+
+static ssize_t
+huf_decode(const uint8_t *p, size_t len, char *dst)
+{
+	const struct huf_state *hs;
+	char *d = dst;
+	unsigned st = 0, acc = HUF_ACCEPT;
+
+	for (; len > 0; len--, p++) {
+		hs = &huf_fsm[st][*p >> 4];
+		if (hs->flags & HUF_FAIL)
+			return (-1);
+		if (hs->flags & HUF_EMIT)
+			*d++ = hs->sym;
+		hs = &huf_fsm[hs->next][*p & 0xf];
+		if (hs->flags & HUF_FAIL)
+			return (-1);
+		if (hs->flags & HUF_EMIT)
+			*d++ = hs->sym;
+		st = hs->next;
+		acc = hs->flags & HUF_ACCEPT;
+	}
+	if (!acc)
+		return (-1);
+	return (d - dst);
+}
+
+static size_t
+huf_size(const char *s, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	size_t bits = 0;
+
+	while (len-- > 0)
+		bits += huf_len[*p++];
+	return ((bits + 7) / 8);
+}
+
+static void
+huf_encode(const char *s, size_t len, uint8_t *d)
+{
+	const unsigned char *p = (const unsigned char *)s;
+	uint64_t acc = 0;
+	unsigned n = 0;
+
+	while (len-- > 0) {
+		acc = (acc << huf_len[*p]) | huf_code[*p];
+		n += huf_len[*p++];
+		while (n >= 8) {
+			n -= 8;
+			*d++ = acc >> n;
+		}
+	}
+	if (n > 0)
+		*d = (acc << (8 - n)) | (0xff >> n);
+}
+
+/*--------------------------------------------------------------------
+ * Integers with an N bit prefix (RFC 7541 5.1)
+ */
+
+#define	VHP_INTMAX		(1U << 28)
+
+static ssize_t
+vhp_int_encode(uint8_t *d, size_t len, unsigned bits, uint8_t first,
+    uint32_t v)
+{
+	unsigned max = (1U << bits) - 1;
+	size_t l = 0;
+
+	if (len == 0)
+		return (-1);
+	if (v < max) {
+		d[0] = first | v;
+		return (1);
+	}
+	d[l++] = first | max;
+	for (v -= max; v >= 0x80; v >>= 7) {
+		if (l == len)
+			return (-1);
+		d[l++] = (v & 0x7f) | 0x80;
+	}
+	if (l == len)
+		return (-1);
+	d[l++] = v;
+	return (l);
+}
+
+static int
+vhp_int_decode(const uint8_t **pp, const uint8_t *e, unsigned bits,
+    uint32_t *v)
+{
+	const uint8_t *p = *pp;
+	unsigned max = (1U << bits) - 1, shift = 0;
+
+	assert(p < e);
+	*v = *p++ & max;
+	if (*v == max) {
+		do {
+			if (p == e || shift > 21)
+				return (-1);
+			*v += (uint32_t)(*p & 0x7f) << shift;
+			shift += 7;
+		} while (*p++ & 0x80);
+		if (*v > VHP_INTMAX)
+			return (-1);
+	}
+	*pp = p;
+	return (0);
+}
+
+/*--------------------------------------------------------------------*/
+
+static uint32_t
+vhp_hash(uint32_t h, const char *p, size_t len)
+{
+
+	while (len-- > 0)
+		h = (h ^ (unsigned char)*p++) * 16777619;
+	return (h);
+}
+
+#define	VHP_HASHINIT		2166136261U
+
+static struct vhp_ent *
+vhp_ent(const struct vhpack *hp, unsigned k)
+{
+
+	/* k == 0 is the newest entry */
+	assert(k < hp->nent);
+	return (&hp->ent[(hp->head + hp->nent - 1 - k) % hp->maxent]);
+}
+
+static void
+vhp_evict(struct vhpack *hp, unsigned limit)
+{
+	struct vhp_ent *e;
+
+	while (hp->size > limit) {
+		assert(hp->nent > 0);
+		e = &hp->ent[hp->head];
+		hp->size -= e->nlen + e->vlen + VHP_ENTOVERHEAD;
+		hp->head = (hp->head + 1) % hp->maxent;
+		hp->nent--;
+	}
+	if (hp->nent == 0)
+		hp->afree = 0;
+}
+
+static void
+vhp_compact(struct vhpack *hp)
+{
+	struct vhp_ent *e;
+	unsigned k, off = 0;
+
+	for (k = hp->nent; k-- > 0; ) {
+		e = vhp_ent(hp, k);
+		memmove(hp->arena + off, hp->arena + e->off,
+		    e->nlen + e->vlen);
+		e->off = off;
+		off += e->nlen + e->vlen;
+	}
+	hp->afree = off;
+}
+
+/*
+ * name and val must not point into the table.
+ */
+
+static void
+vhp_insert(struct vhpack *hp, const char *name, size_t nlen,
+    const char *val, size_t vlen)
+{
+	struct vhp_ent *e;
+	size_t sz = nlen + vlen + VHP_ENTOVERHEAD;
+
+	if (sz > hp->limit) {
+		vhp_evict(hp, 0);
+		return;
+	}
+	vhp_evict(hp, hp->limit - sz);
+	if (hp->afree + nlen + vlen > hp->asize)
+		vhp_compact(hp);
+	assert(hp->afree + nlen + vlen <= hp->asize);
+	assert(hp->nent < hp->maxent);
+	e = &hp->ent[(hp->head + hp->nent) % hp->maxent];
+	e->off = hp->afree;
+	e->nlen = nlen;
+	e->vlen = vlen;
+	e->nhash = vhp_hash(VHP_HASHINIT, name, nlen);
+	e->hash = vhp_hash(e->nhash, val, vlen);
+	memcpy(hp->arena + hp->afree, name, nlen);
+	memcpy(hp->arena + hp->afree + nlen, val, vlen);
+	hp->afree += nlen + vlen;
+	hp->nent++;
+	hp->size += sz;
+}
+
+static int
+vhp_lookup(const struct vhpack *hp, uint32_t idx, const char **name,
+    size_t *nlen, const char **val, size_t *vlen)
+{
+	const struct vhp_ent *e;
+
+	if (idx == 0)
+		return (-1);
+	if (idx <= VHP_STATIC) {
+		*name = vhp_static[idx - 1].name;
+		*nlen = vhp_sent[idx - 1].nlen;
+		*val = vhp_static[idx - 1].val;
+		*vlen = vhp_sent[idx - 1].vlen;
+		return (0);
+	}
+	idx -= VHP_STATIC + 1;
+	if (idx >= hp->nent)
+		return (-1);
+	e = vhp_ent(hp, idx);
+	*name = hp->arena + e->off;
+	*nlen = e->nlen;
+	*val = hp->arena + e->off + e->nlen;
+	*vlen = e->vlen;
+	return (0);
+}
+
+/*--------------------------------------------------------------------*/
+
+void
+VHPACK_Init(void)
+{
+	int i;
+
+	huf_build();
+	for (i = 0; i < VHP_STATIC; i++) {
+		vhp_sent[i].nlen = strlen(vhp_static[i].name);
+		vhp_sent[i].vlen = strlen(vhp_static[i].val);
+		vhp_sent[i].nhash = vhp_hash(VHP_HASHINIT, vhp_static[i].name,
+		    vhp_sent[i].nlen);
+		vhp_sent[i].hash = vhp_hash(vhp_sent[i].nhash,
+		    vhp_static[i].val, vhp_sent[i].vlen);
+	}
+}
+
+struct vhpack *
+VHPACK_New(unsigned maxsize)
+{
+	struct vhpack *hp;
+
+	ALLOC_OBJ(hp, VHPACK_MAGIC);
+	XXXAN(hp);
+	hp->maxsize = hp->limit = hp->minlimit = maxsize;
+	hp->maxent = maxsize / VHP_ENTOVERHEAD + 1;
+	hp->ent = calloc(hp->maxent, sizeof *hp->ent);
+	XXXAN(hp->ent);
+	hp->asize = 2 * maxsize;
+	hp->arena = malloc(hp->asize);
+	XXXAN(hp->arena);
+	return (hp);
+}
+
+void
+VHPACK_Free(struct vhpack *hp)
+{
+
+	CHECK_OBJ_NOTNULL(hp, VHPACK_MAGIC);
+	free(hp->ent);
+	free(hp->arena);
+	free(hp->scratch);
+	FREE_OBJ(hp);
+}
+
+/*
+ * The table size the other side allows us; the next header block
+ * starts by telling it what we picked.
+ */
+
+void
+VHPACK_SetLimit(struct vhpack *hp, unsigned limit)
+{
+
+	CHECK_OBJ_NOTNULL(hp, VHPACK_MAGIC);
+	if (limit > hp->maxsize)
+		limit = hp->maxsize;
+	if (limit == hp->limit)
+		return;
+	vhp_evict(hp, limit);
+	hp->limit = limit;
+	if (limit < hp->minlimit)
+		hp->minlimit = limit;
+	hp->pending = 1;
+}
+
+/*--------------------------------------------------------------------
+ * Decoding.  Huffman strings are expanded into a scratch buffer which
+ * also gets a copy of indexed names, as the insert may evict them.
+ */
+
+static int
+vhp_string(const uint8_t **pp, const uint8_t *e, char **dst,
+    const char **s, size_t *len)
+{
+	const uint8_t *p = *pp;
+	uint32_t l;
+	ssize_t i;
+	int huf;
+
+	if (p == e)
+		return (-1);
+	huf = *p & 0x80;
+	if (vhp_int_decode(&p, e, 7, &l) || l > e - p)
+		return (-1);
+	if (huf) {
+		i = huf_decode(p, l, *dst);
+		if (i < 0)
+			return (-1);
+		*s = *dst;
+		*len = i;
+		*dst += i;
+	} else {
+		*s = (const char *)p;
+		*len = l;
+	}
+	*pp = p + l;
+	return (0);
+}
+
+int
+VHPACK_Decode(struct vhpack *hp, const void *ptr, size_t len,
+    vhpack_hdr_f *func, void *priv)
+{
+	const uint8_t *p = ptr, *e = p + len;
+	const char *name, *val;
+	size_t nlen, vlen, need;
+	uint32_t idx;
+	unsigned bits;
+	char *d;
+	int index;
+
+	CHECK_OBJ_NOTNULL(hp, VHPACK_MAGIC);
+	need = len * 8 / 5 + hp->maxsize + 1;
+	if (hp->scratchlen < need) {
+		free(hp->scratch);
+		hp->scratch = malloc(need);
+		XXXAN(hp->scratch);
+		hp->scratchlen = need;
+	}
+	while (p < e) {
+		d = hp->scratch;
+		if (*p & 0x80) {
+			/* Indexed Header Field */
+			if (vhp_int_decode(&p, e, 7, &idx) ||
+			    vhp_lookup(hp, idx, &name, &nlen, &val, &vlen))
+				return (-1);
+			func(priv, name, nlen, val, vlen);
+			continue;
+		}
+		if ((*p & 0xe0) == 0x20) {
+			/* Dynamic Table Size Update */
+			if (vhp_int_decode(&p, e, 5, &idx) ||
+			    idx > hp->maxsize)
+				return (-1);
+			vhp_evict(hp, idx);
+			hp->limit = idx;
+			continue;
+		}
+		/* Literal, with incremental indexing or not */
+		index = *p & 0x40;
+		bits = index ? 6 : 4;
+		if (vhp_int_decode(&p, e, bits, &idx))
+			return (-1);
+		if (idx != 0) {
+			if (vhp_lookup(hp, idx, &name, &nlen, &val, &vlen))
+				return (-1);
+			memcpy(d, name, nlen);
+			name = d;
+			d += nlen;
+		} else if (vhp_string(&p, e, &d, &name, &nlen))
+			return (-1);
+		if (vhp_string(&p, e, &d, &val, &vlen))
+			return (-1);
+		func(priv, name, nlen, val, vlen);
+		if (index)
+			vhp_insert(hp, name, nlen, val, vlen);
+	}
+	return (0);
+}
+
+/*--------------------------------------------------------------------
+ * Encoding.  Whatever isn't in a table yet is added to ours, unless
+ * it would push out a good part of what's there; the same headers go
+ * out on every request, so from the second one on they're an index.
+ */
+
+ssize_t
+VHPACK_Begin(struct vhpack *hp, void *dst, size_t len)
+{
+	uint8_t *d = dst;
+	ssize_t i, l = 0;
+
+	CHECK_OBJ_NOTNULL(hp, VHPACK_MAGIC);
+	if (!hp->pending)
+		return (0);
+	if (hp->minlimit < hp->limit) {
+		i = vhp_int_encode(d, len, 5, 0x20, hp->minlimit);
+		if (i < 0)
+			return (-1);
+		l += i;
+	}
+	i = vhp_int_encode(d + l, len - l, 5, 0x20, hp->limit);
+	if (i < 0)
+		return (-1);
+	l += i;
+	hp->pending = 0;
+	hp->minlimit = hp->limit;
+	return (l);
+}
+
+static ssize_t
+vhp_string_encode(uint8_t *d, size_t len, const char *s, size_t slen)
+{
+	size_t hl = huf_size(s, slen);
+	ssize_t i;
+
+	if (hl < slen) {
+		i = vhp_int_encode(d, len, 7, 0x80, hl);
+		if (i < 0 || len - i < hl)
+			return (-1);
+		huf_encode(s, slen, d + i);
+		return (i + hl);
+	}
+	i = vhp_int_encode(d, len, 7, 0, slen);
+	if (i < 0 || len - i < slen)
+		return (-1);
+	memcpy(d + i, s, slen);
+	return (i + slen);
+}
+
+static ssize_t
+vhp_encode(struct vhpack *hp, void *dst, size_t len, const char *name,
+    size_t nlen, const char *val, size_t vlen, int mayindex)
+{
+	const struct vhp_ent *e;
+	uint8_t *d = dst;
+	uint32_t nhash, hash, nidx = 0;
+	unsigned k, index;
+	ssize_t i, l;
+
+	CHECK_OBJ_NOTNULL(hp, VHPACK_MAGIC);
+	nhash = vhp_hash(VHP_HASHINIT, name, nlen);
+	hash = vhp_hash(nhash, val, vlen);
+	for (k = 0; k < VHP_STATIC; k++) {
+		e = &vhp_sent[k];
+		if (e->nhash != nhash || e->nlen != nlen ||
+		    memcmp(vhp_static[k].name, name, nlen))
+			continue;
+		if (e->hash == hash && e->vlen == vlen &&
+		    !memcmp(vhp_static[k].val, val, vlen))
+			return (vhp_int_encode(d, len, 7, 0x80, k + 1));
+		if (nidx == 0)
+			nidx = k + 1;
+	}
+	for (k = 0; k < hp->nent; k++) {
+		e = vhp_ent(hp, k);
+		if (e->nhash != nhash || e->nlen != nlen ||
+		    memcmp(hp->arena + e->off, name, nlen))
+			continue;
+		if (e->hash == hash && e->vlen == vlen &&
+		    !memcmp(hp->arena + e->off + nlen, val, vlen))
+			return (vhp_int_encode(d, len, 7, 0x80,
+			    VHP_STATIC + 1 + k));
+		if (nidx == 0)
+			nidx = VHP_STATIC + 1 + k;
+	}
+	index = mayindex && (nlen + vlen + VHP_ENTOVERHEAD) * 4 <= hp->limit;
+	l = vhp_int_encode(d, len, index ? 6 : 4, index ? 0x40 : 0, nidx);
+	if (l < 0)
+		return (-1);
+	if (nidx == 0) {
+		i = vhp_string_encode(d + l, len - l, name, nlen);
+		if (i < 0)
+			return (-1);
+		l += i;
+	}
+	i = vhp_string_encode(d + l, len - l, val, vlen);
+	if (i < 0)
+		return (-1);
+	l += i;
+	if (index)
+		vhp_insert(hp, name, nlen, val, vlen);
+	return (l);
+}
+
+ssize_t
+VHPACK_Encode(struct vhpack *hp, void *dst, size_t len, const char *name,
+    size_t nlen, const char *val, size_t vlen)
+{
+
+	return (vhp_encode(hp, dst, len, name, nlen, val, vlen, 1));
+}
+
+/*
+ * For a value which changes every time: never added to the dynamic
+ * table, where it would only push out the entries worth keeping.
+ */
+
+ssize_t
+VHPACK_EncodeLiteral(struct vhpack *hp, void *dst, size_t len,
+    const char *name, size_t nlen, const char *val, size_t vlen)
+{
+
+	return (vhp_encode(hp, dst, len, name, nlen, val, vlen, 0));
+}
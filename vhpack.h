@@ -0,0 +1,53 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * HPACK (RFC 7541) header compression for the HTTP/2 client.  One
+ * struct vhpack is one direction of a connection: the decoder follows
+ * the table the server builds, the encoder keeps ours.
+ */
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define	VHPACK_TABLESIZE	4096	/* SETTINGS_HEADER_TABLE_SIZE default */
+
+struct vhpack;
+
+typedef void vhpack_hdr_f(void *priv, const char *name, size_t nlen,
+    const char *val, size_t vlen);
+
+void		VHPACK_Init(void);
+struct vhpack	*VHPACK_New(unsigned maxsize);
+void		VHPACK_Free(struct vhpack *hp);
+void		VHPACK_SetLimit(struct vhpack *hp, unsigned limit);
+int		VHPACK_Decode(struct vhpack *hp, const void *ptr, size_t len,
+		    vhpack_hdr_f *func, void *priv);
+ssize_t		VHPACK_Begin(struct vhpack *hp, void *dst, size_t len);
+ssize_t		VHPACK_Encode(struct vhpack *hp, void *dst, size_t len,
+		    const char *name, size_t nlen, const char *val,
+		    size_t vlen);
+ssize_t		VHPACK_EncodeLiteral(struct vhpack *hp, void *dst,
+		    size_t len, const char *name, size_t nlen,
+		    const char *val, size_t vlen);
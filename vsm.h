@@ -0,0 +1,78 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Layout of the shared memory segment varnishperf -n publishes its
+ * counters in, after Varnish's VSM.  The segment describes itself: a
+ * directory entry per stats.h field tells a reader what the value in
+ * the same slot is, so varnishperfstat needn't be built from the same
+ * stats.h.  The scheduler thread rewrites the values once a second;
+ * seq is odd while it does, readers copy and retry if seq moved.
+ */
+
+#include <stdint.h>
+
+#define	VSM_MAGIC		"VPSTAT01"
+#define	VSM_VERSION		1
+#define	VSM_PREFIX		"varnishperf."	/* in /dev/shm */
+#define	VSM_MAXPCT		8
+
+struct vsm_head {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		nfield;
+	uint32_t		nlat;
+	uint32_t		npct;
+	int64_t			pid;
+	double			t_boot;
+	double			t_update;	/* of the values below */
+	double			pct[VSM_MAXPCT];	/* percentiles kept */
+	char			pctname[VSM_MAXPCT][8];
+	uint64_t		off_field;	/* struct vsm_field[nfield] */
+	uint64_t		off_val;	/* union vsm_val[nfield] */
+	uint64_t		off_lat;	/* struct vsm_lat[nlat] */
+	volatile uint32_t	seq;
+	uint32_t		done;		/* the run is over */
+};
+
+struct vsm_field {
+	char			name[32];
+	char			type;		/* 'u' uint64_t, 'd' double */
+	char			flag;		/* 'c' counter, 'g' gauge */
+	char			spare[6];
+	char			desc[96];
+	char			unit[24];
+};
+
+union vsm_val {
+	uint64_t		u;
+	double			d;
+};
+
+/* The latency percentiles of the last second, in msec */
+struct vsm_lat {
+	char			name[16];
+	uint64_t		n;
+	double			ms[VSM_MAXPCT];
+};
@@ -0,0 +1,177 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * What reading the clock costs, per call, for the clocks varnishperf
+ * could take its timestamps from.  VTIM_mono() is only this cheap when
+ * the kernel's clocksource can be read from the vDSO (tsc, mostly).
+ *
+ *	$ make bench && ./vtim_bench [loops]
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+#include "vtim.h"
+
+/* What varnishperf used before: CLOCK_REALTIME as a double. */
+static double
+tim_real(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	return (ts.tv_sec + 1e-9 * ts.tv_nsec);
+}
+
+static uint64_t
+tim_coarse(void)
+{
+	struct timespec ts;
+
+	(void)clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static uint64_t
+bench_real(long loops)
+{
+	double sum = 0.;
+	long i;
+
+	for (i = 0; i < loops; i++)
+		sum += tim_real();
+	return ((uint64_t)sum);
+}
+
+static uint64_t
+bench_mono(long loops)
+{
+	uint64_t sum = 0;
+	long i;
+
+	for (i = 0; i < loops; i++)
+		sum += VTIM_mono();
+	return (sum);
+}
+
+static uint64_t
+bench_coarse(long loops)
+{
+	uint64_t sum = 0;
+	long i;
+
+	for (i = 0; i < loops; i++)
+		sum += tim_coarse();
+	return (sum);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static uint64_t
+bench_rdtsc(long loops)
+{
+	uint64_t sum = 0;
+	long i;
+
+	for (i = 0; i < loops; i++)
+		sum += __rdtsc();
+	return (sum);
+}
+
+/* CPUID 0x80000007, EDX bit 8: the TSC ticks at a constant rate */
+static int
+tsc_invariant(void)
+{
+	unsigned a, b, c, d;
+
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d))
+		return (0);
+	return ((d >> 8) & 1);
+}
+#endif
+
+static void
+run(const char *name, uint64_t (*func)(long), long loops)
+{
+	volatile uint64_t sink;
+	uint64_t t0, t1;
+
+	t0 = VTIM_mono();
+	sink = func(loops);
+	t1 = VTIM_mono();
+	printf("  %-22s %8.1f ns/call\n", name, (double)(t1 - t0) / loops);
+	(void)sink;
+}
+
+static void
+resolution(const char *name, clockid_t id)
+{
+	struct timespec ts;
+
+	if (clock_getres(id, &ts) == 0)
+		printf("  %-22s %8ld ns resolution\n", name,
+		    (long)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+int
+main(int argc, char **argv)
+{
+	char cs[64] = "unknown";
+	FILE *fp;
+	long loops = 10000000;
+
+	if (argc > 1)
+		loops = strtol(argv[1], NULL, 0);
+	if (loops <= 0)
+		loops = 1;
+	fp = fopen("/sys/devices/system/clocksource/clocksource0/"
+	    "current_clocksource", "r");
+	if (fp != NULL) {
+		if (fgets(cs, sizeof(cs), fp) != NULL)
+			cs[strcspn(cs, "\n")] = '\0';
+		(void)fclose(fp);
+	}
+	printf("clocksource %s", cs);
+#if defined(__x86_64__) || defined(__i386__)
+	printf(", invariant TSC %s", tsc_invariant() ? "yes" : "no");
+#endif
+	printf("\n");
+
+	run("TIM_real (REALTIME)", bench_real, loops);
+	run("VTIM_mono (MONOTONIC)", bench_mono, loops);
+	run("MONOTONIC_COARSE", bench_coarse, loops);
+#if defined(__x86_64__) || defined(__i386__)
+	run("rdtsc", bench_rdtsc, loops);
+#endif
+	resolution("MONOTONIC", CLOCK_MONOTONIC);
+	resolution("MONOTONIC_COARSE", CLOCK_MONOTONIC_COARSE);
+	return (0);
+}
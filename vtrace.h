@@ -0,0 +1,67 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Layout of the -T request trace files.  Each worker thread maps one
+ * file: a header followed by a ring of fixed size records it fills in
+ * place, so tracing costs a few stores per request.  Fields are in host
+ * byte order and times are nanoseconds since the epoch, 0 if the
+ * request never got that far.
+ */
+
+#include <stdint.h>
+
+#define	VTRACE_MAGIC		"VPTRACE1"
+#define	VTRACE_VERSION		1
+
+struct vtrace_hdr {
+	char			magic[8];
+	uint32_t		version;
+	uint32_t		recsize;	/* sizeof(struct vtrace_rec) */
+	uint64_t		nrec;		/* slots in the ring */
+	uint64_t		head;		/* records ever written */
+	uint64_t		sample;		/* 1 in this many requests */
+	uint32_t		worker;
+	uint32_t		spare0;
+	uint64_t		t_open;
+	uint64_t		spare1;
+};
+
+struct vtrace_rec {
+	uint64_t		t_start;	/* session was started */
+	uint64_t		t_tx;		/* request was sent */
+	uint64_t		t_connect;	/* connected, 0 if pooled */
+	uint64_t		t_fb;		/* first response byte */
+	uint64_t		t_body;		/* last body byte */
+	uint64_t		bytes;		/* body bytes received */
+	uint32_t		seq;		/* worker's request number */
+	uint16_t		status;
+	uint16_t		url;		/* url, in urlfile order */
+	uint16_t		tgt;		/* target, in breakdown order */
+	uint16_t		worker;
+	uint16_t		error;		/* errno, 0 if it went fine */
+	uint16_t		flags;
+#define	VTRACE_F_TLS		(1 << 0)
+#define	VTRACE_F_H2		(1 << 1)
+};
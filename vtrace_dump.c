@@ -0,0 +1,116 @@
+/*-
+ * Copyright (c) 2012 by Weongyo Jeong <weongyo@gmail.com>.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ *
+ * Turns the request trace rings varnishperf -T leaves behind into CSV,
+ * oldest record of each file first.
+ *
+ *	$ ./vtrace_dump /tmp/trace.* > trace.csv
+ */
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "vtrace.h"
+
+static int
+dump(const char *path)
+{
+	const struct vtrace_hdr *h;
+	const struct vtrace_rec *rec, *r;
+	struct stat st;
+	uint64_t i, n;
+	void *p;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return (1);
+	}
+	if ((size_t)st.st_size < sizeof(*h)) {
+		fprintf(stderr, "%s: too short\n", path);
+		(void)close(fd);
+		return (1);
+	}
+	p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void)close(fd);
+	if (p == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap: %s\n", path, strerror(errno));
+		return (1);
+	}
+	h = p;
+	if (memcmp(h->magic, VTRACE_MAGIC, sizeof(h->magic)) ||
+	    h->version != VTRACE_VERSION ||
+	    h->recsize != sizeof(struct vtrace_rec) || h->nrec == 0 ||
+	    sizeof(*h) + h->nrec * h->recsize > (uint64_t)st.st_size) {
+		fprintf(stderr, "%s: not a version %d trace file\n", path,
+		    VTRACE_VERSION);
+		(void)munmap(p, st.st_size);
+		return (1);
+	}
+	rec = (const struct vtrace_rec *)(const void *)(h + 1);
+	n = h->head < h->nrec ? h->head : h->nrec;
+	if (h->head > h->nrec)
+		fprintf(stderr, "%s: ring wrapped, %" PRIu64 " oldest of %"
+		    PRIu64 " records lost\n", path, h->head - h->nrec,
+		    h->head);
+	for (i = 0; i < n; i++) {
+		r = &rec[(h->head - n + i) % h->nrec];
+		printf("%u,%u,%u,%u,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%"
+		    PRIu64 ",%" PRIu64 ",%u,%" PRIu64 ",%u,%s%s%s\n",
+		    r->worker, r->seq, r->url, r->tgt, r->t_start, r->t_tx,
+		    r->t_connect, r->t_fb, r->t_body, r->status, r->bytes,
+		    r->error, r->flags & VTRACE_F_TLS ? "tls" : "",
+		    (r->flags & (VTRACE_F_TLS | VTRACE_F_H2)) ==
+		    (VTRACE_F_TLS | VTRACE_F_H2) ? "+" : "",
+		    r->flags & VTRACE_F_H2 ? "h2" : "");
+	}
+	(void)munmap(p, st.st_size);
+	return (0);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int i, ret = 0;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: vtrace_dump file ...\n");
+		exit(1);
+	}
+	printf("worker,seq,url,target,t_start,t_tx,t_connect,t_fb,t_body,"
+	    "status,bytes,error,flags\n");
+	for (i = 1; i < argc; i++)
+		ret |= dump(argv[i]);
+	return (ret);
+}